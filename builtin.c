@@ -22,6 +22,7 @@
 #include "cons.h"
 #include "frame.h"
 #include "help.h"
+#include "pool.h"
 #include "song.h"
 #include "user.h"
 #include "smf.h"
@@ -33,6 +34,7 @@
 #include "builtin.h"
 #include "version.h"
 #include "undo.h"
+#include "hist.h"
 
 unsigned
 blt_info(struct exec *o, struct data **r)
@@ -42,6 +44,28 @@ blt_info(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_meminfo(struct exec *o, struct data **r)
+{
+	pool_dumpstats();
+	mem_dumpstats();
+	return 1;
+}
+
+unsigned
+blt_timeinfo(struct exec *o, struct data **r)
+{
+	hist_dumpstats();
+	return 1;
+}
+
+unsigned
+blt_timeclr(struct exec *o, struct data **r)
+{
+	hist_clear();
+	return 1;
+}
+
 unsigned
 blt_shut(struct exec *o, struct data **r)
 {
@@ -172,10 +196,20 @@ blt_exec(struct exec *o, struct data **r)
 {
 	char *filename;
 
+	unsigned res;
+
 	if (!exec_lookupstring(o, "filename", &filename)) {
 		return 0;
 	}
-	return exec_runfile(o, filename);
+
+	/*
+	 * the script's builtins take the lock themselves, don't hold
+	 * it for the whole script
+	 */
+	mux_mdep_unlock();
+	res = exec_runfile(o, filename);
+	mux_mdep_lock();
+	return res;
 }
 
 unsigned
@@ -894,11 +928,28 @@ blt_save(struct exec *o, struct data **r)
 	if (!exec_lookupstring(o, "filename", &filename)) {
 		return 0;
 	}
+	if (!song_try_save(usong))
+		return 0;
 	song_stop(usong);
 	song_save(usong, filename);
 	return 1;
 }
 
+unsigned
+blt_bsave(struct exec *o, struct data **r)
+{
+	char *filename;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	if (!song_try_save(usong))
+		return 0;
+	song_stop(usong);
+	song_bsave(usong, filename);
+	return 1;
+}
+
 unsigned
 blt_load(struct exec *o, struct data **r)
 {
@@ -940,6 +991,8 @@ blt_export(struct exec *o, struct data **r)
 	if (!exec_lookupstring(o, "filename", &filename)) {
 		return 0;
 	}
+	if (!song_try_save(usong))
+		return 0;
 	song_stop(usong);
 	return song_exportsmf(usong, filename);
 }
@@ -964,6 +1017,26 @@ blt_import(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_stream(struct exec *o, struct data **r)
+{
+	char *filename;
+	struct song *sng;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	song_stop(usong);
+	sng = song_streamsmf(filename);
+	if (sng == NULL) {
+		return 0;
+	}
+	song_delete(usong);
+	usong = sng;
+	cons_putpos(usong->curpos, 0, 0);
+	return 1;
+}
+
 unsigned
 blt_idle(struct exec *o, struct data **r)
 {
@@ -1014,6 +1087,46 @@ blt_rec(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_render(struct exec *o, struct data **r)
+{
+	char *filename;
+	unsigned long start, nsec;
+
+	if (!exec_lookupstring(o, "filename", &filename)) {
+		return 0;
+	}
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (mididev_clksrc || mididev_mtcsrc) {
+		logx(1, "%s: can't render with external clock", o->procname);
+		return 0;
+	}
+	if (usong->tap_mode) {
+		logx(1, "%s: can't render in tap mode", o->procname);
+		return 0;
+	}
+	if (usong->loop) {
+		logx(1, "%s: can't render in loop mode", o->procname);
+		return 0;
+	}
+	if (!mux_fwopen(filename)) {
+		return 0;
+	}
+	start = hist_mdep_nsec();
+	song_play(usong);
+	while (!usong->complete && mux_fwstep())
+		song_fillcb(usong);
+	nsec = hist_mdep_nsec() - start;
+	logx(1, "%s: %lums rendered in %lums, %lu events, %llu events/s",
+	    o->procname, mux_wallclock / 24000, nsec / 1000000, mux_fwnev,
+	    1000000000ULL * mux_fwnev / (nsec > 0 ? nsec : 1));
+	song_stop(usong);
+	mux_fwclose();
+	return 1;
+}
+
 unsigned
 blt_stop(struct exec *o, struct data **r)
 {
@@ -1961,7 +2074,7 @@ blt_tpaste(struct exec *o, struct data **r)
 	track_init(&copy);
 	track_move(&usong->clip, tic, ~0U, &usong->curev, &copy, 1, 0);
 	if (!track_isempty(&copy)) {
-		copy.first->delta += tic2;
+		track_shift(&copy, tic2);
 		undo_track_save(usong, &t->track, o->procname, t->name.str);
 		track_merge(&t->track, &copy);
 		undo_track_diff(usong);
@@ -3632,6 +3745,57 @@ blt_dclkrate(struct exec *o, struct data **r)
 	return 1;
 }
 
+unsigned
+blt_dbaud(struct exec *o, struct data **r)
+{
+	long unit, baud;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookuplong(o, "devnum", &unit) ||
+	    !exec_lookuplong(o, "baud", &baud)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+		logx(1, "%s: bad device number", o->procname);
+		return 0;
+	}
+	if (baud != 0 && (baud < 1200 || baud > 10000000)) {
+		logx(1, "%s: baud rate must be 0 or in the 1200..10000000 range",
+		    o->procname);
+		return 0;
+	}
+	/* 1 start bit, 8 data bits, 1 stop bit */
+	mididev_byunit[unit]->orate = baud / 10;
+	return 1;
+}
+
+unsigned
+blt_dlookahead(struct exec *o, struct data **r)
+{
+	long unit, ms;
+
+	if (!song_try_mode(usong, 0)) {
+		return 0;
+	}
+	if (!exec_lookuplong(o, "devnum", &unit) ||
+	    !exec_lookuplong(o, "msecs", &ms)) {
+		return 0;
+	}
+	if (unit < 0 || unit >= DEFAULT_MAXNDEVS || !mididev_byunit[unit]) {
+		logx(1, "%s: bad device number", o->procname);
+		return 0;
+	}
+	if (ms < 0 || ms > 1000) {
+		logx(1, "%s: latency must be in the 0..1000ms range",
+		    o->procname);
+		return 0;
+	}
+	mididev_byunit[unit]->olookahead = 24000UL * ms;
+	return 1;
+}
+
 unsigned
 blt_dinfo(struct exec *o, struct data **r)
 {
@@ -3714,6 +3878,18 @@ blt_dinfo(struct exec *o, struct data **r)
 	textout_putlong(tout, mididev_byunit[unit]->ticrate);
 	textout_putstr(tout, "\n");
 
+	if (dev->olookahead > 0) {
+		textout_putstr(tout, "lookahead ");
+		textout_putlong(tout, dev->olookahead / 24000);
+		textout_putstr(tout, "\n");
+	}
+
+	if (dev->orate > 0) {
+		textout_putstr(tout, "baud ");
+		textout_putlong(tout, dev->orate * 10);
+		textout_putstr(tout, "\n");
+	}
+
 	textout_shiftleft(tout);
 	textout_putstr(tout, "}\n");
 	return 1;
@@ -21,6 +21,9 @@ struct exec;
 struct data;
 
 unsigned blt_info(struct exec *, struct data **);
+unsigned blt_meminfo(struct exec *, struct data **);
+unsigned blt_timeinfo(struct exec *, struct data **);
+unsigned blt_timeclr(struct exec *, struct data **);
 unsigned blt_shut(struct exec *, struct data **);
 unsigned blt_proclist(struct exec *, struct data **);
 unsigned blt_builtinlist(struct exec *, struct data **);
@@ -62,12 +65,15 @@ unsigned blt_getmute(struct exec *, struct data **);
 unsigned blt_ls(struct exec *, struct data **);
 unsigned blt_save(struct exec *, struct data **);
 unsigned blt_load(struct exec *, struct data **);
+unsigned blt_bsave(struct exec *, struct data **);
 unsigned blt_reset(struct exec *, struct data **);
 unsigned blt_export(struct exec *, struct data **);
 unsigned blt_import(struct exec *, struct data **);
+unsigned blt_stream(struct exec *, struct data **);
 unsigned blt_idle(struct exec *, struct data **);
 unsigned blt_play(struct exec *, struct data **);
 unsigned blt_rec(struct exec *, struct data **);
+unsigned blt_render(struct exec *, struct data **);
 unsigned blt_stop(struct exec *, struct data **);
 unsigned blt_tempo(struct exec *, struct data **);
 unsigned blt_mins(struct exec *, struct data **);
@@ -176,6 +182,8 @@ unsigned blt_dmmctx(struct exec *, struct data **);
 unsigned blt_dclkrx(struct exec *, struct data **);
 unsigned blt_dclktx(struct exec *, struct data **);
 unsigned blt_dclkrate(struct exec *, struct data **);
+unsigned blt_dbaud(struct exec *, struct data **);
+unsigned blt_dlookahead(struct exec *, struct data **);
 unsigned blt_dinfo(struct exec *, struct data **);
 unsigned blt_dixctl(struct exec *, struct data **);
 unsigned blt_doxctl(struct exec *, struct data **);
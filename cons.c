@@ -31,6 +31,10 @@ cons_putpos(unsigned measure, unsigned beat, unsigned tic)
 {
 	char buf[32];
 
+#ifdef USE_RTTHREAD
+	if (cons_mdep_defer(NULL, measure, beat, tic))
+		return;
+#endif
 	if (user_flag_verb) {
 		fprintf(stdout, "+pos %u %u %u\n", measure, beat, tic);
 		fflush(stdout);
@@ -47,6 +51,10 @@ cons_putpos(unsigned measure, unsigned beat, unsigned tic)
 void
 cons_puttag(char *tag)
 {
+#ifdef USE_RTTHREAD
+	if (cons_mdep_defer(tag, 0, 0, 0))
+		return;
+#endif
 	if (user_flag_verb) {
 		fprintf(stdout, "+%s\n", tag);
 		fflush(stdout);
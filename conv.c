@@ -62,8 +62,8 @@ conv_setctl(struct statelist *slist, struct ev *ev)
 		}
 	}
 	i = state_new();
-	statelist_add(slist, i);
 	i->ev = *ev;
+	statelist_add(slist, i);
 }
 
 /*
@@ -57,9 +57,10 @@
 #define TPU_MAX			(96 * 40)
 
 /*
- * maximum number of midi devices supported by midish
+ * maximum number of midi devices supported by midish, the unit
+ * number must fit in the ``dev'' field of struct ev (8 bits)
  */
-#define DEFAULT_MAXNDEVS	16
+#define DEFAULT_MAXNDEVS	128
 
 /*
  * maximum number of instruments
@@ -67,28 +68,29 @@
 #define DEFAULT_MAXNCHANS	(DEFAULT_MAXNDEVS * 16)
 
 /*
- * maximum number of events
+ * number of preallocated events; pools grow beyond this
+ * size on demand, but never shrink below it
  */
 #define DEFAULT_MAXNSEQEVS	400000
 
 /*
- * maximum number of tracks
+ * number of preallocated track pointers (roughly number of tracks)
  */
 #define DEFAULT_MAXNSEQPTRS	200
 
 /*
- * maximum number of filter states (roughly maximum number of
- * simultaneous notes
+ * number of preallocated filter states (roughly maximum number of
+ * simultaneous notes)
  */
 #define DEFAULT_MAXNSTATES	10000
 
 /*
- * maximum number of system exclusive messages
+ * number of preallocated system exclusive messages
  */
 #define DEFAULT_MAXNSYSEXS	2000
 
 /*
- * maximum number of chunks (each sysex is a set of chunks)
+ * number of preallocated chunks (each sysex is a set of chunks)
  */
 #define DEFAULT_MAXNCHUNKS	(DEFAULT_MAXNSYSEXS * 2)
 
@@ -155,6 +155,11 @@
 #include "frame.h"
 #include "pool.h"
 
+/*
+ * number of events between positions saved in the time index
+ */
+#define SEQPTR_IDXSTEP	512
+
 struct pool seqptr_pool;
 
 void
@@ -180,6 +185,7 @@ seqptr_new(struct track *t)
 
 	sp = (struct seqptr *)pool_new(&seqptr_pool);
 	statelist_init(&sp->statelist);
+	sp->track = t;
 	sp->link = NULL;
 	sp->pos = t->first;
 	sp->delta = 0;
@@ -265,6 +271,7 @@ seqptr_evdel(struct seqptr *sp, struct statelist *slist)
 		st = statelist_update(slist, &sp->pos->ev);
 	else
 		st = NULL;
+	track_idxclear(sp->track);
 	next = sp->pos->next;
 	next->delta += sp->pos->delta;
 	/* unlink and delete sp->pos */
@@ -286,6 +293,7 @@ seqptr_evput(struct seqptr *sp, struct ev *ev)
 	struct seqptr *link;
 	struct seqev *se;
 
+	track_idxclear(sp->track);
 	se = seqev_new();
 	se->ev = *ev;
 	se->delta = sp->delta;
@@ -343,6 +351,8 @@ seqptr_ticdel(struct seqptr *sp, unsigned max, struct statelist *slist)
 	if (ntics > max) {
 		ntics = max;
 	}
+	if (ntics > 0)
+		track_idxclear(sp->track);
 	sp->pos->delta -= ntics;
 	if (slist != NULL && max > 0) {
 		statelist_outdate(slist);
@@ -369,6 +379,7 @@ seqptr_ticput(struct seqptr *sp, unsigned ntics)
 	if (ntics == 0)
 		return;
 
+	track_idxclear(sp->track);
 	sp->pos->delta += ntics;
 	sp->delta += ntics;
 	sp->tic += ntics;
@@ -385,15 +396,38 @@ seqptr_ticput(struct seqptr *sp, unsigned ntics)
 /*
  * move forward 'ntics', if the end-of-track is reached then return
  * the number of reamaining tics. Used for reading on a track
+ *
+ * If the seqptr is at the beginning of the track, we start from the
+ * closest position of the time index of the track, and we add new
+ * positions to the index as we move beyond it, so next seeks on the
+ * same track will be faster. Positions are only saved after tics are
+ * skipped, before events of the new tic are read, so the result is
+ * the same as if the whole track was read.
  */
 unsigned
 seqptr_skip(struct seqptr *sp, unsigned ntics)
 {
-	unsigned delta;
+	struct track *t = sp->track;
+	struct trackidx *idx;
+	unsigned delta, nev, useidx;
+
+	useidx = (sp->tic == 0 && sp->delta == 0 && sp->pos == t->first &&
+	    sp->link == NULL && sp->statelist.first == NULL);
+	if (useidx) {
+		idx = track_idxfind(t, ntics);
+		if (idx != NULL) {
+			statelist_copy(&sp->statelist, &idx->statelist);
+			sp->pos = idx->pos;
+			sp->delta = idx->delta;
+			sp->tic = idx->tic;
+			ntics -= idx->tic;
+		}
+	}
 
+	nev = 0;
 	while (ntics > 0) {
 		while (seqptr_evget(sp))
-			; /* nothing */
+			nev++;
 		delta = seqptr_ticskip(sp, ntics);
 		/*
 		 * check if the end of the track was reached
@@ -401,6 +435,20 @@ seqptr_skip(struct seqptr *sp, unsigned ntics)
 		if (delta == 0)
 			break;
 		ntics -= delta;
+
+		/*
+		 * save the current position in the index
+		 */
+		if (useidx && nev >= SEQPTR_IDXSTEP &&
+		    (t->nidx == 0 || t->idx[t->nidx - 1].tic < sp->tic)) {
+			idx = track_idxadd(t);
+			idx->tic = sp->tic;
+			idx->pos = sp->pos;
+			idx->delta = sp->delta;
+			statelist_init(&idx->statelist);
+			statelist_copy(&idx->statelist, &sp->statelist);
+			nev = 0;
+		}
 	}
 	return ntics;
 }
@@ -437,6 +485,7 @@ seqptr_framerm(struct seqptr *sp, struct track *f)
 		panic();
 	}
 
+	track_idxclear(sp->track);
 	track_clear(f);
 	fpos = f->first;
 
@@ -512,6 +561,9 @@ seqptr_frameadd(struct seqptr *sp, struct track *f)
 	struct seqev *se, *spos, **save_pos;
 	unsigned ntics, offs, sdelta, save_delta;
 
+	track_idxclear(sp->track);
+	track_idxclear(f);
+
 	/*
 	 * Save current postition.
 	 */
@@ -635,6 +687,7 @@ seqptr_rmlast(struct seqptr *sp, struct state **pst)
 	 * 'prev' the event before 'cur' that belongs to the same
 	 * frame
 	 */
+	track_idxclear(sp->track);
 	i = cur = st->pos;
 	prev = NULL;
 	for (;;) {
@@ -692,6 +745,7 @@ seqptr_rmprev(struct seqptr *sp, struct state **pst)
 	 * start a the first event of the frame and iterate until the
 	 * current postion removing all events of the frame.
 	 */
+	track_idxclear(sp->track);
 	i = st->pos;
 	for (;;) {
 		if (state_match(st, &i->ev)) {
@@ -1708,6 +1762,121 @@ seqptr_skipmeasure(struct seqptr *sp, unsigned meas)
 	return 0;
 }
 
+/*
+ * build the measure and tempo maps of the given track, if not built
+ * yet. Measures are walked the same way as seqptr_skipmeasure() does,
+ * so time signature changes take effect at the beginning of the next
+ * measure. Tempo changes take effect immediately.
+ */
+void
+track_mapbuild(struct track *t)
+{
+	struct seqptr *sp;
+	struct trackmeas *me;
+	struct tracktempo *te;
+	unsigned m, bpm, tpb;
+	unsigned long usec24;
+
+	if (t->nmeas > 0)
+		return;
+
+	/*
+	 * there's at most one entry per meta-event, plus
+	 * the initial one
+	 */
+	t->meas = xmalloc((track_evcnt(t, EV_TIMESIG) + 1) *
+	    sizeof(struct trackmeas), "trackmeas");
+	t->tempo = xmalloc((track_evcnt(t, EV_TEMPO) + 1) *
+	    sizeof(struct tracktempo), "tracktempo");
+
+	me = NULL;
+	sp = seqptr_new(t);
+	for (m = 0; ; m++) {
+		while (seqptr_evget(sp))
+			; /* nothing */
+		seqptr_getsign(sp, &bpm, &tpb);
+		if (me == NULL || me->bpm != bpm || me->tpb != tpb) {
+			me = &t->meas[t->nmeas++];
+			me->meas = m;
+			me->tic = sp->tic;
+			me->bpm = bpm;
+			me->tpb = tpb;
+		}
+		if (seqptr_eot(sp) || seqptr_skip(sp, bpm * tpb) > 0)
+			break;
+	}
+	seqptr_del(sp);
+
+	te = t->tempo;
+	te->tic = 0;
+	te->usec24 = DEFAULT_USEC24;
+	te->time = 0;
+	t->ntempo = 1;
+	sp = seqptr_new(t);
+	for (;;) {
+		while (seqptr_evget(sp))
+			; /* nothing */
+		seqptr_gettempo(sp, &usec24);
+		if (usec24 != te->usec24) {
+			if (te->tic != sp->tic) {
+				te[1].time = te->time +
+				    (unsigned long long)(sp->tic - te->tic) *
+				    te->usec24;
+				te++;
+				te->tic = sp->tic;
+				t->ntempo++;
+			}
+			te->usec24 = usec24;
+		}
+		if (seqptr_eot(sp))
+			break;
+		(void)seqptr_ticskip(sp, ~0U);
+	}
+	seqptr_del(sp);
+}
+
+/*
+ * return the measure map entry of the given measure
+ */
+static struct trackmeas *
+track_measfind(struct track *t, unsigned meas)
+{
+	unsigned lo, hi, mid;
+
+	track_mapbuild(t);
+	lo = 1;
+	hi = t->nmeas;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t->meas[mid].meas <= meas)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return &t->meas[lo - 1];
+}
+
+/*
+ * return the tempo map entry of the given tic
+ */
+static struct tracktempo *
+track_tempofind(struct track *t, unsigned tic)
+{
+	unsigned lo, hi, mid;
+
+	track_mapbuild(t);
+	lo = 1;
+	hi = t->ntempo;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t->tempo[mid].tic <= tic)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return &t->tempo[lo - 1];
+}
+
 /*
  * convert a measure number to a tic number using
  * meta-events from the given track
@@ -1715,13 +1884,11 @@ seqptr_skipmeasure(struct seqptr *sp, unsigned meas)
 unsigned
 track_findmeasure(struct track *t, unsigned m)
 {
-	struct seqptr *sp;
+	struct trackmeas *me;
 	unsigned tic;
 
-	sp = seqptr_new(t);
-	tic  = seqptr_skipmeasure(sp, m);
-	tic += sp->tic;
-	seqptr_del(sp);
+	me = track_measfind(t, m);
+	tic = me->tic + (m - me->meas) * me->bpm * me->tpb;
 
 #ifdef FRAME_DEBUG
 	logx(1, "%s: %u -> %u", __func__, m, tic);
@@ -1738,26 +1905,86 @@ void
 track_timeinfo(struct track *t, unsigned meas, unsigned *abs,
     unsigned long *usec24, unsigned *bpm, unsigned *tpb)
 {
-	struct seqptr *sp;
+	struct trackmeas *me;
 	unsigned tic;
 
-	sp = seqptr_new(t);
-	tic  = seqptr_skipmeasure(sp, meas);
-	tic += sp->tic;
-
-	/*
-	 * move to the last event, so all meta events enter the
-	 * state list
-	 */
-	while (seqptr_evget(sp)) {
-		/* nothing */
-	}
-	if (abs) {
+	me = track_measfind(t, meas);
+	tic = me->tic + (meas - me->meas) * me->bpm * me->tpb;
+	if (abs)
 		*abs = tic;
-	}
-	seqptr_getsign(sp, bpm, tpb);
-	seqptr_gettempo(sp, usec24);
-	seqptr_del(sp);
+	if (usec24)
+		*usec24 = track_tempofind(t, tic)->usec24;
+	if (bpm)
+		*bpm = me->bpm;
+	if (tpb)
+		*tpb = me->tpb;
+}
+
+/*
+ * convert the given absolute tic to a measure:beat:tic position
+ */
+void
+track_measinfo(struct track *t, unsigned abs,
+    unsigned *meas, unsigned *beat, unsigned *tic)
+{
+	struct trackmeas *me;
+	unsigned lo, hi, mid, delta, tpm;
+
+	track_mapbuild(t);
+	lo = 1;
+	hi = t->nmeas;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t->meas[mid].tic <= abs)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	me = &t->meas[lo - 1];
+	tpm = me->bpm * me->tpb;
+	delta = abs - me->tic;
+	*meas = me->meas + delta / tpm;
+	*beat = (delta % tpm) / me->tpb;
+	*tic = delta % me->tpb;
+}
+
+/*
+ * return the absolute time (in 24-th of microsecond) of the given tic
+ * and, if not NULL, store the tempo at this tic in 'usec24'
+ */
+unsigned long long
+track_tictime(struct track *t, unsigned tic, unsigned long *usec24)
+{
+	struct tracktempo *te;
+
+	te = track_tempofind(t, tic);
+	if (usec24)
+		*usec24 = te->usec24;
+	return te->time + (unsigned long long)(tic - te->tic) * te->usec24;
+}
+
+/*
+ * return the last tic starting at or before the given absolute time
+ * (in 24-th of microsecond)
+ */
+unsigned
+track_timetic(struct track *t, unsigned long long time)
+{
+	struct tracktempo *te;
+	unsigned lo, hi, mid;
+
+	track_mapbuild(t);
+	lo = 1;
+	hi = t->ntempo;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t->tempo[mid].time <= time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	te = &t->tempo[lo - 1];
+	return te->tic + (time - te->time) / te->usec24;
 }
 
 /*
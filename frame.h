@@ -21,6 +21,7 @@
 
 struct seqptr {
 	struct statelist statelist;
+	struct track *track;		/* track we're walking */
 	struct seqptr *link;		/* opposite direction seqptr */
 	struct seqev *pos;		/* next event (current position) */
 	unsigned delta;			/* tics until the next event */
@@ -56,6 +57,11 @@ void	 track_merge(struct track *, struct track *);
 unsigned track_findmeasure(struct track *, unsigned);
 void	 track_timeinfo(struct track *, unsigned, unsigned *,
 			unsigned long *, unsigned *, unsigned *);
+void	 track_mapbuild(struct track *);
+void	 track_measinfo(struct track *, unsigned,
+			unsigned *, unsigned *, unsigned *);
+unsigned long long track_tictime(struct track *, unsigned, unsigned long *);
+unsigned track_timetic(struct track *, unsigned long long);
 void     track_settempo(struct track *, unsigned, unsigned);
 void     track_move(struct track *, unsigned, unsigned,
 		    struct evspec *, struct track *,
@@ -486,6 +486,17 @@ struct help help_list[] = {
 	"\n"
 	"Stop performance and release MIDI devices."},
 
+	{"render",
+	"render filename\n"
+	"\n"
+	"Play the song from the current position to its end as fast as "
+	"possible, using a virtual clock instead of the real-time one. MIDI "
+	"devices are not opened; instead, the data that would be sent to "
+	"them is written to the given file, one line per write, each "
+	"starting with the virtual time in microseconds and the device "
+	"number. Display the rendered duration, the time it took and the "
+	"number of events per second."},
+
 	{"ev",
 	"ev evspec\n"
 	"\n"
@@ -698,7 +709,15 @@ struct help help_list[] = {
 	"load filename\n"
 	"\n"
 	"Load the song from the given file. The file name is a "
-	"quoted string. The current song will be overwritten."},
+	"quoted string. The current song will be overwritten. "
+	"Both the text format and the binary format are accepted."},
+
+	{"bsave",
+	"bsave filename\n"
+	"\n"
+	"Save the song into the given file, in binary format. The file "
+	"name is a quoted string. Binary files are not human readable "
+	"but are much faster to load."},
 
 	{"reset",
 	"reset\n"
@@ -719,6 +738,15 @@ struct help help_list[] = {
 	"is a quoted string. The current song will be overwritten. "
 	"Only MIDI file formats 0 and 1 are supported."},
 
+	{"stream",
+	"stream filename\n"
+	"\n"
+	"Replace the song by an empty one that plays the given standard "
+	"MIDI file. Tracks are read from the file during playback instead "
+	"of being imported, so large files start playing immediately. "
+	"Only the tempo map and the sysex messages are loaded in the song, "
+	"which can't be saved or exported."},
+
 	{"u",
 	"u\n"
 	"\n"
@@ -749,7 +777,14 @@ struct help help_list[] = {
 	"If nil is given instead of the path, then the port is not "
 	"connected to any existing port}, this allows other ALSA sequencer "
 	"clients to subscribe to it and to provide events to midish or to "
-	"consume events midish sends to the port."},
+	"consume events midish sends to the port.\n"
+	"\n"
+	"The \"null\" and \"loop\" paths designate built-in devices that "
+	"need no MIDI hardware. The null device discards output. The loop "
+	"device, if opened in rw mode, sends output back to its input; the "
+	"time between each input and the next output is stored in the loop "
+	"histogram displayed by timeinfo. Both display the number of bytes "
+	"written when they are closed."},
 
 	{"ddel",
 	"ddel devnum\n"
@@ -779,7 +814,10 @@ struct help help_list[] = {
 	"\n"
 	"Configure the given devices to transmit MIDI clock information "
 	"(MIDI ticks, MIDI start and MIDI stop events). Useful to "
-	"synchronize an external sequencer to midish."},
+	"synchronize an external sequencer to midish. Events sent "
+	"to ALSA devices transmitting the clock are then passed as "
+	"bytes rather than as sequencer events, to keep them ordered "
+	"after the clock ticks."},
 
 	{"dclkrx",
 	"dclkrx devnum\n"
@@ -797,6 +835,24 @@ struct help help_list[] = {
 	"MIDI device. Default value is 96 ticks. This is the standard MIDI "
 	"value and its not recommended to change it."},
 
+	{"dbaud",
+	"dbaud devnum baud\n"
+	"\n"
+	"Set the bit rate of the MIDI port, ex. 31250 for a DIN port. "
+	"Then, bender, aftertouch and continuous controller changes are "
+	"sent only when the port is not busy with other events, and the "
+	"values that couldn't be sent yet are replaced by newer ones. "
+	"Use 0 for unlimited rate (the default)."},
+
+	{"dlookahead",
+	"dlookahead devnum msecs\n"
+	"\n"
+	"Send events to the device the given number of milliseconds "
+	"ahead, with the time they must be played, so their timing "
+	"doesn't depend on midish being scheduled on time. All output, "
+	"including the MIDI thru, is delayed by this amount. "
+	"Only ALSA devices support it. Use 0 to disable (the default)."},
+
 	{"dinfo",
 	"dinfo devnum\n"
 	"\n"
@@ -921,6 +977,30 @@ struct help help_list[] = {
 	"Display the list of built-in and user-defined procedures and global "
 	"variables."},
 
+	{"meminfo",
+	"meminfo\n"
+	"\n"
+	"Display memory usage of each pool and of each type of dynamically "
+	"allocated object: current and maximum usage, and number of "
+	"allocations since startup and since the last call."},
+
+	{"timeinfo",
+	"timeinfo\n"
+	"\n"
+	"Display timing histograms of the real-time path: lateness of "
+	"processed ticks (ticlate), time spent per tick in playing "
+	"tracks (ticplay), in the output mixer (putev) and in writing "
+	"the output of the ticks to devices (flush), and input to "
+	"output time of loop devices (loop). For each, display the "
+	"number of samples, the average and the maximum in "
+	"microseconds, then the count of samples in each non-empty "
+	"power-of-two bucket."},
+
+	{"timeclr",
+	"timeclr\n"
+	"\n"
+	"Reset timing histograms displayed by timeinfo."},
+
 	{"print",
 	"print value\n"
 	"\n"
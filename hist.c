@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * timing histograms of the real-time path: how late ticks are
+ * processed and how long each stage takes per tick.
+ *
+ * Stages add the time they spend to the 'acc' field of their
+ * histogram (see HIST_ACC); the accumulated time is turned into a
+ * sample at the end of each tick. Nothing is allocated, so it's safe
+ * to use from the real-time path.
+ */
+
+#include "utils.h"
+#include "hist.h"
+
+struct hist hist_tab[HIST_NUM] = {
+	{"ticlate"},
+	{"ticplay"},
+	{"putev"},
+	{"flush"},
+	{"loop"}
+};
+
+unsigned hist_ticked = 0;		/* ticks processed since last flush */
+
+/*
+ * add a sample, in microseconds, to the given histogram
+ */
+void
+hist_put(unsigned i, unsigned long usec)
+{
+	struct hist *h = &hist_tab[i];
+	unsigned b;
+
+	for (b = 0; usec >= (1UL << b) && b < HIST_NBUCKET - 1; b++)
+		; /* nothing */
+	h->bucket[b]++;
+	h->cnt++;
+	h->sum += usec;
+	if (h->max < usec)
+		h->max = usec;
+}
+
+/*
+ * called before a tick is processed: drop time accumulated
+ * outside ticks (ex. by events from the input)
+ */
+void
+hist_ticstart(void)
+{
+	unsigned i;
+
+	for (i = 0; i < HIST_NUM; i++)
+		hist_tab[i].acc = 0;
+}
+
+/*
+ * called after a tick is processed, store accumulated times. Output
+ * is written once all ticks are processed, so flush time is stored
+ * later by hist_flushend()
+ */
+void
+hist_ticend(void)
+{
+	unsigned i;
+
+	for (i = HIST_TICPLAY; i <= HIST_PUTEV; i++)
+		hist_put(i, hist_tab[i].acc / 1000);
+	hist_ticked = 1;
+}
+
+/*
+ * called after deferred output is flushed, store the flush time if
+ * ticks were processed since the last call
+ */
+void
+hist_flushend(void)
+{
+	if (hist_ticked) {
+		hist_put(HIST_FLUSH, hist_tab[HIST_FLUSH].acc / 1000);
+		hist_ticked = 0;
+	}
+	hist_tab[HIST_FLUSH].acc = 0;
+}
+
+/*
+ * reset all histograms
+ */
+void
+hist_clear(void)
+{
+	struct hist *h;
+	unsigned b;
+
+	for (h = hist_tab; h != hist_tab + HIST_NUM; h++) {
+		h->acc = h->cnt = h->max = 0;
+		h->sum = 0;
+		for (b = 0; b < HIST_NBUCKET; b++)
+			h->bucket[b] = 0;
+	}
+}
+
+/*
+ * display all histograms, skipping empty buckets
+ */
+void
+hist_dumpstats(void)
+{
+	struct hist *h;
+	unsigned b;
+
+	logx(1, "%-8s %10s %10s %10s", "name", "count", "avg_us", "max_us");
+	for (h = hist_tab; h != hist_tab + HIST_NUM; h++) {
+		logx(1, "%-8s %10lu %10lu %10lu", h->name, h->cnt,
+		    h->cnt > 0 ? (unsigned long)(h->sum / h->cnt) : 0, h->max);
+	}
+	logx(1, "%-8s %10s %10s %10s", "name", "from_us", "to_us", "count");
+	for (h = hist_tab; h != hist_tab + HIST_NUM; h++) {
+		for (b = 0; b < HIST_NBUCKET; b++) {
+			if (h->bucket[b] == 0)
+				continue;
+			if (b == 0) {
+				logx(1, "%-8s %10s %10s %10lu",
+				    h->name, "0", "1", h->bucket[b]);
+			} else if (b == HIST_NBUCKET - 1) {
+				logx(1, "%-8s %10lu %10s %10lu", h->name,
+				    1UL << (b - 1), "-", h->bucket[b]);
+			} else {
+				logx(1, "%-8s %10lu %10lu %10lu", h->name,
+				    1UL << (b - 1), 1UL << b, h->bucket[b]);
+			}
+		}
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MIDISH_HIST_H
+#define MIDISH_HIST_H
+
+/*
+ * histogram bucket 0 counts values below 1us, bucket i > 0 counts
+ * values in the [2^(i-1), 2^i) us range, the last bucket counts
+ * everything above
+ */
+#define HIST_NBUCKET	24
+
+/*
+ * measured quantities
+ */
+#define HIST_TICLATE	0	/* tick lateness */
+#define HIST_TICPLAY	1	/* song_ticplay() duration per tick */
+#define HIST_PUTEV	2	/* mixout_putev() duration per tick */
+#define HIST_FLUSH	3	/* mux_flush() duration after ticks */
+#define HIST_LOOP	4	/* loop device input to output time */
+#define HIST_NUM	5
+
+struct hist {
+	char *name;
+	unsigned long acc;		/* ns spent in this tick */
+	unsigned long cnt;		/* number of samples */
+	unsigned long max;		/* largest sample, in us */
+	unsigned long long sum;		/* sum of samples, in us */
+	unsigned long bucket[HIST_NBUCKET];
+};
+
+extern struct hist hist_tab[HIST_NUM];
+
+void hist_put(unsigned, unsigned long);
+void hist_ticstart(void);
+void hist_ticend(void);
+void hist_flushend(void);
+void hist_clear(void);
+void hist_dumpstats(void);
+
+/*
+ * the following is defined in mdep.c, and returns a monotonic time
+ * in nanoseconds, it's used to measure short durations only
+ */
+unsigned long hist_mdep_nsec(void);
+
+/*
+ * add the time elapsed since 'start' to the per tick accumulator
+ */
+#define HIST_ACC(i, start) \
+	(hist_tab[i].acc += hist_mdep_nsec() - (start))
+
+#endif /* MIDISH_HIST_H */
@@ -15,6 +15,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "utils.h"
@@ -37,9 +38,36 @@ main(int argc, char **argv)
 {
 	int ch;
 	unsigned exitcode;
+#ifdef USE_RTTHREAD
+	char *end;
+	long val;
+#define OPTS "a:bvr:"
+#else
+#define OPTS "bv"
+#endif
 
-	while ((ch = getopt(argc, argv, "bv")) != -1) {
+	while ((ch = getopt(argc, argv, OPTS)) != -1) {
 		switch (ch) {
+#ifdef USE_RTTHREAD
+		case 'a':
+			val = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' ||
+			    val < 0 || val > 1023) {
+				fprintf(stderr, "%s: bad cpu number\n", optarg);
+				return 1;
+			}
+			mux_mdep_rtcpu = val;
+			break;
+		case 'r':
+			val = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' ||
+			    val < 1 || val > 99) {
+				fprintf(stderr, "%s: bad priority\n", optarg);
+				return 1;
+			}
+			mux_mdep_rtprio = val;
+			break;
+#endif
 		case 'b':
 			user_flag_batch = 1;
 			break;
@@ -54,7 +82,11 @@ main(int argc, char **argv)
 	argv += optind;
 	if (argc >= 1) {
 	err:
+#ifdef USE_RTTHREAD
+		fputs("usage: midish [-bv] [-a cpu] [-r priority]\n", stderr);
+#else
 		fputs("usage: midish [-bv]\n", stderr);
+#endif
 		return 0;
 	}
 
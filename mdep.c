@@ -18,10 +18,20 @@
  * machine and OS dependent code
  */
 
+#if defined(USE_RTTHREAD) && defined(__linux__)
+#define _GNU_SOURCE		/* for pthread_setaffinity_np() */
+#endif
+
 #include <sys/param.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef USE_TIMERFD
+#include <sys/timerfd.h>
+#endif
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
 #include <dirent.h>
 #ifdef __APPLE__
 #include <mach/mach_time.h>
@@ -36,6 +46,10 @@
 #include <errno.h>
 #include <limits.h>
 #include <time.h>
+#ifdef USE_RTTHREAD
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "defs.h"
 #include "mux.h"
@@ -45,6 +59,7 @@
 #include "exec.h"
 #include "tty.h"
 #include "utils.h"
+#include "hist.h"
 
 #define TIMER_USEC	1000
 
@@ -57,10 +72,99 @@
 #endif
 
 #define MIDI_BUFSIZE	1024
-#define MAXFDS		(DEFAULT_MAXNDEVS + 1)
+#define MAXFDS		(DEFAULT_MAXNDEVS + 2)
 
 volatile sig_atomic_t int_flag = 0, resize_flag = 0, cont_flag = 0, usr1_flag = 0;
 struct timespec ts, ts_last;
+int mdep_armed;				/* clock armed, during revents */
+
+#ifdef USE_TIMERFD
+/*
+ * instead of a periodic SIGALRM, the clock is a timer file
+ * descriptor, part of the poll() set, and armed for the next time
+ * mux_timercb() has to be called (next tick or next timeout)
+ */
+int mdep_timerfd = -1;
+struct pollfd *mdep_timerpfd;
+#endif
+
+#ifdef USE_EPOLL
+/*
+ * MIDI devices are registered once in an epoll(7) instance, whose
+ * descriptor is the only one poll()ed for them, so the cost of a
+ * wakeup doesn't grow with the number of devices. Notification is
+ * edge-triggered, so devices are read until they would block, and
+ * written when they become writable
+ */
+int mdep_epfd = -1;
+struct pollfd *mdep_eppfd;		/* epoll descriptor in poll() set */
+struct pollfd mdep_devpfds[MAXFDS];	/* pollfd of registered devices */
+struct mididev *mdep_devs[MAXFDS];	/* device of each pollfd */
+unsigned mdep_ndevpfds;			/* registered pollfds */
+unsigned char mdep_devnoep[MAXFDS];	/* not supported by epoll */
+unsigned mdep_nnoep;			/* number of above */
+
+void mdep_devreg(void);
+void mdep_devunreg(struct mididev *);
+#endif
+
+#ifdef USE_RTTHREAD
+/*
+ * messages exchanged between the main thread and the real-time thread
+ */
+#define MDEP_RTMSG_QUIT		0	/* stop the real-time thread */
+#define MDEP_RTMSG_REPOLL	1	/* devices were reopened */
+#define MDEP_RTMSG_POS		2	/* display the song position */
+#define MDEP_RTMSG_TAG		3	/* display a tag */
+#define MDEP_RTMSG_FILL		4	/* call song_fillcb() */
+
+struct mdep_rtmsg {
+	unsigned type;			/* one of above */
+	char *tag;			/* for MDEP_RTMSG_TAG */
+	unsigned measure, beat, tic;	/* for MDEP_RTMSG_POS */
+};
+
+/*
+ * lock-free single-producer single-consumer queue: the producer only
+ * writes 'head', the consumer only writes 'tail'
+ */
+#define MDEP_RTQLEN	64		/* must be a power of two */
+
+struct mdep_rtq {
+	struct mdep_rtmsg msg[MDEP_RTQLEN];
+	unsigned head, tail;
+	int pipe[2];			/* to wake up the consumer */
+};
+
+/*
+ * If enabled, the clock, MIDI input and everything called from
+ * mux_timercb() and mididev_inputcb() run in a separate thread,
+ * holding 'mdep_rtlock'. The main thread, which runs the console and
+ * the interpreter, holds the lock only while it executes builtins
+ * (see node_exec_builtin()) or reads streamed files, so the
+ * real-time thread is not delayed by the line editor, the parser,
+ * the terminal or by procedures. A single builtin editing a large
+ * song still delays it.
+ */
+pthread_t mdep_rtthread;
+pthread_mutex_t mdep_rtlock;
+int mdep_rtrunning = 0;
+unsigned mdep_rtheld = 0;		/* mux_mdep_lock() nesting depth */
+unsigned mdep_rtlost = 0;		/* messages dropped, queue full */
+unsigned mdep_rtfillreq = 0;		/* MDEP_RTMSG_FILL not handled yet */
+struct mdep_rtq mdep_cmdq;		/* main thread -> real-time thread */
+struct mdep_rtq mdep_evq;		/* real-time thread -> main thread */
+
+void mdep_rtcons(struct mdep_rtmsg *);
+void mdep_rtstart(void);
+void mdep_rtstop(void);
+#endif
+
+/*
+ * SCHED_FIFO priority of the real-time thread (0 = disabled), and
+ * CPU to run it on (-1 = any)
+ */
+int mux_mdep_rtprio = 0, mux_mdep_rtcpu = -1;
 
 int cons_eof, cons_isatty, cons_quit;
 
@@ -109,14 +213,31 @@ mdep_sigusr1(int s)
 	usr1_flag = 1;
 }
 
+/*
+ * return a monotonic time in nanoseconds, used by timing histograms
+ */
+unsigned long
+hist_mdep_nsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
+		panic();
+	}
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
 /*
  * start the mux, must be called just after devices are opened
  */
 void
 mux_mdep_open(void)
 {
+#ifndef USE_TIMERFD
 	static struct sigaction sa;
 	struct itimerval it;
+#endif
 	sigset_t set;
 
 	sigemptyset(&set);
@@ -129,6 +250,26 @@ mux_mdep_open(void)
 		logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
 		exit(1);
 	}
+#ifdef USE_EPOLL
+	mdep_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (mdep_epfd < 0) {
+		logx(1, "%s: epoll_create1: %s", __func__, strerror(errno));
+		exit(1);
+	}
+	mdep_devreg();
+#endif
+#ifdef USE_TIMERFD
+	mdep_timerfd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_NONBLOCK | TFD_CLOEXEC);
+	if (mdep_timerfd < 0) {
+		logx(1, "%s: timerfd_create: %s", __func__, strerror(errno));
+		exit(1);
+	}
+#ifdef USE_RTTHREAD
+	if (mux_mdep_rtprio > 0)
+		mdep_rtstart();
+#endif
+#else
         sa.sa_flags = SA_RESTART;
         sa.sa_handler = mdep_sigalrm;
         sigfillset(&sa.sa_mask);
@@ -144,6 +285,7 @@ mux_mdep_open(void)
 		logx(1, "%s: setitimer: %s", __func__, strerror(errno));
 		exit(1);
 	}
+#endif
 }
 
 /*
@@ -152,8 +294,18 @@ mux_mdep_open(void)
 void
 mux_mdep_close(void)
 {
+#ifndef USE_TIMERFD
 	struct itimerval it;
+#endif
 
+#ifdef USE_TIMERFD
+#ifdef USE_RTTHREAD
+	if (mdep_rtrunning)
+		mdep_rtstop();
+#endif
+	close(mdep_timerfd);
+	mdep_timerfd = -1;
+#else
 	it.it_value.tv_sec = 0;
 	it.it_value.tv_usec = 0;
 	it.it_interval.tv_sec = 0;
@@ -162,6 +314,755 @@ mux_mdep_close(void)
 		logx(1, "%s: setitimer: %s", __func__, strerror(errno));
 		exit(1);
 	}
+#endif
+#ifdef USE_EPOLL
+	close(mdep_epfd);
+	mdep_epfd = -1;
+#endif
+}
+
+#ifdef USE_TIMERFD
+/*
+ * arm the clock timer to expire at the next deadline of the mux, or
+ * disarm it if there's nothing to wait for. Return 1 if armed
+ */
+int
+mdep_timerarm(void)
+{
+	struct itimerspec its;
+	unsigned long delta;
+	long long nsec;
+	int armed;
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+	armed = mux_deadline(&delta);
+	if (armed) {
+		/*
+		 * round up, so we don't wake up slightly before the
+		 * deadline and then sleep again for few nano-seconds
+		 */
+		nsec = ts_last.tv_nsec + (1000LL * delta + 23) / 24;
+		its.it_value.tv_sec = ts_last.tv_sec + nsec / 1000000000LL;
+		its.it_value.tv_nsec = nsec % 1000000000LL;
+	} else {
+		its.it_value.tv_sec = 0;
+		its.it_value.tv_nsec = 0;
+	}
+	if (timerfd_settime(mdep_timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		logx(1, "%s: timerfd_settime: %s", __func__, strerror(errno));
+		panic();
+	}
+	return armed;
+}
+#endif
+
+#ifdef USE_EPOLL
+/*
+ * register the descriptors of open devices. Called when devices
+ * are opened or reopened; descriptors of closed devices are removed
+ * from the epoll set by the kernel
+ */
+void
+mdep_devreg(void)
+{
+	struct epoll_event ee;
+	struct mididev *dev;
+	struct pollfd *pfd;
+	unsigned i, n, cnt;
+	int events;
+
+	n = 0;
+	mdep_nnoep = 0;
+	for (dev = mididev_list; dev != NULL; dev = dev->next) {
+		dev->pfd = NULL;
+		if (dev->eof)
+			continue;
+		events = POLLOUT;
+		if (dev->mode & MIDIDEV_MODE_IN)
+			events |= POLLIN;
+		pfd = &mdep_devpfds[n];
+		cnt = dev->ops->pollfd(dev, pfd, events);
+		for (i = 0; i < cnt; i++) {
+			pfd[i].revents = 0;
+			mdep_devs[n + i] = dev;
+			ee.events = EPOLLET;
+			if (pfd[i].events & POLLIN)
+				ee.events |= EPOLLIN;
+			if (pfd[i].events & POLLOUT)
+				ee.events |= EPOLLOUT;
+			ee.data.u32 = n + i;
+			mdep_devnoep[n + i] = 0;
+			if (epoll_ctl(mdep_epfd, EPOLL_CTL_ADD,
+				pfd[i].fd, &ee) < 0 &&
+			    (errno != EEXIST || epoll_ctl(mdep_epfd,
+				EPOLL_CTL_MOD, pfd[i].fd, &ee) < 0)) {
+				/*
+				 * regular files and few devices (ex.
+				 * /dev/null) can't be watched, but
+				 * they are always ready, as with poll()
+				 */
+				if (errno != EPERM) {
+					logx(1, "%s: epoll_ctl: %s",
+					    __func__, strerror(errno));
+					exit(1);
+				}
+				mdep_devnoep[n + i] = 1;
+				mdep_nnoep++;
+			}
+		}
+		dev->pfd = pfd;
+		n += cnt;
+	}
+	mdep_ndevpfds = n;
+}
+
+/*
+ * remove from the epoll set the descriptors of a device that
+ * reached eof, so it doesn't wake us up anymore. It's registered
+ * again by mdep_devreg() once reopened
+ */
+void
+mdep_devunreg(struct mididev *dev)
+{
+	unsigned i;
+
+	if (dev->pfd == NULL)
+		return;
+	for (i = dev->pfd - mdep_devpfds;
+	     i < mdep_ndevpfds && mdep_devs[i] == dev; i++) {
+		if (mdep_devnoep[i]) {
+			mdep_devnoep[i] = 0;
+			mdep_nnoep--;
+		} else
+			(void)epoll_ctl(mdep_epfd, EPOLL_CTL_DEL,
+			    mdep_devpfds[i].fd, NULL);
+	}
+	dev->pfd = NULL;
+}
+
+/*
+ * return the list of devices that are ready, and set the revents
+ * field of their pollfd structures
+ */
+unsigned
+mdep_devready(struct mididev **ready)
+{
+	struct epoll_event evs[MAXFDS];
+	struct pollfd *pfd;
+	struct mididev *dev;
+	int i, j, n, nready;
+
+	nready = 0;
+	if (mdep_nnoep > 0) {
+		for (i = 0; i < mdep_ndevpfds; i++) {
+			if (!mdep_devnoep[i] || mdep_devs[i]->pfd == NULL)
+				continue;
+			dev = mdep_devs[i];
+			if (dev->eof) {
+				mdep_devunreg(dev);
+				continue;
+			}
+			pfd = &mdep_devpfds[i];
+			pfd->revents |= pfd->events & (POLLIN | POLLOUT);
+			if (nready == 0 || ready[nready - 1] != dev)
+				ready[nready++] = dev;
+		}
+	}
+	if (!(mdep_eppfd->revents & POLLIN))
+		return nready;
+	n = epoll_wait(mdep_epfd, evs, MAXFDS, 0);
+	if (n < 0) {
+		if (errno == EINTR)
+			return nready;
+		logx(1, "%s: epoll_wait: %s", __func__, strerror(errno));
+		panic();
+	}
+	for (i = 0; i < n; i++) {
+		pfd = &mdep_devpfds[evs[i].data.u32];
+		dev = mdep_devs[evs[i].data.u32];
+		if (dev->pfd == NULL)
+			continue;
+		if (dev->eof) {
+			mdep_devunreg(dev);
+			continue;
+		}
+		if (evs[i].events & EPOLLIN)
+			pfd->revents |= POLLIN;
+		if (evs[i].events & EPOLLOUT)
+			pfd->revents |= POLLOUT;
+		if (evs[i].events & EPOLLHUP)
+			pfd->revents |= POLLHUP;
+		if (evs[i].events & EPOLLERR)
+			pfd->revents |= POLLERR;
+		for (j = 0; j < nready; j++) {
+			if (ready[j] == dev)
+				break;
+		}
+		if (j == nready)
+			ready[nready++] = dev;
+	}
+	return nready;
+}
+#endif
+
+/*
+ * fill the given array with the pollfd structures of the MIDI
+ * devices and of the clock, return the number of structures used.
+ * Store in the given location whether the clock is armed
+ */
+nfds_t
+mdep_midipollfd(struct pollfd *pfds, int *armed)
+{
+#ifndef USE_EPOLL
+	struct pollfd *pfd;
+	struct mididev *dev;
+	int events;
+#endif
+	nfds_t nfds;
+
+	nfds = 0;
+#ifdef USE_EPOLL
+	if (mux_isopen) {
+		mdep_eppfd = &pfds[nfds++];
+		mdep_eppfd->fd = mdep_epfd;
+		mdep_eppfd->events = POLLIN;
+	}
+#else
+	for (dev = mididev_list; dev != NULL; dev = dev->next) {
+		events = 0;
+		if (dev->mode & MIDIDEV_MODE_IN)
+			events |= POLLIN;
+		if (dev->oused > 0 || dev->onative > 0)
+			events |= POLLOUT;
+		if (events == 0 || dev->eof) {
+			dev->pfd = NULL;
+			continue;
+		}
+		pfd = &pfds[nfds];
+		nfds += dev->ops->pollfd(dev, pfd, events);
+		dev->pfd = pfd;
+	}
+#endif
+	*armed = 1;
+#ifdef USE_TIMERFD
+	if (mux_isopen) {
+		mdep_timerpfd = &pfds[nfds++];
+		mdep_timerpfd->fd = mdep_timerfd;
+		mdep_timerpfd->events = POLLIN;
+		*armed = mdep_timerarm();
+	}
+#endif
+	return nfds;
+}
+
+/*
+ * advance the clock up to the given time. If the delta is too large
+ * while the clock is armed (eg. the program was suspended and then
+ * resumed), just ignore it
+ */
+void
+mdep_clkadvance(struct timespec *now, int armed)
+{
+	long long delta_nsec, chunk;
+
+	/*
+	 * number of nano-seconds between now and the last
+	 * time we advanced the clock. Warning: because of system
+	 * clock changes this value can be negative.
+	 */
+	delta_nsec = 1000000000LL * (now->tv_sec - ts_last.tv_sec);
+	delta_nsec += now->tv_nsec - ts_last.tv_nsec;
+	if (delta_nsec > 0) {
+		ts_last = *now;
+		if (delta_nsec < 1000000000LL || !armed) {
+			/*
+			 * update the current position,
+			 * (time unit = 24th of microsecond). After a
+			 * long idle period the delta doesn't fit in
+			 * mux_timercb() argument, so pass it in chunks
+			 * of one second
+			 */
+			while (delta_nsec > 0) {
+				chunk = delta_nsec < 1000000000LL ?
+				    delta_nsec : 1000000000LL;
+				mux_timercb(24 * chunk / 1000);
+				delta_nsec -= chunk;
+			}
+		} else
+			logx(1, "ignored huge clock delta");
+	}
+}
+
+/*
+ * called by devices that know when their input arrived (in
+ * nanoseconds of CLOCK_MONOTONIC), before passing it to
+ * mididev_inputcb() or mididev_evcb(). The clock is advanced to that
+ * time so the input is handled at the tick it arrived. Input can't
+ * be handled in the past, nor after the time poll() returned
+ */
+void
+mux_mdep_intime(unsigned long long nsec)
+{
+	struct timespec t;
+
+	if (!mux_isopen)
+		return;
+	t.tv_sec = nsec / 1000000000ULL;
+	t.tv_nsec = nsec % 1000000000ULL;
+	if (t.tv_sec > ts.tv_sec ||
+	    (t.tv_sec == ts.tv_sec && t.tv_nsec > ts.tv_nsec))
+		t = ts;
+	mdep_clkadvance(&t, mdep_armed);
+}
+
+/*
+ * handle poll() events of the given device
+ */
+void
+mdep_devrevents(struct mididev *dev)
+{
+	unsigned char midibuf[MIDI_BUFSIZE];
+	int res, revents;
+#ifdef USE_EPOLL
+	unsigned i;
+#endif
+
+	revents = dev->ops->revents(dev, dev->pfd);
+#ifdef USE_EPOLL
+	for (i = dev->pfd - mdep_devpfds;
+	     i < mdep_ndevpfds && mdep_devs[i] == dev; i++)
+		mdep_devpfds[i].revents = 0;
+#endif
+	if (revents & POLLOUT)
+		mididev_flush(dev);
+	if (revents & POLLIN) {
+		/*
+		 * read until the device would block
+		 */
+		do {
+			res = dev->ops->read(dev, midibuf, MIDI_BUFSIZE);
+			if (dev->eof) {
+				mux_errorcb(dev->unit);
+				return;
+			}
+			if (dev->isensto.set) {
+				timo_del(&dev->isensto);
+				timo_add(&dev->isensto, MIDIDEV_ISENSTO);
+			}
+			mididev_inputcb(dev, midibuf, res);
+		} while (res == MIDI_BUFSIZE);
+	}
+	if (revents & POLLHUP) {
+		dev->eof = 1;
+		mux_errorcb(dev->unit);
+	}
+}
+
+/*
+ * advance the clock and process input of MIDI devices, once poll()
+ * returned. If 'ready' is false, poll() was interrupted so there's no
+ * input to process
+ */
+void
+mdep_midirevents(int armed, int ready)
+{
+	struct mididev *rdev[MAXFDS];
+	unsigned i, nready;
+#ifndef USE_EPOLL
+	struct mididev *dev;
+#endif
+#ifdef USE_TIMERFD
+	unsigned long long expirations;
+#endif
+
+	if (mux_isopen) {
+#ifdef USE_TIMERFD
+		if (ready && (mdep_timerpfd->revents & POLLIN)) {
+			if (read(mdep_timerfd, &expirations,
+				sizeof(expirations)) < 0 && errno != EAGAIN) {
+				logx(1, "%s: timerfd: %s", __func__, strerror(errno));
+				panic();
+			}
+		}
+#endif
+		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+			logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
+			panic();
+		}
+	}
+	nready = 0;
+	if (ready) {
+#ifdef USE_EPOLL
+		if (mux_isopen)
+			nready = mdep_devready(rdev);
+#else
+		for (dev = mididev_list; dev != NULL; dev = dev->next) {
+			if (dev->pfd != NULL)
+				rdev[nready++] = dev;
+		}
+#endif
+	}
+	mdep_armed = armed;
+	mux_flushbegin();
+
+	/*
+	 * devices timestamping their input advance the clock
+	 * themselves, handle them first
+	 */
+	for (i = 0; i < nready; i++) {
+		if (rdev[i]->itstamp && !rdev[i]->eof)
+			mdep_devrevents(rdev[i]);
+	}
+
+	/*
+	 * other devices are handled at the time poll() returned
+	 */
+	if (mux_isopen)
+		mdep_clkadvance(&ts, armed);
+	for (i = 0; i < nready; i++) {
+		if (!rdev[i]->itstamp && !rdev[i]->eof)
+			mdep_devrevents(rdev[i]);
+	}
+	mux_flushend();
+#ifdef USE_EPOLL
+	for (i = 0; i < nready; i++) {
+		if (rdev[i]->eof)
+			mdep_devunreg(rdev[i]);
+	}
+#endif
+}
+
+#ifdef USE_RTTHREAD
+/*
+ * store a message in the given queue, return 0 if the queue is
+ * full. Only one thread at a time may call this routine for a given
+ * queue.
+ */
+int
+mdep_rtput(struct mdep_rtq *q, struct mdep_rtmsg *msg)
+{
+	unsigned head, tail;
+	char c = 0;
+
+	head = q->head;
+	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if (head - tail == MDEP_RTQLEN)
+		return 0;
+	q->msg[head & (MDEP_RTQLEN - 1)] = *msg;
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+	/*
+	 * wake up the consumer. Don't skip this if the queue was not
+	 * empty: the consumer may have drained the pipe already and
+	 * be about to sleep. If the pipe is full it will wake up
+	 * anyway
+	 */
+	(void)write(q->pipe[1], &c, 1);
+	return 1;
+}
+
+/*
+ * retrieve a message from the given queue, return 0 if the queue is
+ * empty. Only one thread at a time may call this routine for a given
+ * queue.
+ */
+int
+mdep_rtget(struct mdep_rtq *q, struct mdep_rtmsg *msg)
+{
+	unsigned head, tail;
+
+	tail = q->tail;
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return 0;
+	*msg = q->msg[tail & (MDEP_RTQLEN - 1)];
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * initialize a queue and the pipe used to wake up its consumer
+ */
+void
+mdep_rtqinit(struct mdep_rtq *q)
+{
+	int i;
+
+	q->head = q->tail = 0;
+	if (pipe(q->pipe) < 0) {
+		logx(1, "%s: pipe: %s", __func__, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < 2; i++) {
+		if (fcntl(q->pipe[i], F_SETFL, O_NONBLOCK) < 0 ||
+		    fcntl(q->pipe[i], F_SETFD, FD_CLOEXEC) < 0) {
+			logx(1, "%s: fcntl: %s", __func__, strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+void
+mdep_rtqdone(struct mdep_rtq *q)
+{
+	close(q->pipe[0]);
+	close(q->pipe[1]);
+}
+
+/*
+ * fill the pollfd structure to wait for messages on the given queue
+ */
+nfds_t
+mdep_rtqpollfd(struct mdep_rtq *q, struct pollfd *pfd)
+{
+	pfd->fd = q->pipe[0];
+	pfd->events = POLLIN;
+	return 1;
+}
+
+/*
+ * consume wake up bytes, once poll() returned
+ */
+void
+mdep_rtqrevents(struct mdep_rtq *q, struct pollfd *pfd)
+{
+	char buf[MDEP_RTQLEN];
+
+	if (pfd->revents & POLLIN) {
+		while (read(q->pipe[0], buf, sizeof(buf)) > 0)
+			; /* nothing */
+	}
+}
+
+/*
+ * routine of the real-time thread. It runs the clock and handles
+ * MIDI input with the lock held, and releases the lock while
+ * waiting. The console, the interpreter, and terminal output stay in
+ * the main thread.
+ */
+void *
+mdep_rtmain(void *arg)
+{
+	struct pollfd pfds[MAXFDS];
+	struct mdep_rtmsg msg;
+	nfds_t nfds;
+	int res, armed, ready, quit;
+	char c = 0;
+
+	pthread_mutex_lock(&mdep_rtlock);
+	quit = 0;
+	while (!quit) {
+		nfds = mdep_rtqpollfd(&mdep_cmdq, pfds);
+		nfds += mdep_midipollfd(pfds + nfds, &armed);
+		pthread_mutex_unlock(&mdep_rtlock);
+		res = poll(pfds, nfds, -1);
+		if (res < 0 && errno != EINTR) {
+			logx(1, "%s: poll: %s", __func__, strerror(errno));
+			panic();
+		}
+		pthread_mutex_lock(&mdep_rtlock);
+		ready = res > 0;
+		if (ready)
+			mdep_rtqrevents(&mdep_cmdq, pfds);
+		while (mdep_rtget(&mdep_cmdq, &msg)) {
+			switch (msg.type) {
+			case MDEP_RTMSG_QUIT:
+				/*
+				 * devices are closed, don't touch them
+				 */
+				quit = 1;
+				ready = 0;
+				break;
+			case MDEP_RTMSG_REPOLL:
+				/*
+				 * devices were reopened, pollfd
+				 * structures are stale
+				 */
+				ready = 0;
+				break;
+			}
+		}
+		if (quit)
+			break;
+		mdep_midirevents(armed, ready);
+
+		/*
+		 * let the main thread read the file being streamed
+		 */
+		if (!__atomic_load_n(&mdep_rtfillreq, __ATOMIC_RELAXED) &&
+		    usong != NULL && song_needfill(usong)) {
+			msg.type = MDEP_RTMSG_FILL;
+			if (mdep_rtput(&mdep_evq, &msg))
+				__atomic_store_n(&mdep_rtfillreq, 1,
+				    __ATOMIC_RELAXED);
+		}
+
+		/*
+		 * let the main thread write messages
+		 */
+		if (__atomic_load_n(&log_used, __ATOMIC_RELAXED) > 0)
+			(void)write(mdep_evq.pipe[1], &c, 1);
+	}
+	pthread_mutex_unlock(&mdep_rtlock);
+	return NULL;
+}
+
+/*
+ * display a message sent by the real-time thread
+ */
+void
+mdep_rtcons(struct mdep_rtmsg *msg)
+{
+	switch (msg->type) {
+	case MDEP_RTMSG_POS:
+		cons_putpos(msg->measure, msg->beat, msg->tic);
+		break;
+	case MDEP_RTMSG_TAG:
+		cons_puttag(msg->tag);
+		break;
+	}
+}
+
+/*
+ * start the real-time thread, with SCHED_FIFO priority if
+ * possible. Must be called from mux_mdep_lock() context; on return
+ * the lock is held by the main thread
+ */
+void
+mdep_rtstart(void)
+{
+	pthread_mutexattr_t mattr;
+	pthread_attr_t attr;
+	struct sched_param sp;
+	sigset_t set, oset;
+	int err;
+#ifdef __linux__
+	cpu_set_t cpus;
+#endif
+
+	mdep_rtqinit(&mdep_cmdq);
+	mdep_rtqinit(&mdep_evq);
+
+	/*
+	 * give the main thread the priority of the real-time thread
+	 * while it holds the lock
+	 */
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setprotocol(&mattr, PTHREAD_PRIO_INHERIT);
+	pthread_mutex_init(&mdep_rtlock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+	pthread_mutex_lock(&mdep_rtlock);
+
+	/*
+	 * signals must be handled by the main thread
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	sp.sched_priority = mux_mdep_rtprio;
+	pthread_attr_setschedparam(&attr, &sp);
+	err = pthread_create(&mdep_rtthread, &attr, mdep_rtmain, NULL);
+	if (err == EPERM) {
+		logx(1, "real-time priority not permitted, using default");
+		err = pthread_create(&mdep_rtthread, NULL, mdep_rtmain, NULL);
+	}
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (err) {
+		logx(1, "%s: pthread_create: %s", __func__, strerror(err));
+		exit(1);
+	}
+#ifdef __linux__
+	if (mux_mdep_rtcpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(mux_mdep_rtcpu, &cpus);
+		err = pthread_setaffinity_np(mdep_rtthread, sizeof(cpus), &cpus);
+		if (err) {
+			logx(1, "%s: cpu %d: %s", __func__,
+			    mux_mdep_rtcpu, strerror(err));
+		}
+	}
+#endif
+	mdep_rtfillreq = 0;
+	mdep_rtrunning = 1;
+}
+
+/*
+ * stop the real-time thread. Must be called with the lock held, the
+ * lock is destroyed
+ */
+void
+mdep_rtstop(void)
+{
+	struct mdep_rtmsg msg;
+
+	msg.type = MDEP_RTMSG_QUIT;
+	mdep_rtput(&mdep_cmdq, &msg);
+	pthread_mutex_unlock(&mdep_rtlock);
+	pthread_join(mdep_rtthread, NULL);
+	pthread_mutex_destroy(&mdep_rtlock);
+	mdep_rtrunning = 0;
+
+	/*
+	 * display messages not consumed yet
+	 */
+	while (mdep_rtget(&mdep_evq, &msg))
+		mdep_rtcons(&msg);
+	mdep_rtqdone(&mdep_cmdq);
+	mdep_rtqdone(&mdep_evq);
+}
+
+/*
+ * called by cons_putpos() and cons_puttag(). If called from the
+ * real-time thread, pass the message to the main thread, so the
+ * real-time thread never writes on the terminal. Return 1 if the
+ * message was passed.
+ */
+int
+cons_mdep_defer(char *tag, unsigned measure, unsigned beat, unsigned tic)
+{
+	struct mdep_rtmsg msg;
+
+	if (!mdep_rtrunning || !pthread_equal(pthread_self(), mdep_rtthread))
+		return 0;
+	msg.type = tag ? MDEP_RTMSG_TAG : MDEP_RTMSG_POS;
+	msg.tag = tag;
+	msg.measure = measure;
+	msg.beat = beat;
+	msg.tic = tic;
+	if (!mdep_rtput(&mdep_evq, &msg))
+		__atomic_add_fetch(&mdep_rtlost, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+#endif
+
+/*
+ * called by the main thread before touching the song, the devices or
+ * anything else used by the real-time thread. Calls may be nested
+ */
+void
+mux_mdep_lock(void)
+{
+#ifdef USE_RTTHREAD
+	if (mdep_rtheld++ == 0 && mdep_rtrunning)
+		pthread_mutex_lock(&mdep_rtlock);
+#endif
+}
+
+/*
+ * release the lock taken by mux_mdep_lock()
+ */
+void
+mux_mdep_unlock(void)
+{
+#ifdef USE_RTTHREAD
+	if (--mdep_rtheld == 0 && mdep_rtrunning)
+		pthread_mutex_unlock(&mdep_rtlock);
+#endif
 }
 
 /*
@@ -174,10 +1075,18 @@ mux_mdep_wait(int docons)
 {
 	int i, res, revents;
 	nfds_t nfds;
-	struct pollfd *pfd, *tty_pfds, pfds[MAXFDS];
+	struct pollfd *tty_pfds, pfds[MAXFDS];
 	struct mididev *dev;
 	unsigned char midibuf[MIDI_BUFSIZE];
-	long long delta_nsec;
+	int armed;
+#ifdef USE_RTTHREAD
+	struct pollfd *ev_pfd = NULL;
+	struct mdep_rtmsg msg;
+	char logbuf[LOG_BUFSZ];
+	size_t logsize;
+	unsigned lost, held;
+	int fill;
+#endif
 
 	nfds = 0;
 	if (docons && !cons_eof) {
@@ -218,6 +1127,7 @@ mux_mdep_wait(int docons)
 	}
 	if (usr1_flag) {
 		usr1_flag = 0;
+		mux_mdep_lock();
 		for (dev = mididev_list; dev != NULL; dev = dev->next) {
 			if (dev->eof) {
 				mididev_close(dev);
@@ -227,81 +1137,85 @@ mux_mdep_wait(int docons)
 				}
 			}
 		}
-	}
-	for (dev = mididev_list; dev != NULL; dev = dev->next) {
-		if (!(dev->mode & MIDIDEV_MODE_IN) || dev->eof) {
-			dev->pfd = NULL;
-			continue;
+#ifdef USE_EPOLL
+		if (mux_isopen)
+			mdep_devreg();
+#endif
+#ifdef USE_RTTHREAD
+		if (mdep_rtrunning) {
+			msg.type = MDEP_RTMSG_REPOLL;
+			mdep_rtput(&mdep_cmdq, &msg);
 		}
-		pfd = &pfds[nfds];
-		nfds += dev->ops->pollfd(dev, pfd, POLLIN);
-		dev->pfd = pfd;
+#endif
+		mux_mdep_unlock();
 	}
 
-	/*
-	 * if editor was hiddent to write to std{err,out}, show it
-	 */
-	el_show();
+#ifdef USE_RTTHREAD
+	if (mdep_rtrunning) {
+		ev_pfd = &pfds[nfds];
+		nfds += mdep_rtqpollfd(&mdep_evq, ev_pfd);
 
-	res = poll(pfds, nfds, -1);
-	if (res < 0 && errno != EINTR) {
-		logx(1, "%s: poll: %s", __func__, strerror(errno));
-		exit(1);
-	}
-	if (res > 0) {
-		for (dev = mididev_list; dev != NULL; dev = dev->next) {
-			pfd = dev->pfd;
-			if (pfd == NULL)
-				continue;
-			revents = dev->ops->revents(dev, pfd);
-			if (revents & POLLIN) {
-				res = dev->ops->read(dev, midibuf, MIDI_BUFSIZE);
-				if (dev->eof) {
-					mux_errorcb(dev->unit);
-					continue;
-				}
-				if (dev->isensto > 0) {
-					dev->isensto = MIDIDEV_ISENSTO;
-				}
-				mididev_inputcb(dev, midibuf, res);
-			}
-			if (revents & POLLHUP) {
-				dev->eof = 1;
-				mux_errorcb(dev->unit);
-			}
+		/*
+		 * the lock is held here only if we're called by a
+		 * builtin being executed (ex. by blt_ev()), release
+		 * it while waiting, and until it's taken again let
+		 * mux_mdep_lock() work as if it was never held
+		 */
+		held = mdep_rtheld;
+		if (held > 0) {
+			mdep_rtheld = 0;
+			pthread_mutex_unlock(&mdep_rtlock);
 		}
-	}
-	if (mux_isopen) {
-		if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
-			logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
-			panic();
+		lost = __atomic_exchange_n(&mdep_rtlost, 0, __ATOMIC_RELAXED);
+		if (lost > 0)
+			logx(1, "%u position messages lost", lost);
+		logsize = log_take(logbuf, sizeof(logbuf));
+		if (logsize > 0) {
+			el_hide();
+			write(STDERR_FILENO, logbuf, logsize);
+		}
+		el_show();
+		res = poll(pfds, nfds, -1);
+		if (res < 0 && errno != EINTR) {
+			logx(1, "%s: poll: %s", __func__, strerror(errno));
+			exit(1);
+		}
+		if (res > 0)
+			mdep_rtqrevents(&mdep_evq, ev_pfd);
+		fill = 0;
+		while (mdep_rtget(&mdep_evq, &msg)) {
+			if (msg.type == MDEP_RTMSG_FILL)
+				fill = 1;
+			else
+				mdep_rtcons(&msg);
+		}
+		if (fill) {
+			__atomic_store_n(&mdep_rtfillreq, 0, __ATOMIC_RELAXED);
+			song_fillcb(usong);
+		}
+		if (held > 0) {
+			pthread_mutex_lock(&mdep_rtlock);
+			mdep_rtheld = held;
 		}
+	} else
+#endif
+	{
+		nfds += mdep_midipollfd(pfds + nfds, &armed);
 
 		/*
-		 * number of micro-seconds between now and the last
-		 * time we called poll(). Warning: because of system
-		 * clock changes this value can be negative.
+		 * if editor was hiddent to write to std{err,out}, show it
 		 */
-		delta_nsec = 1000000000LL * (ts.tv_sec - ts_last.tv_sec);
-		delta_nsec += ts.tv_nsec - ts_last.tv_nsec;
-		if (delta_nsec > 0) {
-			ts_last = ts;
-			if (delta_nsec < 1000000000LL) {
-				/*
-				 * update the current position,
-				 * (time unit = 24th of microsecond)
-				 */
-				mux_timercb(24 * delta_nsec / 1000);
-			} else {
-				/*
-				 * delta is too large (eg. the program was
-				 * suspended and then resumed), just ignore it
-				 */
-					logx(1, "ignored huge clock delta");
-			}
+		el_show();
+
+		res = poll(pfds, nfds, -1);
+		if (res < 0 && errno != EINTR) {
+			logx(1, "%s: poll: %s", __func__, strerror(errno));
+			exit(1);
 		}
+		mdep_midirevents(armed, res > 0);
+		song_fillcb(usong);
+		log_flush();
 	}
-	log_flush();
 	if (tty_pfds) {
 		if (cons_isatty) {
 			revents = tty_revents(tty_pfds);
@@ -352,6 +1266,10 @@ mux_sleep(unsigned millisecs)
 	int res, delta_msec;
 	struct timespec ts;
 
+	if (mux_freewheel) {
+		mux_timercb(24000UL * millisecs);
+		return;
+	}
 	if (clock_gettime(CLOCK_MONOTONIC, &ts_last) < 0) {
 		logx(1, "%s: clock_gettime: %s", __func__, strerror(errno));
 		exit(1);
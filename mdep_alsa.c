@@ -18,14 +18,18 @@
 #include <sys/types.h>
 #include <limits.h>
 #include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 #include <alsa/asoundlib.h>
 #include "utils.h"
+#include "ev.h"
 #include "mididev.h"
+#include "mux.h"
 #include "str.h"
 
 struct alsa {
@@ -36,6 +40,11 @@ struct alsa {
 	snd_midi_event_t *iparser;	/* midi input event parser */
 	snd_midi_event_t *oparser;	/* midi output event parser */
 	int nfds;
+	int queue;			/* queue for timestamps, or -1 */
+	unsigned long qwall;		/* tick due time at last stamp */
+	long long qtime;		/* queue time of above */
+	struct timespec qstartts;	/* CLOCK_MONOTONIC at queue start */
+	long long qlast;		/* last event time */
 };
 
 void	 alsa_open(struct mididev *);
@@ -46,6 +55,11 @@ unsigned alsa_pollfd(struct mididev *, struct pollfd *, int);
 int	 alsa_revents(struct mididev *, struct pollfd *);
 void	 alsa_close(struct mididev *);
 void	 alsa_del(struct mididev *);
+unsigned alsa_putev(struct mididev *, struct ev *);
+unsigned alsa_sync(struct mididev *);
+void	 alsa_stamp(struct alsa *, snd_seq_event_t *);
+int	 alsa_evconv(snd_seq_event_t *, struct ev *);
+void	 alsa_intime(struct alsa *, snd_seq_event_t *);
 
 struct devops alsa_ops = {
 	alsa_open,
@@ -55,7 +69,10 @@ struct devops alsa_ops = {
 	alsa_pollfd,
 	alsa_revents,
 	alsa_close,
-	alsa_del
+	alsa_del,
+	NULL,
+	alsa_putev,
+	alsa_sync
 };
 
 void
@@ -86,6 +103,7 @@ alsa_new(char *path, unsigned mode)
 	dev->port = -1;
 	dev->iparser = NULL;
 	dev->oparser = NULL;
+	dev->queue = -1;
 	return (struct mididev *)&dev->mididev;
 }
 
@@ -105,6 +123,7 @@ alsa_open(struct mididev *addr)
 {
 	struct alsa *dev = (struct alsa *)addr;
 	struct snd_seq_addr dst;
+	snd_seq_port_info_t *pinfo;
 	unsigned int mode;
 	char name[32];
 
@@ -116,7 +135,7 @@ alsa_open(struct mididev *addr)
 	(void)snd_lib_error_set_handler(alsa_err);
 
 	if (snd_seq_open(&dev->seq_handle, "default",
-		SND_SEQ_OPEN_DUPLEX, 0) < 0) {
+		SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK) < 0) {
 		logx(1, "%s: could not open ALSA sequencer", __func__);
 		dev->mididev.eof = 1;
 		return;
@@ -140,13 +159,51 @@ alsa_open(struct mididev *addr)
 	}
 	if (dev->mididev.mode == (MIDIDEV_MODE_IN | MIDIDEV_MODE_OUT))
 		mode |= SND_SEQ_PORT_CAP_DUPLEX;
-	dev->port = snd_seq_create_simple_port(dev->seq_handle, "default", mode,
+
+	/*
+	 * a queue is used to timestamp input, and to schedule output
+	 * if output latency is set. Its time origin is now
+	 */
+	if ((dev->mididev.mode & MIDIDEV_MODE_IN) ||
+	    dev->mididev.olookahead > 0) {
+		dev->queue = snd_seq_alloc_named_queue(dev->seq_handle, name);
+		if (dev->queue < 0) {
+			logx(1, "%s: couldn't allocate queue", __func__);
+			dev->mididev.eof = 1;
+			return;
+		}
+		if (snd_seq_start_queue(dev->seq_handle, dev->queue, NULL) < 0 ||
+		    snd_seq_drain_output(dev->seq_handle) < 0 ||
+		    clock_gettime(CLOCK_MONOTONIC, &dev->qstartts) < 0) {
+			logx(1, "%s: couldn't start queue", __func__);
+			dev->mididev.eof = 1;
+			return;
+		}
+		dev->qwall = mux_wallclock;
+		dev->qtime = 0;
+		dev->qlast = 0;
+	}
+
+	snd_seq_port_info_alloca(&pinfo);
+	snd_seq_port_info_set_name(pinfo, "default");
+	snd_seq_port_info_set_capability(pinfo, mode);
+	snd_seq_port_info_set_type(pinfo,
 	    SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
-	if (dev->port < 0) {
+	if (dev->mididev.mode & MIDIDEV_MODE_IN) {
+		/*
+		 * have the sequencer stamp input with the queue time
+		 */
+		snd_seq_port_info_set_timestamping(pinfo, 1);
+		snd_seq_port_info_set_timestamp_real(pinfo, 1);
+		snd_seq_port_info_set_timestamp_queue(pinfo, dev->queue);
+		dev->mididev.itstamp = 1;
+	}
+	if (snd_seq_create_port(dev->seq_handle, pinfo) < 0) {
 		logx(1, "%s: could not create port", __func__);
 		dev->mididev.eof = 1;
 		return;
 	}
+	dev->port = snd_seq_port_info_get_port(pinfo);
 
 	/*
 	 * now we have the port, create parsers
@@ -158,6 +215,11 @@ alsa_open(struct mididev *addr)
 			dev->mididev.eof = 1;
 			return;
 		}
+		/*
+		 * voice events are not decoded as bytes, so the
+		 * running status of the parser is not reliable
+		 */
+		snd_midi_event_no_status(dev->iparser, 1);
 	}
 	if (dev->mididev.mode & MIDIDEV_MODE_OUT) {
 		if (snd_midi_event_new(MIDIDEV_BUFLEN, &dev->oparser) < 0) {
@@ -193,7 +255,48 @@ alsa_open(struct mididev *addr)
 			return;
 		}
 	}
-	dev->nfds = snd_seq_poll_descriptors_count(dev->seq_handle, POLLIN);
+
+	dev->nfds = snd_seq_poll_descriptors_count(dev->seq_handle,
+	    POLLIN | POLLOUT);
+}
+
+/*
+ * set the time the event is delivered: either immediately or, in
+ * lookahead mode, the time it was due plus the output latency, so
+ * the sequencer hides our scheduling jitter
+ */
+void
+alsa_stamp(struct alsa *dev, snd_seq_event_t *sev)
+{
+	snd_seq_real_time_t rt;
+	unsigned long wall;
+	long long t;
+
+	if (dev->mididev.olookahead == 0) {
+		snd_seq_ev_set_direct(sev);
+		return;
+	}
+
+	/*
+	 * mux_wallclock wraps after few minutes if long is 32-bit,
+	 * so only use differences of it to advance the 64-bit
+	 * queue time
+	 */
+	wall = mux_wallclock - mux_ticlate;
+	dev->qtime += (long)(wall - dev->qwall);
+	dev->qwall = wall;
+	t = dev->qtime + (long long)dev->mididev.olookahead;
+
+	/*
+	 * the lateness of the tick may go backwards, but events must
+	 * be delivered in the order they are sent
+	 */
+	if (t < dev->qlast)
+		t = dev->qlast;
+	dev->qlast = t;
+	rt.tv_sec = t / 24000000;
+	rt.tv_nsec = (t % 24000000) / 3 * 125;
+	snd_seq_ev_schedule_real(sev, dev->queue, 0, &rt);
 }
 
 void
@@ -209,6 +312,10 @@ alsa_close(struct mididev *addr)
 		snd_midi_event_free(dev->oparser);
 		dev->oparser = NULL;
 	}
+	if (dev->queue >= 0) {
+		(void)snd_seq_free_queue(dev->seq_handle, dev->queue);
+		dev->queue = -1;
+	}
 	if (dev->port) {
 		snd_seq_delete_simple_port(dev->seq_handle, dev->port);
 		dev->port = -1;
@@ -218,44 +325,134 @@ alsa_close(struct mididev *addr)
 	dev->mididev.eof = 1;
 }
 
+/*
+ * convert a sequencer voice event to a midish event, return 0 if
+ * it's not a voice event
+ */
+int
+alsa_evconv(snd_seq_event_t *sev, struct ev *ev)
+{
+	switch (sev->type) {
+	case SND_SEQ_EVENT_NOTEON:
+		ev->ch = sev->data.note.channel;
+		ev->note_num = sev->data.note.note;
+		if (sev->data.note.velocity == 0) {
+			ev->cmd = EV_NOFF;
+			ev->note_vel = EV_NOFF_DEFAULTVEL;
+		} else {
+			ev->cmd = EV_NON;
+			ev->note_vel = sev->data.note.velocity;
+		}
+		break;
+	case SND_SEQ_EVENT_NOTEOFF:
+		ev->cmd = EV_NOFF;
+		ev->ch = sev->data.note.channel;
+		ev->note_num = sev->data.note.note;
+		ev->note_vel = sev->data.note.velocity;
+		break;
+	case SND_SEQ_EVENT_KEYPRESS:
+		ev->cmd = EV_KAT;
+		ev->ch = sev->data.note.channel;
+		ev->note_num = sev->data.note.note;
+		ev->note_kat = sev->data.note.velocity;
+		break;
+	case SND_SEQ_EVENT_CONTROLLER:
+		ev->cmd = EV_CTL;
+		ev->ch = sev->data.control.channel;
+		ev->ctl_num = sev->data.control.param;
+		ev->ctl_val = sev->data.control.value;
+		break;
+	case SND_SEQ_EVENT_PGMCHANGE:
+		ev->cmd = EV_PC;
+		ev->ch = sev->data.control.channel;
+		ev->v0 = sev->data.control.value;
+		ev->v1 = 0;
+		break;
+	case SND_SEQ_EVENT_CHANPRESS:
+		ev->cmd = EV_CAT;
+		ev->ch = sev->data.control.channel;
+		ev->cat_val = sev->data.control.value;
+		ev->v1 = 0;
+		break;
+	case SND_SEQ_EVENT_PITCHBEND:
+		ev->cmd = EV_BEND;
+		ev->ch = sev->data.control.channel;
+		ev->bend_val = sev->data.control.value + EV_BEND_DEFAULT;
+		ev->v1 = 0;
+		break;
+	default:
+		return 0;
+	}
+	return ev->ch <= EV_MAXCH && ev->v0 <= EV_MAXFINE &&
+	    (ev->cmd == EV_BEND || ev->v0 <= EV_MAXCOARSE) &&
+	    ev->v1 <= EV_MAXCOARSE;
+}
+
+/*
+ * if the event was stamped by the queue, advance the clock to
+ * the time it arrived
+ */
+void
+alsa_intime(struct alsa *dev, snd_seq_event_t *sev)
+{
+	unsigned long long nsec;
+
+	if (sev->queue != dev->queue ||
+	    (sev->flags & SND_SEQ_TIME_STAMP_MASK) != SND_SEQ_TIME_STAMP_REAL)
+		return;
+	nsec = 1000000000ULL * dev->qstartts.tv_sec + dev->qstartts.tv_nsec;
+	nsec += 1000000000ULL * sev->time.time.tv_sec + sev->time.time.tv_nsec;
+	mux_mdep_intime(nsec);
+}
+
+/*
+ * read events from the sequencer; voice events are passed directly
+ * to mididev_evcb(), others are decoded to bytes and passed to
+ * mididev_inputcb(), in the order they arrive. So nothing is
+ * returned to the caller.
+ */
 unsigned
 alsa_read(struct mididev *addr, unsigned char *buf, unsigned count)
 {
 	struct alsa *dev = (struct alsa *)addr;
-	unsigned todo = count;
-	snd_seq_event_t *ev;
+	snd_seq_event_t *sev;
+	struct ev ev;
 	long len;
 	int err;
 
 	if (!dev->seq_handle || !dev->iparser)
 		return 0;
 
-	while (todo > 0 &&
-	    snd_seq_event_input_pending(dev->seq_handle, 1) > 0) {
-		err = snd_seq_event_input(dev->seq_handle, &ev);
+	while (snd_seq_event_input_pending(dev->seq_handle, 1) > 0) {
+		err = snd_seq_event_input(dev->seq_handle, &sev);
 		if (err < 0) {
 			logx(1, "%s: snd_seq_event_input() failed", __func__);
 			dev->mididev.eof = 1;
 			return 0;
 		}
-		len = snd_midi_event_decode(dev->iparser, buf, todo, ev);
+		alsa_intime(dev, sev);
+		if (alsa_evconv(sev, &ev)) {
+			mididev_evcb(&dev->mididev, &ev);
+			continue;
+		}
+		len = snd_midi_event_decode(dev->iparser, buf, count, sev);
 		if (len < 0) {
 			/* fails for ALSA specific stuff we dont care about */
 			continue;
 		}
-		todo -= len;
-		buf += len;
+		mididev_inputcb(&dev->mididev, buf, len);
 	}
-	return count - todo;
+	return 0;
 }
 
 unsigned
 alsa_write(struct mididev *addr, unsigned char *buf, unsigned count)
 {
 	struct alsa *dev = (struct alsa *)addr;
-	unsigned todo = count;
+	unsigned todo = count, msg = count;
 	snd_seq_event_t ev;
 	long len;
+	int err;
 
 	if (!dev->seq_handle || !dev->oparser)
 		return 0;
@@ -274,17 +471,131 @@ alsa_write(struct mididev *addr, unsigned char *buf, unsigned count)
 		todo -= len;
 		if (ev.type == SND_SEQ_EVENT_NONE)
 			continue;
-		snd_seq_ev_set_direct(&ev);
+		alsa_stamp(dev, &ev);
 		snd_seq_ev_set_dest(&ev, SND_SEQ_ADDRESS_SUBSCRIBERS, 255);
 		snd_seq_ev_set_source(&ev, dev->port);
-		if (snd_seq_event_output_direct(dev->seq_handle, &ev) < 0) {
+
+		/*
+		 * queue events in the library buffer, and write them
+		 * with a single call at the end
+		 */
+		err = snd_seq_event_output_buffer(dev->seq_handle, &ev);
+		if (err == -EAGAIN) {
+			err = snd_seq_drain_output(dev->seq_handle);
+			if (err >= 0 || err == -EAGAIN) {
+				err = snd_seq_event_output_buffer(
+				    dev->seq_handle, &ev);
+			}
+		}
+		if (err == -EAGAIN) {
+			/*
+			 * the sequencer is full, the event will be
+			 * encoded again by the next call
+			 */
+			return count - msg;
+		}
+		if (err < 0) {
 			dev->mididev.eof = 1;
 			return 0;
 		}
+		msg = todo;
+	}
+	err = snd_seq_drain_output(dev->seq_handle);
+	if (err < 0 && err != -EAGAIN) {
+		dev->mididev.eof = 1;
+		return 0;
 	}
 	return count;
 }
 
+/*
+ * queue a voice event in the library output buffer, it's sent by
+ * alsa_sync()
+ */
+unsigned
+alsa_putev(struct mididev *addr, struct ev *ev)
+{
+	struct alsa *dev = (struct alsa *)addr;
+	snd_seq_event_t sev;
+	int err;
+
+	if (!dev->seq_handle || !dev->oparser)
+		return 0;
+
+	snd_seq_ev_clear(&sev);
+	switch (ev->cmd) {
+	case EV_NON:
+		snd_seq_ev_set_noteon(&sev, ev->ch,
+		    ev->note_num, ev->note_vel);
+		break;
+	case EV_NOFF:
+		snd_seq_ev_set_noteoff(&sev, ev->ch,
+		    ev->note_num, ev->note_vel);
+		break;
+	case EV_KAT:
+		snd_seq_ev_set_keypress(&sev, ev->ch,
+		    ev->note_num, ev->note_kat);
+		break;
+	case EV_CTL:
+		snd_seq_ev_set_controller(&sev, ev->ch,
+		    ev->ctl_num, ev->ctl_val);
+		break;
+	case EV_PC:
+		snd_seq_ev_set_pgmchange(&sev, ev->ch, ev->v0);
+		break;
+	case EV_CAT:
+		snd_seq_ev_set_chanpress(&sev, ev->ch, ev->cat_val);
+		break;
+	case EV_BEND:
+		snd_seq_ev_set_pitchbend(&sev, ev->ch,
+		    (int)ev->bend_val - EV_BEND_DEFAULT);
+		break;
+	default:
+		return 0;
+	}
+	alsa_stamp(dev, &sev);
+	snd_seq_ev_set_dest(&sev, SND_SEQ_ADDRESS_SUBSCRIBERS, 255);
+	snd_seq_ev_set_source(&sev, dev->port);
+	err = snd_seq_event_output_buffer(dev->seq_handle, &sev);
+	if (err == -EAGAIN) {
+		/*
+		 * library buffer full, make room and retry
+		 */
+		err = snd_seq_drain_output(dev->seq_handle);
+		if (err >= 0 || err == -EAGAIN)
+			err = snd_seq_event_output_buffer(dev->seq_handle, &sev);
+	}
+	if (err == -EAGAIN)
+		return 0;
+	if (err < 0) {
+		dev->mididev.eof = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * send events queued in the library output buffer
+ */
+unsigned
+alsa_sync(struct mididev *addr)
+{
+	struct alsa *dev = (struct alsa *)addr;
+	int err;
+
+	if (!dev->seq_handle)
+		return 1;
+	err = snd_seq_drain_output(dev->seq_handle);
+	if (err == -EAGAIN)
+		return 0;
+	if (err < 0) {
+		dev->mididev.eof = 1;
+		return 1;
+	}
+	/* positive value is the number of bytes left in the buffer */
+	return err == 0;
+}
+
 unsigned
 alsa_nfds(struct mididev *addr)
 {
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2003-2010 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * built-in devices that need no MIDI hardware:
+ *
+ * "null" is a sink: output is discarded, only bytes and writes are
+ * counted. Nothing is ever received.
+ *
+ * "loop" sends output back to its input, through a pipe so input is
+ * processed by the event loop like for any other device. The time
+ * between each read and the next write is stored in the "loop"
+ * histogram: that's the time spent by input events in the
+ * mididev_inputcb() -> mux -> norm -> filt -> song -> mididev_putev()
+ * path. Since events played are sent back to the input, a song
+ * routing input to the same device will loop forever; that's
+ * intended for stress tests. If the device is not opened in "rw"
+ * mode it behaves like the null device.
+ *
+ * Both display the byte count and the time between the first and the
+ * last write when they're closed.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include "utils.h"
+#include "mididev.h"
+#include "hist.h"
+
+struct loop {
+	struct mididev mididev;		/* device stuff */
+	unsigned isloop;		/* send output back to input */
+	int fd[2];			/* pipe, if isloop */
+	unsigned long nbytes, nwrites;	/* bytes and writes since open */
+	unsigned long nlost;		/* bytes dropped, pipe full */
+	unsigned long tfirst, tlast;	/* time of first and last write */
+	unsigned long tread;		/* time of last read */
+	unsigned rpending;		/* a read is not answered yet */
+};
+
+void	 loop_open(struct mididev *);
+unsigned loop_read(struct mididev *, unsigned char *, unsigned);
+unsigned loop_write(struct mididev *, unsigned char *, unsigned);
+unsigned loop_nfds(struct mididev *);
+unsigned loop_pollfd(struct mididev *, struct pollfd *, int);
+int	 loop_revents(struct mididev *, struct pollfd *);
+void	 loop_close(struct mididev *);
+void	 loop_del(struct mididev *);
+
+struct devops loop_ops = {
+	loop_open,
+	loop_read,
+	loop_write,
+	loop_nfds,
+	loop_pollfd,
+	loop_revents,
+	loop_close,
+	loop_del
+};
+
+/*
+ * return true if the given path designates a built-in device
+ */
+int
+loop_match(char *path)
+{
+	return path != NULL &&
+	    (strcmp(path, "loop") == 0 || strcmp(path, "null") == 0);
+}
+
+struct mididev *
+loop_new(char *path, unsigned mode)
+{
+	struct loop *dev;
+
+	dev = xmalloc(sizeof(struct loop), "loop");
+	mididev_init(&dev->mididev, &loop_ops, mode);
+	dev->isloop = strcmp(path, "loop") == 0 &&
+	    mode == (MIDIDEV_MODE_IN | MIDIDEV_MODE_OUT);
+	dev->fd[0] = dev->fd[1] = -1;
+	return (struct mididev *)&dev->mididev;
+}
+
+void
+loop_del(struct mididev *addr)
+{
+	struct loop *dev = (struct loop *)addr;
+
+	mididev_done(&dev->mididev);
+	xfree(dev);
+}
+
+void
+loop_open(struct mididev *addr)
+{
+	struct loop *dev = (struct loop *)addr;
+	int i;
+
+	dev->nbytes = dev->nwrites = dev->nlost = 0;
+	dev->rpending = 0;
+	if (!dev->isloop)
+		return;
+	if (pipe(dev->fd) < 0) {
+		logx(1, "loop: pipe: %s", strerror(errno));
+		dev->mididev.eof = 1;
+		return;
+	}
+	for (i = 0; i < 2; i++) {
+		if (fcntl(dev->fd[i], F_SETFL, O_NONBLOCK) < 0 ||
+		    fcntl(dev->fd[i], F_SETFD, FD_CLOEXEC) < 0) {
+			logx(1, "loop: fcntl: %s", strerror(errno));
+			dev->mididev.eof = 1;
+			return;
+		}
+	}
+}
+
+void
+loop_close(struct mididev *addr)
+{
+	struct loop *dev = (struct loop *)addr;
+	int i;
+
+	if (dev->nwrites > 0) {
+		logx(1, "%u: %lu bytes, %lu writes in %luus, %lu lost",
+		    dev->mididev.unit, dev->nbytes, dev->nwrites,
+		    (dev->tlast - dev->tfirst) / 1000, dev->nlost);
+	}
+	for (i = 0; i < 2; i++) {
+		if (dev->fd[i] >= 0) {
+			(void)close(dev->fd[i]);
+			dev->fd[i] = -1;
+		}
+	}
+}
+
+unsigned
+loop_read(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	struct loop *dev = (struct loop *)addr;
+	ssize_t res, i;
+
+	res = read(dev->fd[0], buf, count);
+	if (res < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		logx(1, "loop: read: %s", strerror(errno));
+		dev->mididev.eof = 1;
+		return 0;
+	}
+
+	/*
+	 * real-time messages (clock, active sensing) produce no
+	 * output, so don't wait for it
+	 */
+	for (i = 0; i < res; i++) {
+		if (buf[i] < 0xf8) {
+			dev->tread = hist_mdep_nsec();
+			dev->rpending = 1;
+			break;
+		}
+	}
+	return res;
+}
+
+unsigned
+loop_write(struct mididev *addr, unsigned char *buf, unsigned count)
+{
+	struct loop *dev = (struct loop *)addr;
+	unsigned long now;
+	ssize_t res;
+
+	now = hist_mdep_nsec();
+	if (dev->rpending) {
+		hist_put(HIST_LOOP, (now - dev->tread) / 1000);
+		dev->rpending = 0;
+	}
+	if (dev->nwrites == 0)
+		dev->tfirst = now;
+	dev->tlast = now;
+	dev->nwrites++;
+	dev->nbytes += count;
+	if (dev->isloop) {
+		res = write(dev->fd[1], buf, count);
+		if (res < 0) {
+			if (errno != EAGAIN) {
+				logx(1, "loop: write: %s", strerror(errno));
+				dev->mididev.eof = 1;
+				return 0;
+			}
+			res = 0;
+		}
+
+		/*
+		 * never block the caller, drop what doesn't fit
+		 */
+		dev->nlost += count - res;
+	}
+	return count;
+}
+
+unsigned
+loop_nfds(struct mididev *addr)
+{
+	struct loop *dev = (struct loop *)addr;
+
+	return dev->isloop ? 1 : 0;
+}
+
+unsigned
+loop_pollfd(struct mididev *addr, struct pollfd *pfd, int events)
+{
+	struct loop *dev = (struct loop *)addr;
+
+	if (!dev->isloop)
+		return 0;
+	pfd->fd = dev->fd[0];
+	pfd->events = events;
+	pfd->revents = 0;
+	return 1;
+}
+
+int
+loop_revents(struct mididev *addr, struct pollfd *pfd)
+{
+	struct loop *dev = (struct loop *)addr;
+
+	return dev->isloop ? pfd->revents : 0;
+}
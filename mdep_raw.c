@@ -15,6 +15,7 @@
  */
 #ifdef USE_RAW
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -35,6 +36,7 @@ struct raw {
 void	 raw_open(struct mididev *);
 unsigned raw_read(struct mididev *, unsigned char *, unsigned);
 unsigned raw_write(struct mididev *, unsigned char *, unsigned);
+unsigned raw_writev(struct mididev *, struct iovec *, unsigned);
 unsigned raw_nfds(struct mididev *);
 unsigned raw_pollfd(struct mididev *, struct pollfd *, int);
 int	 raw_revents(struct mididev *, struct pollfd *);
@@ -49,7 +51,8 @@ struct devops raw_ops = {
 	raw_pollfd,
 	raw_revents,
 	raw_close,
-	raw_del
+	raw_del,
+	raw_writev
 };
 
 struct mididev *
@@ -94,7 +97,7 @@ raw_open(struct mididev *addr)
 		panic();
 		mode = 0;
 	}
-	dev->fd = open(dev->path, mode, 0666);
+	dev->fd = open(dev->path, mode | O_NONBLOCK, 0666);
 	if (dev->fd < 0) {
 		logx(1, "%s: %s", dev->path, strerror(errno));
 		dev->mididev.eof = 1;
@@ -121,6 +124,8 @@ raw_read(struct mididev *addr, unsigned char *buf, unsigned count)
 
 	res = read(dev->fd, buf, count);
 	if (res < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
 		logx(1, "%s: %s", dev->path, strerror(errno));
 		dev->mididev.eof = 1;
 		return 0;
@@ -136,6 +141,25 @@ raw_write(struct mididev *addr, unsigned char *buf, unsigned count)
 
 	res = write(dev->fd, buf, count);
 	if (res < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		logx(1, "%s: %s", dev->path, strerror(errno));
+		dev->mididev.eof = 1;
+		return 0;
+	}
+	return res;
+}
+
+unsigned
+raw_writev(struct mididev *addr, struct iovec *iov, unsigned iovcnt)
+{
+	struct raw *dev = (struct raw *)addr;
+	ssize_t res;
+
+	res = writev(dev->fd, iov, iovcnt);
+	if (res < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
 		logx(1, "%s: %s", dev->path, strerror(errno));
 		dev->mididev.eof = 1;
 		return 0;
@@ -82,7 +82,7 @@ sndio_open(struct mididev *addr)
 		mode |= MIO_OUT;
 	if (dev->mididev.mode & MIDIDEV_MODE_IN)
 		mode |= MIO_IN;
-	dev->hdl = mio_open(dev->path, mode, 0);
+	dev->hdl = mio_open(dev->path, mode, 1);
 	if (dev->hdl == NULL) {
 		logx(1, "%s: failed to open device", dev->path);
 		dev->mididev.eof = 1;
@@ -123,8 +123,8 @@ sndio_write(struct mididev *addr, unsigned char *buf, unsigned count)
 	size_t res;
 
 	res = mio_write(dev->hdl, buf, count);
-	if (res < count) {
-		logx(1, "%s: short write", dev->path);
+	if (res < count && mio_eof(dev->hdl)) {
+		logx(1, "%s: write failed", dev->path);
 		dev->mididev.eof = 1;
 		return 0;
 	}
@@ -37,12 +37,32 @@
  *   midi input has been read(), basically it decodes the midi byte
  *   stream and calls mux_xxx() routines
  *
+ * - mididev_evcb() is called instead by the lower layer for voice
+ *   events it decoded itself (ex. ALSA sequencer events)
+ *
  * - mididev_put{ev,start,stop,tic,ack}() routines send respectively
  *   a voice event, clock start, clock stop, clock tick and midi
  *   active sense.
  *
+ * output is queued in a per-device ring, mididev_flush() writes as
+ * much as the device accepts without blocking and the rest is
+ * written when the device is ready (POLLOUT), so a stalled device
+ * doesn't delay others. If the ring fills, events are dropped.
+ *
+ * devices providing the putev() method get voice events directly,
+ * without encoding them as bytes; the ring is used for other
+ * messages, and as a fallback if the device can't accept the event.
+ *
+ * if the byte rate of the device is known (ex. 3125 bytes/s for a
+ * 31250 baud DIN port), the time the wire will be busy is
+ * estimated, and continuous streams (bender, aftertouch,
+ * controllers) are sent only when there's bandwidth left, after
+ * other events; new values of controllers not sent yet replace the
+ * pending ones.
+ *
  */
 
+#include <sys/uio.h>
 #include "utils.h"
 #include "defs.h"
 #include "mididev.h"
@@ -54,6 +74,7 @@
 #include "mux.h"
 #include "timo.h"
 #include "conv.h"
+#include "hist.h"
 
 #define MIDI_SYSEXSTART	0xf0
 #define MIDI_QFRAME	0xf1
@@ -71,11 +92,35 @@
 unsigned mididev_debug = 0;
 
 unsigned mididev_evlen[] = { 2, 2, 2, 2, 1, 1, 2, 0 };
+/*
+ * max length of an encoded event: the longest sysex pattern, and
+ * the longest voice event
+ */
+#define MIDIDEV_EVMAX	EV_PATSIZE
+#define MIDIDEV_EVMAXVOICE	3
+
 #define MIDIDEV_EVLEN(status) (mididev_evlen[((status) >> 4) & 7])
 
 struct mididev *mididev_list, *mididev_clksrc, *mididev_mtcsrc;
 struct mididev *mididev_byunit[DEFAULT_MAXNDEVS];
 
+static void mididev_sched(struct mididev *, int);
+static void mididev_encode(struct mididev *, struct ev *);
+
+/*
+ * called when timeout expires, ie MTC stopped
+ */
+static void
+mtc_timo(void *arg)
+{
+	struct mtc *mtc = arg;
+
+	if (mididev_debug)
+		logx(1, "%s: stopped", __func__);
+	mtc->state = MTC_STOP;
+	mux_mtcstop();
+}
+
 /*
  * initialize the mtc "parser" to a state, when a full message or 2 complete
  * frames are needed to lock to the master
@@ -87,7 +132,7 @@ mtc_init(struct mtc *mtc)
 	mtc->qfr = 0;
 	mtc->pos = 0xdeadbeef;
 	mtc->state = MTC_STOP;
-	mtc->timo = 0;
+	timo_set(&mtc->timo, mtc_timo, mtc);
 };
 
 /*
@@ -117,18 +162,6 @@ mtc_setfps(struct mtc *mtc, unsigned id)
 	return 1;
 }
 
-/*
- * called when timeout expires, ie MTC stopped
- */
-void
-mtc_timo(struct mtc *mtc)
-{
-	if (mididev_debug)
-		logx(1, "%s: stopped", __func__);
-	mtc->state = MTC_STOP;
-	mux_mtcstop();
-}
-
 /*
  * handle a quarter frame message
  */
@@ -157,7 +190,9 @@ mtc_tick(struct mtc *mtc, unsigned data)
 	mtc->nibble[mtc->qfr++] = data & 0xf;
 	if (mtc->qfr < 8)
 		return;
-	mtc->timo = 24000000 / 4;
+	if (mtc->timo.set)
+		timo_del(&mtc->timo);
+	timo_add(&mtc->timo, 24000000 / 4);
 	pos = mtc->tps * 4 * (mtc->nibble[0] +  (mtc->nibble[1]      << 4)) +
 	    MTC_SEC *        (mtc->nibble[2] +  (mtc->nibble[3]      << 4)) +
 	    MTC_SEC * 60 *   (mtc->nibble[4] +  (mtc->nibble[5]      << 4)) +
@@ -229,6 +264,8 @@ mididev_init(struct mididev *o, struct devops *ops, unsigned mode)
 	o->sendclk = 0;
 	o->sendmmc = 1;
 	o->ticrate = DEFAULT_TPU;
+	o->orate = 0;
+	o->olookahead = 0;
 	o->ticdelta = 0xdeadbeef;
 	o->mode = mode;
 	o->ixctlset = 0;	/* all input controllers are 7bit */
@@ -240,11 +277,13 @@ mididev_init(struct mididev *o, struct devops *ops, unsigned mode)
 	/*
 	 * reset parser
 	 */
-	o->oused = 0;
+	o->ostart = o->oused = 0;
+	o->onative = 0;
+	o->ocongest = 0;
+	o->odrops = 0;
 	o->istatus = o->ostatus = 0;
 	o->isysex = NULL;
 	o->runst = 1;
-	o->sync = 0;
 }
 
 /*
@@ -258,6 +297,41 @@ mididev_done(struct mididev *o)
 		mididev_close(o);
 }
 
+/*
+ * called when no input was received during MIDIDEV_ISENSTO
+ */
+static void
+mididev_isenscb(void *arg)
+{
+	struct mididev *o = arg;
+
+	logx(1, "%u: sensing timeout, disabled", o->unit);
+}
+
+/*
+ * called when nothing was sent during MIDIDEV_OSENSTO
+ */
+static void
+mididev_osenscb(void *arg)
+{
+	struct mididev *o = arg;
+
+	mididev_putack(o);
+	if (!o->osensto.set)
+		timo_add(&o->osensto, MIDIDEV_OSENSTO);
+}
+
+/*
+ * called when the wire is expected to have room for pending events
+ */
+static void
+mididev_schedcb(void *arg)
+{
+	struct mididev *o = arg;
+
+	mididev_flush(o);
+}
+
 /*
  * open the device and initialize the parser
  */
@@ -265,11 +339,25 @@ void
 mididev_open(struct mididev *o)
 {
 	o->eof = 0;
-	o->oused = 0;
+	o->itstamp = 0;
+	o->ostart = o->oused = 0;
+	o->onative = 0;
+	o->ocongest = 0;
+	o->odrops = 0;
+	o->owire = o->ostarttime = mux_wallclock;
+	o->obusy = 0;
+	o->obytes = 0;
+	o->omerged = 0;
+	o->npend = 0;
 	o->istatus = o->ostatus = 0;
 	o->isysex = NULL;
 	mtc_init(&o->imtc);
-	o->ops->open(o);
+	timo_set(&o->oschedto, mididev_schedcb, o);
+	timo_set(&o->isensto, mididev_isenscb, o);
+	timo_set(&o->osensto, mididev_osenscb, o);
+	timo_add(&o->osensto, MIDIDEV_OSENSTO);
+	if (!mux_freewheel)
+		o->ops->open(o);
 }
 
 /*
@@ -278,38 +366,160 @@ mididev_open(struct mididev *o)
 void
 mididev_close(struct mididev *o)
 {
-	mididev_flush(o);
-	o->ops->close(o);
+	unsigned long elapsed;
+
+	mididev_sched(o, 1);
+	mididev_drain(o);
+	if (o->olookahead > 0 && !mux_freewheel) {
+		/*
+		 * let the device play events scheduled ahead
+		 */
+		mux_sleep(o->olookahead / 24000 + 1);
+	}
+	if (o->odrops > 0)
+		logx(1, "%u: %lu events dropped", o->unit, o->odrops);
+	if (o->orate > 0) {
+		elapsed = mux_wallclock - o->ostarttime;
+		logx(1, "%u: %lu bytes, %u%% of bandwidth used, %lu merged",
+		    o->unit, o->obytes,
+		    elapsed > 0 ? (unsigned)(100 * o->obusy / elapsed) : 0,
+		    o->omerged);
+	}
+	if (o->oschedto.set)
+		timo_del(&o->oschedto);
+	if (!mux_freewheel)
+		o->ops->close(o);
 	o->eof = 1;
+	if (o->isensto.set)
+		timo_del(&o->isensto);
+	if (o->osensto.set)
+		timo_del(&o->osensto);
+	if (o->imtc.timo.set)
+		timo_del(&o->imtc.timo);
 }
 
 /*
- * flush the given midi device
+ * write as much as possible of the output ring, without blocking
  */
 void
 mididev_flush(struct mididev *o)
 {
-	unsigned count, todo;
-	unsigned char *buf;
+	struct iovec iov[2];
+	unsigned count, todo, done;
+	unsigned long start;
 
-	if (!o->eof) {
-		if (mididev_debug && o->oused > 0) {
+	start = hist_mdep_nsec();
+	if (o->npend > 0)
+		mididev_sched(o, 0);
+	done = 0;
+	if (o->ops->writev && !mux_freewheel && !o->eof &&
+	    o->ostart + o->oused > MIDIDEV_BUFLEN) {
+		iov[0].iov_base = o->obuf + o->ostart;
+		iov[0].iov_len = MIDIDEV_BUFLEN - o->ostart;
+		iov[1].iov_base = o->obuf;
+		iov[1].iov_len = o->oused - iov[0].iov_len;
+		if (mididev_debug) {
+			logx(1, "%s: %u: %u: {hexdump:%p,%u} {hexdump:%p,%u}",
+			    __func__, timo_abstime / 24, o->unit,
+			    iov[0].iov_base, (unsigned)iov[0].iov_len,
+			    iov[1].iov_base, (unsigned)iov[1].iov_len);
+		}
+		count = o->ops->writev(o, iov, 2);
+		if (!o->eof) {
+			o->ostart = (o->ostart + count) & (MIDIDEV_BUFLEN - 1);
+			o->oused -= count;
+			done += count;
+		}
+	}
+	while (o->oused > 0 && !o->eof) {
+		todo = MIDIDEV_BUFLEN - o->ostart;
+		if (todo > o->oused)
+			todo = o->oused;
+		if (mididev_debug) {
 			logx(1, "%s: %u: %u: {hexdump:%p,%u}", __func__,
-			    timo_abstime / 24, o->unit, o->obuf, o->oused);
+			    timo_abstime / 24, o->unit, o->obuf + o->ostart, todo);
 		}
-		todo = o->oused;
-		buf = o->obuf;
-		while (todo > 0) {
-			count = o->ops->write(o, buf, todo);
+		if (mux_freewheel) {
+			mux_fwwrite(o->unit, o->obuf + o->ostart, todo);
+			count = todo;
+		} else {
+			count = o->ops->write(o, o->obuf + o->ostart, todo);
 			if (o->eof)
 				break;
-			todo -= count;
-			buf += count;
 		}
-		if (o->oused)
-			o->osensto = MIDIDEV_OSENSTO;
+		o->ostart = (o->ostart + count) & (MIDIDEV_BUFLEN - 1);
+		o->oused -= count;
+		done += count;
+		if (count < todo)
+			break;
+	}
+	if (o->onative > 0 && !o->eof) {
+		if (o->ops->sync(o)) {
+			done += o->onative;
+			o->onative = 0;
+		}
+	}
+	if (o->eof) {
+		o->oused = 0;
+		o->onative = 0;
+	}
+	if (o->oused == 0)
+		o->ostart = 0;
+	if (done > 0 && o->osensto.set) {
+		timo_del(&o->osensto);
+		timo_add(&o->osensto, MIDIDEV_OSENSTO);
+	}
+	if (o->ocongest && o->oused < MIDIDEV_HIWAT / 2) {
+		logx(1, "%u: output recovered, %lu events dropped",
+		    o->unit, o->odrops);
+		o->ocongest = 0;
 	}
-	o->oused = 0;
+	HIST_ACC(HIST_FLUSH, start);
+}
+
+/*
+ * write the output ring, waiting for the device if necessary. If the
+ * device is stalled, discard data
+ */
+void
+mididev_drain(struct mididev *o)
+{
+	unsigned used, ms;
+
+	for (ms = 0; ; ms++) {
+		used = o->oused;
+		mididev_flush(o);
+		if (o->oused == 0 && o->onative == 0)
+			return;
+		if (o->oused < used)
+			ms = 0;
+		if (ms == MIDIDEV_DRAINTO)
+			break;
+		mux_sleep(1);
+	}
+	logx(1, "%u: device stalled, %u bytes, %u events discarded",
+	    o->unit, o->oused, o->onative);
+	o->ostart = o->oused = 0;
+	o->onative = 0;
+	o->ostatus = 0;
+}
+
+/*
+ * called by the lower layer for each voice event it decoded
+ */
+void
+mididev_evcb(struct mididev *o, struct ev *ev)
+{
+	if (!(o->mode & MIDIDEV_MODE_IN)) {
+		logx(1, "received event from output only device");
+		return;
+	}
+	if (mididev_debug) {
+		logx(1, "%s: %u: %u: {ev:%p}", __func__,
+		    timo_abstime / 24, o->unit, ev);
+	}
+	ev->dev = o->unit;
+	mux_evcb(o->unit, ev);
 }
 
 /*
@@ -441,64 +651,252 @@ mididev_inputcb(struct mididev *o, unsigned char *buf, unsigned count)
 }
 
 /*
- * write a single midi byte to the output buffer, if
- * it is full, flush it. Shouldn't we inline it?
+ * write a single midi byte to the output ring, the caller must
+ * ensure there's space for it
  */
 void
 mididev_out(struct mididev *o, unsigned data)
 {
-	if (!(o->mode & MIDIDEV_MODE_OUT)) {
-		return;
+	unsigned cost;
+
+	o->obuf[(o->ostart + o->oused) & (MIDIDEV_BUFLEN - 1)] = data;
+	o->oused++;
+	if (o->orate > 0) {
+		cost = 24000000 / o->orate;
+		if ((long)(o->owire - mux_wallclock) < 0)
+			o->owire = mux_wallclock;
+		o->owire += cost;
+		o->obusy += cost;
+		o->obytes++;
 	}
-	if (o->oused == MIDIDEV_BUFLEN) {
+}
+
+/*
+ * check if there's space in the output ring for a message of the
+ * given maximum length; if not, count it as dropped. If 'lowprio' is
+ * set, the message is dropped above the high-water mark
+ */
+int
+mididev_room(struct mididev *o, unsigned len, int lowprio)
+{
+	if (!(o->mode & MIDIDEV_MODE_OUT))
+		return 0;
+	if (o->oused + len > MIDIDEV_BUFLEN)
 		mididev_flush(o);
+	if (o->oused + len <= MIDIDEV_BUFLEN &&
+	    (!lowprio || o->oused < MIDIDEV_HIWAT))
+		return 1;
+	if (!o->ocongest) {
+		logx(1, "%u: output congested, dropping events", o->unit);
+		o->ocongest = 1;
 	}
-	o->obuf[o->oused] = (unsigned char)data;
-	o->oused++;
+	o->odrops++;
+	return 0;
 }
 
 void
 mididev_putstart(struct mididev *o)
 {
+	if (!mididev_room(o, 1, 0))
+		return;
 	mididev_out(o, MIDI_START);
-	if (o->sync)
-		mididev_flush(o);
 }
 
 void
 mididev_putstop(struct mididev *o)
 {
+	if (!mididev_room(o, 1, 0))
+		return;
 	mididev_out(o, MIDI_STOP);
-	if (o->sync)
-		mididev_flush(o);
 }
 
 void
 mididev_puttic(struct mididev *o)
 {
+	if (!mididev_room(o, 1, 0))
+		return;
 	mididev_out(o, MIDI_TIC);
-	if (o->sync)
-		mididev_flush(o);
 }
 
 void
 mididev_putack(struct mididev *o)
 {
+	if (!mididev_room(o, 1, 0))
+		return;
 	mididev_out(o, MIDI_ACK);
-	if (o->sync)
-		mididev_flush(o);
 }
 
 /*
- * convert a voice event to byte stream and queue
- * it for sending
+ * return true if the event is part of a continuous stream that may
+ * be delayed and thinned by the output scheduler. Bank select, data
+ * entry, pedals and other switches, (N)RPN and channel mode
+ * controllers must be sent in order with other events.
+ */
+static int
+mididev_iscont(struct ev *ev)
+{
+	switch (ev->cmd) {
+	case EV_BEND:
+	case EV_CAT:
+	case EV_KAT:
+		return 1;
+	case EV_CTL:
+		switch (ev->ctl_num) {
+		case 0:
+		case 6:
+		case 32:
+		case 38:
+			return 0;
+		}
+		if (ev->ctl_num >= 64 && ev->ctl_num <= 69)
+			return 0;
+		return ev->ctl_num < 96 || (ev->ctl_num > 101 && ev->ctl_num < 120);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * move pending events to the output ring, as long as the wire lag
+ * stays below MIDIDEV_MAXLAG, or unconditionally if 'force' is set.
+ * If events remain, schedule a new attempt
+ */
+static void
+mididev_sched(struct mididev *o, int force)
+{
+	unsigned i, n, cost;
+	long lag;
+
+	if (o->orate == 0) {
+		force = 1;
+		cost = 0;
+	} else
+		cost = MIDIDEV_EVMAXVOICE * (24000000 / o->orate);
+	for (n = 0; n < o->npend; n++) {
+		lag = o->owire - mux_wallclock;
+		if (!force && lag + cost > MIDIDEV_MAXLAG)
+			break;
+		mididev_encode(o, &o->opend[n]);
+	}
+	for (i = n; i < o->npend; i++)
+		o->opend[i - n] = o->opend[i];
+	o->npend -= n;
+	if (o->npend > 0 && !o->oschedto.set) {
+		lag = o->owire - mux_wallclock;
+		lag += cost - MIDIDEV_MAXLAG;
+		timo_add(&o->oschedto, lag > 0 ? lag : cost);
+	}
+}
+
+/*
+ * send pending events of the given channel, so they are not
+ * reordered with an event that is sent directly
+ */
+static void
+mididev_flushch(struct mididev *o, unsigned ch)
+{
+	unsigned i, n;
+
+	n = 0;
+	for (i = 0; i < o->npend; i++) {
+		if (o->opend[i].ch == ch)
+			mididev_encode(o, &o->opend[i]);
+		else
+			o->opend[n++] = o->opend[i];
+	}
+	o->npend = n;
+}
+
+/*
+ * queue an event for sending. Continuous streams are deferred
+ * to the scheduler if the output rate is set. Other voice events
+ * (notes, switches, channel mode messages, ...) are sent after the
+ * pending events of their channel, and other events after all
+ * pending events.
  */
 void
 mididev_putev(struct mididev *o, struct ev *ev)
+{
+	unsigned i;
+
+	if (o->orate > 0 && mididev_iscont(ev)) {
+		for (i = 0; i < o->npend; i++) {
+			if (o->opend[i].cmd == ev->cmd &&
+			    o->opend[i].ch == ev->ch &&
+			    (ev->cmd == EV_BEND || ev->cmd == EV_CAT ||
+				o->opend[i].v0 == ev->v0)) {
+				o->opend[i] = *ev;
+				o->omerged++;
+				return;
+			}
+		}
+		if (o->npend < MIDIDEV_NPEND) {
+			o->opend[o->npend++] = *ev;
+			return;
+		}
+	}
+	if (o->npend > 0) {
+		if (EV_ISVOICE(ev))
+			mididev_flushch(o, ev->ch);
+		else
+			mididev_sched(o, 1);
+	}
+	mididev_encode(o, ev);
+}
+
+/*
+ * queue the events produced by conv_unpackev() for a single midish
+ * event. They are dropped or sent all together, so the device never
+ * gets half of a multi-message sequence (ex. NRPN or 14-bit
+ * controller)
+ */
+void
+mididev_putevs(struct mididev *o, struct ev *rev, unsigned nev)
+{
+	unsigned i;
+
+	if (nev == 0)
+		return;
+	if (!mididev_room(o, nev * MIDIDEV_EVMAX, rev[0].cmd != EV_NOFF))
+		return;
+	for (i = 0; i < nev; i++)
+		mididev_putev(o, &rev[i]);
+}
+
+/*
+ * convert a voice event to byte stream and store it in the output
+ * ring
+ */
+static void
+mididev_encode(struct mididev *o, struct ev *ev)
 {
 	unsigned char *p;
 	unsigned s;
 
+	/*
+	 * if the device takes events natively, use that unless it
+	 * must be ordered after bytes not written yet, or if bytes
+	 * must be counted by the scheduler. Pending bytes are not
+	 * flushed here, to write everything at once in mux_flushend(),
+	 * so the event is encoded after them. Thus, on devices
+	 * transmitting the clock, events of a tick follow the clock
+	 * byte and always take this path
+	 */
+	if (o->ops->putev && EV_ISVOICE(ev) && !mux_freewheel &&
+	    o->orate == 0 && !o->eof) {
+		if (o->oused == 0 && o->ops->putev(o, ev)) {
+			o->onative++;
+			/* the native event broke the running status */
+			o->ostatus = 0;
+			return;
+		}
+	}
+	/*
+	 * low priority events were already dropped, as a group, by
+	 * mididev_putevs()
+	 */
+	if (!mididev_room(o, MIDIDEV_EVMAX, 0))
+		return;
 	if (EV_ISSX(ev)) {
 		o->ostatus = 0;
 		p = evinfo[ev->cmd].pattern;
@@ -519,7 +917,7 @@ mididev_putev(struct mididev *o, struct ev *ev)
 			default:
 				mididev_out(o, *p);
 				if (*p == 0xf7)
-					goto end;
+					return;
 			}
 			p++;
 		}
@@ -554,9 +952,6 @@ mididev_putev(struct mididev *o, struct ev *ev)
 			mididev_out(o, ev->v1);
 		}
 	}
-end:
-	if (o->sync)
-		mididev_flush(o);
 }
 
 /*
@@ -568,12 +963,20 @@ mididev_sendraw(struct mididev *o, unsigned char *buf, unsigned len)
 	if (!(o->mode & MIDIDEV_MODE_OUT)) {
 		return;
 	}
+
+	/*
+	 * the message may depend on pending events (ex. a bulk dump
+	 * after a bank select), send them first
+	 */
+	if (o->npend > 0)
+		mididev_sched(o, 1);
 	while (len > 0) {
 		if (o->oused == MIDIDEV_BUFLEN) {
 			mididev_flush(o);
+			if (o->oused == MIDIDEV_BUFLEN)
+				mididev_drain(o);
 		}
-		o->obuf[o->oused] = *buf;
-		o->oused++;
+		mididev_out(o, *buf);
 		len--;
 		buf++;
 	}
@@ -581,8 +984,6 @@ mididev_sendraw(struct mididev *o, unsigned char *buf, unsigned len)
 	 * since we don't parse the buffer, reset running status
 	 */
 	o->ostatus = 0;
-	if (o->sync)
-		mididev_flush(o);
 }
 
 /*
@@ -636,13 +1037,17 @@ mididev_attach(unsigned unit, char *path, unsigned mode)
 		logx(1, "device already exists");
 		return 0;
 	}
+	if (loop_match(path))
+		dev = loop_new(path, mode);
+	else {
 #if defined(USE_SNDIO)
-	dev = sndio_new(path, mode);
+		dev = sndio_new(path, mode);
 #elif defined(USE_ALSA)
-	dev = alsa_new(path, mode);
+		dev = alsa_new(path, mode);
 #else
-	dev = raw_new(path, mode);
+		dev = raw_new(path, mode);
 #endif
+	}
 	if (dev == NULL)
 		return 0;
 	dev->next = mididev_list;
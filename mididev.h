@@ -17,6 +17,9 @@
 #ifndef MIDISH_MIDIDEV_H
 #define MIDISH_MIDIDEV_H
 
+#include "timo.h"
+#include "ev.h"
+
 /*
  * timeouts for active sensing
  * (as usual units are 24th of microsecond)
@@ -31,11 +34,30 @@
 #define MIDIDEV_MODE_OUT	2	/* can output */
 
 /*
- * device output buffer length in bytes
+ * device output ring length in bytes (must be a power of two), about
+ * 5 seconds of data at 31250 baud. Above the high-water mark only
+ * note-off events are queued, others are dropped
  */
-#define MIDIDEV_BUFLEN	0x400
+#define MIDIDEV_BUFLEN	0x4000
+#define MIDIDEV_HIWAT	(MIDIDEV_BUFLEN / 4 * 3)
+
+/*
+ * when the output rate of the device is set, continuous streams
+ * (bender, aftertouch, controllers) are queued in a per-device list
+ * of MIDIDEV_NPEND events, and sent only if they don't make the wire
+ * lag more than MIDIDEV_MAXLAG (in 24ths of microsecond)
+ */
+#define MIDIDEV_NPEND	64
+#define MIDIDEV_MAXLAG	(10 * 24 * 1000)
+
+/*
+ * max time in milliseconds to wait for a stalled device to accept
+ * data, when the data can't be dropped (ex. sysex, closing)
+ */
+#define MIDIDEV_DRAINTO	1000
 
 struct pollfd;
+struct iovec;
 struct mididev;
 struct ev;
 
@@ -46,7 +68,9 @@ struct devops {
 	void (*open)(struct mididev *);
 	/*
 	 * try to read the given number of bytes, and return the number
-	 * of bytes actually read, set the ``eof'' flag on error
+	 * of bytes actually read, set the ``eof'' flag on error. The
+	 * device may also pass input directly to mididev_inputcb()
+	 * and mididev_evcb(), and return 0
 	 */
 	unsigned (*read)(struct mididev *, unsigned char *, unsigned);
 	/*
@@ -77,6 +101,23 @@ struct devops {
 	 * free the mididev structure and associated resources
 	 */
 	void (*del)(struct mididev *);
+	/*
+	 * optional: like write, but for the given array of buffers,
+	 * so the output ring is written with a single call when it
+	 * wraps
+	 */
+	unsigned (*writev)(struct mididev *, struct iovec *, unsigned);
+	/*
+	 * optional: queue the given voice event in the device native
+	 * format, bypassing the byte stream, return 0 if the device
+	 * can't accept it now
+	 */
+	unsigned (*putev)(struct mididev *, struct ev *);
+	/*
+	 * optional: send events queued with putev(), return 0 if the
+	 * device is not ready, so it must be called again on POLLOUT
+	 */
+	unsigned (*sync)(struct mididev *);
 };
 
 /*
@@ -91,7 +132,7 @@ struct mtc {
 #define MTC_START	1		/* got a full frame but no tick yet */
 #define MTC_RUN		2		/* got at least 1 tick */
 	unsigned state;			/* one of above */
-	unsigned timo;
+	struct timo timo;		/* to detect when MTC stops */
 };
 
 struct mididev {
@@ -108,15 +149,16 @@ struct mididev {
 	 */
 	unsigned unit;			/* index in the mididev table */
 	unsigned ticrate, ticdelta;	/* tick rate (default 96) */
+	unsigned long olookahead;	/* output latency, see dlookahead */
 	unsigned sendclk;		/* send MIDI clock */
 	unsigned sendmmc;		/* send MMC start/stop/relocate */
-	unsigned isensto, osensto;	/* active sensing timeouts */
+	struct timo isensto, osensto;	/* active sensing timeouts */
 	unsigned mode;			/* read, write */
 	unsigned ixctlset, oxctlset;	/* bitmap of 14bit controllers */
 	unsigned ievset, oevset;	/* bitmap of CONV_{XPC,NRPN,RPN} */
 	unsigned eof;			/* i/o error pending */
 	unsigned runst;			/* use running status for output */
-	unsigned sync;			/* flush buffer after each message */
+	unsigned itstamp;		/* input has arrival times */
 
 	/*
 	 * midi events parser state
@@ -126,25 +168,43 @@ struct mididev {
 	unsigned char	  idata[2];		/* current event's data */
 	struct sysex	 *isysex;		/* input sysex */
 	struct mtc	  imtc;			/* MTC parser */
+	unsigned	  ostart;		/* first byte to write in obuf */
 	unsigned 	  oused;		/* bytes in obuf */
 	unsigned	  ostatus;		/* output running status */
-	unsigned char	  obuf[MIDIDEV_BUFLEN];	/* output buffer */
+	unsigned	  ocongest;		/* above high-water mark */
+	unsigned long	  odrops;		/* events dropped */
+	unsigned char	  obuf[MIDIDEV_BUFLEN];	/* output ring */
+	unsigned	  onative;		/* events queued with putev */
+
+	/*
+	 * output scheduler, used if orate > 0
+	 */
+	unsigned	  orate;		/* bytes per second */
+	unsigned long	  owire;		/* time the wire becomes idle */
+	unsigned long	  ostarttime;		/* time the device was opened */
+	unsigned long long obusy;		/* time the wire was busy */
+	unsigned long	  obytes;		/* bytes sent */
+	unsigned long	  omerged;		/* events merged */
+	struct timo	  oschedto;		/* to send pending events */
+	unsigned	  npend;		/* events in opend[] */
+	struct ev	  opend[MIDIDEV_NPEND];	/* pending continuous events */
 };
 
 void mididev_init(struct mididev *, struct devops *, unsigned);
 void mididev_done(struct mididev *);
 void mididev_flush(struct mididev *);
+void mididev_drain(struct mididev *);
 void mididev_putstart(struct mididev *);
 void mididev_putstop(struct mididev *);
 void mididev_puttic(struct mididev *);
 void mididev_putack(struct mididev *);
 void mididev_putev(struct mididev *, struct ev *);
+void mididev_putevs(struct mididev *, struct ev *, unsigned);
 void mididev_sendraw(struct mididev *, unsigned char *, unsigned);
 void mididev_open(struct mididev *);
 void mididev_close(struct mididev *);
 void mididev_inputcb(struct mididev *, unsigned char *, unsigned);
-
-void mtc_timo(struct mtc *); /* XXX, use timeouts */
+void mididev_evcb(struct mididev *, struct ev *);
 
 extern unsigned mididev_debug;
 
@@ -153,6 +213,8 @@ extern struct mididev *mididev_clksrc;
 extern struct mididev *mididev_mtcsrc;
 extern struct mididev *mididev_byunit[];
 
+int loop_match(char *);
+struct mididev *loop_new(char *, unsigned);
 struct mididev *raw_new(char *, unsigned);
 struct mididev *alsa_new(char *, unsigned);
 struct mididev *sndio_new(char *, unsigned);
@@ -39,6 +39,7 @@
 #include "mux.h"
 #include "timo.h"
 #include "state.h"
+#include "hist.h"
 
 #define MIXOUT_TIMO (1000000UL)
 #define MIXOUT_MAXTICS 24
@@ -69,8 +70,8 @@ mixout_stop(void)
 	statelist_done(&mixout_slist);
 }
 
-void
-mixout_putev(struct ev *ev, unsigned id)
+static void
+mixout_doputev(struct ev *ev, unsigned id)
 {
 	struct state *os;
 	struct ev ca;
@@ -109,6 +110,16 @@ mixout_putev(struct ev *ev, unsigned id)
 	}
 }
 
+void
+mixout_putev(struct ev *ev, unsigned id)
+{
+	unsigned long start;
+
+	start = hist_mdep_nsec();
+	mixout_doputev(ev, id);
+	HIST_ACC(HIST_PUTEV, start);
+}
+
 void
 mixout_timocb(void *addr)
 {
@@ -67,6 +67,8 @@
 #include "timo.h"
 #include "state.h"
 #include "conv.h"
+#include "hist.h"
+#include "textio.h"
 
 #include "norm.h"
 #include "mixout.h"
@@ -89,6 +91,22 @@ unsigned mux_manualstart = 1;
 void *mux_addr;
 unsigned long mux_wallclock;
 
+/*
+ * while a tick is processed, how late it is (in 24th of microsecond),
+ * so mux_wallclock - mux_ticlate is the time the tick was due
+ */
+unsigned long mux_ticlate;
+unsigned mux_flushdefer = 0;
+
+/*
+ * in freewheel mode, the clock is virtual: devices are not opened,
+ * mux_timercb() is called by mux_fwstep() as soon as possible, and
+ * output is written to mux_fwout, prefixed by the virtual time
+ */
+unsigned mux_freewheel = 0;
+struct textout *mux_fwout;
+unsigned long mux_fwnev;
+
 struct statelist mux_istate, mux_ostate;
 
 const char *mux_phasestr[] = {"STARTWAIT", "START", "FIRST", "NEXT", "STOP"};
@@ -127,23 +145,27 @@ mux_open(void)
 	 */
 	mux_ticrate = DEFAULT_TPU;
 
+	/*
+	 * devices use the clock as time origin
+	 */
+	mux_wallclock = 0;
+	mux_ticlate = 0;
+
 	/*
 	 * reset tic counters of devices
 	 */
 	mux_isopen = 1;
 	for (i = mididev_list; i != NULL; i = i->next) {
 		i->ticdelta = i->ticrate;
-		i->isensto = 0;
-		i->osensto = MIDIDEV_OSENSTO;
 		mididev_open(i);
 	}
-	mux_mdep_open();
+	if (!mux_freewheel)
+		mux_mdep_open();
 
 	mux_curpos = 0;
 	mux_nextpos = 0;
 	mux_reqphase = MUX_STOP;
 	mux_phase = MUX_STOP;
-	mux_wallclock = 0;
 	log_sync = 0;
 }
 
@@ -166,7 +188,8 @@ mux_close(void)
 		}
 		mididev_close(i);
 	}
-	mux_mdep_close();
+	if (!mux_freewheel)
+		mux_mdep_close();
 	mux_isopen = 0;
 	statelist_done(&mux_ostate);
 	statelist_done(&mux_istate);
@@ -252,7 +275,7 @@ mux_putev(struct ev *ev)
 	unsigned unit;
 	struct mididev *dev;
 	struct ev rev[CONV_NUMREV];
-	unsigned i, nev;
+	unsigned nev;
 
 #ifdef MUX_DEBUG
 	if (mux_debug) {
@@ -269,13 +292,12 @@ mux_putev(struct ev *ev)
 		logx(0, "%s: {ev:%p}: bad dev number", __func__, ev);
 		panic();
 	}
+	mux_fwnev++;
 	dev = mididev_byunit[unit];
 	if (dev != NULL) {
 		nev = conv_unpackev(&mux_ostate,
 		    dev->oxctlset, dev->oevset, ev, rev);
-		for (i = 0; i < nev; i++) {
-			mididev_putev(dev, &rev[i]);
-		}
+		mididev_putevs(dev, rev, nev);
 	}
 }
 
@@ -356,8 +378,10 @@ mux_mtctick(unsigned delta)
 	mux_curpos += delta;
 
 	while (mux_curpos >= mux_nextpos) {
+		hist_put(HIST_TICLATE, (mux_curpos - mux_nextpos) / 24);
 		mux_curpos -= mux_nextpos;
 		mux_nextpos = mux_ticlength;
+		mux_ticlate = mux_curpos;
 
 		/*
 		 * if in manual mode, dont trigger the 0-th tick (ie
@@ -366,6 +390,7 @@ mux_mtctick(unsigned delta)
 		if (!mux_manualstart || mux_phase != MUX_START)
 			mux_ticcb();
 	}
+	mux_ticlate = 0;
 }
 
 /*
@@ -394,7 +419,7 @@ mux_mtcstop(void)
 void
 mux_timercb(unsigned long delta)
 {
-	struct mididev *dev;
+	mux_flushbegin();
 
 	/*
 	 * update wall clock
@@ -407,38 +432,6 @@ mux_timercb(unsigned long delta)
 	 */
 	timo_update(delta);
 
-	/*
-	 * handle timeouts not using the timo.c interface
-	 * XXX: convert this to timo_xxx() routines
-	 */
-	for (dev = mididev_list; dev != NULL; dev = dev->next) {
-		if (dev->isensto) {
-			if (dev->isensto <= delta) {
-				dev->isensto = 0;
-				logx(1, "%u: sensing timeout, disabled", dev->unit);
-			} else {
-				dev->isensto -= delta;
-			}
-		}
-		if (dev->osensto) {
-			if (dev->osensto <= delta) {
-				mididev_putack(dev);
-				mididev_flush(dev);
-				dev->osensto = MIDIDEV_OSENSTO;
-			} else {
-				dev->osensto -= delta;
-			}
-		}
-		if (dev->imtc.timo) {
-			if (dev->imtc.timo <= delta) {
-				dev->imtc.timo = 0;
-				mtc_timo(&dev->imtc);
-			} else {
-				dev->imtc.timo -= delta;
-			}
-		}
-	}
-
 	/*
 	 * if there's no ext MTC source, then generate one internally
 	 * using the current sequencer state as hints
@@ -465,6 +458,42 @@ mux_timercb(unsigned long delta)
 			break;
 		}
 	}
+	mux_flushend();
+}
+
+/*
+ * store in the given location the time until mux_timercb() must be
+ * called next, either to run a timeout or to generate the next
+ * tick. Return 0 if there's nothing to wait for, in which case the
+ * clock may be stopped until the next input event.
+ */
+int
+mux_deadline(unsigned long *delta)
+{
+	unsigned long next;
+	unsigned timo;
+	int have;
+
+	have = 0;
+	next = 0;
+	if (!mididev_mtcsrc && !mididev_clksrc) {
+		switch (mux_phase) {
+		case MUX_START:
+		case MUX_FIRST:
+		case MUX_NEXT:
+			next = (mux_nextpos > mux_curpos) ?
+			    mux_nextpos - mux_curpos : 0;
+			have = 1;
+			break;
+		}
+	}
+	if (timo_next(&timo)) {
+		if (!have || timo < next)
+			next = timo;
+		have = 1;
+	}
+	*delta = next;
+	return have;
 }
 
 /*
@@ -479,6 +508,7 @@ mux_ticcb(void)
 			mididev_clksrc->ticdelta += mux_ticrate;
 			break;
 		}
+		hist_ticstart();
 		if (mux_phase == MUX_FIRST) {
 			mux_chgphase(MUX_NEXT);
 		} else if (mux_phase == MUX_START) {
@@ -495,6 +525,7 @@ mux_ticcb(void)
 			mux_sendtic();
 			song_startcb(usong);
 		}
+		hist_ticend();
 		if (mididev_clksrc == NULL)
 			break;
 		mididev_clksrc->ticdelta -= mididev_clksrc->ticrate;
@@ -551,9 +582,9 @@ mux_ackcb(unsigned unit)
 {
 	struct mididev *dev = mididev_byunit[unit];
 
-	if (dev->isensto == 0) {
+	if (!dev->isensto.set) {
 		logx(1, "%u: sensing enabled", dev->unit);
-		dev->isensto = MIDIDEV_ISENSTO;
+		timo_add(&dev->isensto, MIDIDEV_ISENSTO);
 	}
 }
 
@@ -655,18 +686,40 @@ mux_sysexcb(unsigned unit, struct sysex *sysex)
 }
 
 /*
- * flush all devices
+ * flush all devices, unless flushes are deferred
  */
 void
 mux_flush(void)
 {
 	struct mididev *dev;
 
+	if (mux_flushdefer > 0)
+		return;
 	for (dev = mididev_list; dev != NULL; dev = dev->next) {
 		mididev_flush(dev);
 	}
 }
 
+/*
+ * defer mux_flush() calls until the matching mux_flushend() call, so
+ * everything produced during a clock update or while processing a
+ * burst of input is written with a single write per device
+ */
+void
+mux_flushbegin(void)
+{
+	mux_flushdefer++;
+}
+
+void
+mux_flushend(void)
+{
+	if (--mux_flushdefer == 0) {
+		mux_flush();
+		hist_flushend();
+	}
+}
+
 /*
  * return the current phase
  */
@@ -785,3 +838,60 @@ mux_gotoreq(unsigned mmcpos)
 	}
 }
 
+/*
+ * enter freewheel mode, output will be written in the given file;
+ * must be called before the mux is opened
+ */
+int
+mux_fwopen(char *filename)
+{
+	mux_fwout = textout_new(filename);
+	if (mux_fwout == NULL)
+		return 0;
+	mux_fwnev = 0;
+	mux_freewheel = 1;
+	return 1;
+}
+
+/*
+ * leave freewheel mode, must be called after the mux is closed
+ */
+void
+mux_fwclose(void)
+{
+	textout_delete(mux_fwout);
+	mux_fwout = NULL;
+	mux_freewheel = 0;
+}
+
+/*
+ * advance the virtual clock to the next deadline. Return 0 if there
+ * is nothing to wait for.
+ */
+int
+mux_fwstep(void)
+{
+	unsigned long delta;
+
+	if (!mux_deadline(&delta))
+		return 0;
+	mux_timercb(delta);
+	return 1;
+}
+
+/*
+ * write bytes sent to the given device, on a single line starting
+ * with the virtual time in microseconds and the device number
+ */
+void
+mux_fwwrite(unsigned unit, unsigned char *buf, unsigned len)
+{
+	textout_putlong(mux_fwout, mux_wallclock / 24);
+	textout_putstr(mux_fwout, " ");
+	textout_putlong(mux_fwout, unit);
+	while (len-- > 0) {
+		textout_putstr(mux_fwout, " ");
+		textout_putbyte(mux_fwout, *buf++);
+	}
+	textout_putstr(mux_fwout, "\n");
+}
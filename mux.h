@@ -44,10 +44,15 @@ extern struct song *usong;
 extern unsigned mux_isopen;
 extern unsigned mux_manualstart;
 extern unsigned long mux_wallclock;
+extern unsigned long mux_ticlate;
+extern unsigned mux_freewheel;
+extern unsigned long mux_fwnev;
 
 void song_startcb(struct song *);
 void song_stopcb(struct song *);
 void song_movecb(struct song *);
+unsigned song_needfill(struct song *);
+void song_fillcb(struct song *);
 void song_evcb(struct song *, struct ev *);
 void song_sysexcb(struct song *, struct sysex *);
 unsigned song_gotocb(struct song *, int, unsigned);
@@ -67,6 +72,8 @@ void mux_close(void);
 void mux_run(void);
 void mux_sleep(unsigned);
 void mux_flush(void);
+void mux_flushbegin(void);
+void mux_flushend(void);
 void mux_shut(void);
 void mux_putev(struct ev *);
 void mux_sendraw(unsigned, unsigned char *, unsigned);
@@ -77,12 +84,20 @@ void mux_chgticrate(unsigned);
 void mux_startreq(int);
 void mux_stopreq(void);
 void mux_gotoreq(unsigned);
+int mux_fwopen(char *);
+void mux_fwclose(void);
+int mux_fwstep(void);
 int mux_mdep_wait(int); /* XXX: hide this prototype */
+void mux_mdep_lock(void);
+void mux_mdep_unlock(void);
+void mux_mdep_intime(unsigned long long);
+extern int mux_mdep_rtprio, mux_mdep_rtcpu;
 
 /*
  * call-backs called by midi device drivers
  */
 void mux_timercb(unsigned long);
+int mux_deadline(unsigned long *);
 void mux_startcb(void);
 void mux_stopcb(void);
 void mux_ticcb(void);
@@ -90,6 +105,7 @@ void mux_ackcb(unsigned);
 void mux_evcb(unsigned, struct ev *);
 void mux_sysexcb(unsigned, struct sysex *);
 void mux_errorcb(unsigned);
+void mux_fwwrite(unsigned, unsigned char *, unsigned);
 
 void mux_mtcstart(unsigned);
 void mux_mtctick(unsigned);
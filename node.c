@@ -27,6 +27,7 @@
 #include "cons.h"
 #include "user.h"
 #include "textio.h"
+#include "mux.h"
 
 struct node *
 node_new(struct node_vmt *vmt, struct data *data)
@@ -241,13 +242,22 @@ node_exec_slist(struct node *o, struct exec *x, struct data **r)
 /*
  * execute a builtin function
  * if the function didn't set 'r', then set it to 'nil'
+ *
+ * builtins are the only code touching the song and the devices, so
+ * they are the only code running with the real-time thread locked;
+ * expressions, loops and procedure calls are evaluated without the
+ * lock, thus the clock may tick between two builtin calls
  */
 unsigned
 node_exec_builtin(struct node *o, struct exec *x, struct data **r)
 {
+	unsigned res;
 
-	if (!((unsigned (*)(struct exec *, struct data **))
-	    o->data->val.user)(x, r)) {
+	mux_mdep_lock();
+	res = ((unsigned (*)(struct exec *, struct data **))
+	    o->data->val.user)(x, r);
+	mux_mdep_unlock();
+	if (!res) {
 		return RESULT_ERR;
 	}
 	if (!*r) {
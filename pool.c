@@ -15,62 +15,163 @@
  */
 
 /*
- * a pool is a large memory block (the pool) that is split into
- * small blocks of equal size (pools entries). Its used for
- * fast allocation of pool entries. Free enties are on a singly
- * linked list
+ * a pool is a set of large memory blocks (slabs) that are split into
+ * small blocks of equal size (pools entries). Its used for fast
+ * allocation of pool entries. Free enties of each slab are on a
+ * singly linked list and slabs with free entries are on a doubly
+ * linked list, so allocating and freeing entries is O(1).
+ *
+ * When all entries are used a new slab is allocated, and when a slab
+ * becomes empty it's freed, so the pool can grow beyond its initial
+ * size instead of failing. To avoid calling malloc() and free()
+ * repeatedly when the usage oscillates around a slab boundary, one
+ * empty slab is kept around.
  */
 
+#include <stdint.h>
+#include <stdlib.h>
 #include "utils.h"
 #include "pool.h"
 
+/*
+ * minimum slab size, must be a power of two
+ */
+#define POOL_SLABSIZE	0x10000
+
+/*
+ * minimum number of entries per slab
+ */
+#define POOL_SLABMIN	16
+
 unsigned pool_debug = 0;
+struct pool *pool_list = NULL;
 
 /*
- * initialises a pool of "itemnum" elements of size "itemsize"
+ * allocate a new slab, link all its entries on its free list and make
+ * it available for allocations
  */
-void
-pool_init(struct pool *o, char *name, unsigned itemsize, unsigned itemnum)
+static struct poolslab *
+pool_addslab(struct pool *o)
 {
-	unsigned i;
+	struct poolslab *s;
 	unsigned char *p;
+	unsigned i;
+	void *m;
+
+	/* please gcc */
+	m = NULL;
+
+	if (posix_memalign(&m, o->slabsize, o->slabsize) != 0) {
+		logx(1, "%s: %s: out of memory", __func__, o->name);
+		panic();
+	}
+	s = m;
+	s->first = NULL;
+	s->used = 0;
 
 	/*
-	 * round item size to sizeof unsigned
+	 * create a linked list of all entries
 	 */
-	if (itemsize < sizeof(struct poolent)) {
-		itemsize = sizeof(struct poolent);
+	p = (unsigned char *)(s + 1);
+	for (i = o->slabnum; i != 0; i--) {
+		((struct poolent *)p)->next = s->first;
+		s->first = (struct poolent *)p;
+		p += o->itemsize;
 	}
-	itemsize += sizeof(unsigned) - 1;
-	itemsize &= ~(sizeof(unsigned) - 1);
 
-	o->data = xmalloc(itemsize * itemnum, "pool");
-	if (!o->data) {
-		logx(1, "%s: %s: out of memory", __func__, name);
-		panic();
+	/*
+	 * link to the list of all slabs and to the list of
+	 * slabs with free entries
+	 */
+	s->next = o->slabs;
+	s->prev = &o->slabs;
+	if (s->next)
+		s->next->prev = &s->next;
+	o->slabs = s;
+	s->anext = o->avail;
+	s->aprev = &o->avail;
+	if (s->anext)
+		s->anext->aprev = &s->anext;
+	o->avail = s;
+
+	o->nslabs++;
+	o->nempty++;
+	if (o->nslabs > o->maxslabs)
+		o->maxslabs = o->nslabs;
+#ifdef POOL_DEBUG
+	if (pool_debug && o->nslabs > o->minslabs) {
+		logx(1, "%s: %s: growing to %u slabs", __func__,
+		    o->name, o->nslabs);
 	}
-	o->first = NULL;
-	o->itemsize = itemsize;
-	o->itemnum = itemnum;
-	o->name = name;
+#endif
+	return s;
+}
+
+/*
+ * unlink the given empty slab and give it back to the system
+ */
+static void
+pool_rmslab(struct pool *o, struct poolslab *s)
+{
+	*s->prev = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	*s->aprev = s->anext;
+	if (s->anext)
+		s->anext->aprev = s->aprev;
+	o->nslabs--;
+	o->nempty--;
 #ifdef POOL_DEBUG
-	o->maxused = 0;
-	o->used = 0;
-	o->newcnt = 0;
+	if (pool_debug) {
+		logx(1, "%s: %s: shrinking to %u slabs", __func__,
+		    o->name, o->nslabs);
+	}
 #endif
+	free(s);
+}
 
+/*
+ * initialises a pool of "itemsize" elements, with
+ * enough slabs preallocated to hold "itemnum" elements
+ */
+void
+pool_init(struct pool *o, char *name, unsigned itemsize, unsigned itemnum)
+{
 	/*
-	 * create a linked list of all entries
+	 * round item size to the alignment of pointers
 	 */
-	p = o->data;
-	for (i = itemnum; i != 0; i--) {
-		((struct poolent *)p)->next = o->first;
-		o->first = (struct poolent *)p;
-		p += itemsize;
-		o->itemnum++;
+	if (itemsize < sizeof(struct poolent)) {
+		itemsize = sizeof(struct poolent);
 	}
-}
+	itemsize += sizeof(struct poolent) - 1;
+	itemsize &= ~(sizeof(struct poolent) - 1);
+
+	/*
+	 * choose the smallest power of two slab size that
+	 * holds at least POOL_SLABMIN entries
+	 */
+	o->slabsize = POOL_SLABSIZE;
+	while (o->slabsize < sizeof(struct poolslab) + POOL_SLABMIN * itemsize)
+		o->slabsize <<= 1;
+	o->slabnum = (o->slabsize - sizeof(struct poolslab)) / itemsize;
 
+	o->slabs = NULL;
+	o->avail = NULL;
+	o->nslabs = 0;
+	o->nempty = 0;
+	o->minslabs = (itemnum + o->slabnum - 1) / o->slabnum;
+	o->itemsize = itemsize;
+	o->name = name;
+	o->maxused = 0;
+	o->used = 0;
+	o->newcnt = 0;
+	o->lastcnt = 0;
+	o->maxslabs = 0;
+	o->next = pool_list;
+	pool_list = o;
+	while (o->nslabs < o->minslabs)
+		pool_addslab(o);
+}
 
 /*
  * free the given pool
@@ -78,23 +179,31 @@ pool_init(struct pool *o, char *name, unsigned itemsize, unsigned itemnum)
 void
 pool_done(struct pool *o)
 {
-	xfree(o->data);
+	struct poolslab *s, *snext;
+	struct pool **p;
+
 #ifdef POOL_DEBUG
 	if (o->used != 0) {
 		logx(1, "%s: %s: WARNING: %u items still allocated", __func__, o->name, o->used);
 	}
+#endif
 	if (pool_debug) {
-		logx(1, "%s: %s: using %dkB, max = %d%%, allocs = %d%%", __func__,
-		    o->name, (1023 + o->itemnum * o->itemsize) / 1024,
-		    100 * o->maxused / o->itemnum,
-		    100 * o->newcnt / o->itemnum);
+		logx(1, "%s: %s: using %ukB, max = %u items, allocs = %lu, slabs = %u/%u", __func__,
+		    o->name, (1023 + o->maxslabs * o->slabsize) / 1024,
+		    o->maxused, o->newcnt, o->maxslabs, o->minslabs);
+	}
+	for (p = &pool_list; *p != o; p = &(*p)->next)
+		; /* nothing */
+	*p = o->next;
+	for (s = o->slabs; s != NULL; s = snext) {
+		snext = s->next;
+		free(s);
 	}
-#endif
 }
 
 /*
- * allocate an entry from the pool: just unlink
- * it from the free list and return the pointer
+ * allocate an entry from the pool: just unlink it from the free list
+ * of the first slab with free entries and return the pointer
  */
 void *
 pool_new(struct pool *o)
@@ -103,26 +212,36 @@ pool_new(struct pool *o)
 	unsigned i;
 	unsigned char *buf;
 #endif
-
+	struct poolslab *s;
 	struct poolent *e;
 
-	if (!o->first) {
-		logx(1, "%s: %s: pool is empty", __func__, o->name);
-		panic();
-	}
+	s = o->avail;
+	if (s == NULL)
+		s = pool_addslab(o);
 
 	/*
 	 * unlink from the free list
 	 */
-	e = o->first;
-	o->first = e->next;
+	e = s->first;
+	s->first = e->next;
+	if (s->used++ == 0)
+		o->nempty--;
+
+	/*
+	 * if the slab is full, remove it from the available list
+	 */
+	if (s->first == NULL) {
+		o->avail = s->anext;
+		if (s->anext)
+			s->anext->aprev = &o->avail;
+	}
 
-#ifdef POOL_DEBUG
 	o->newcnt++;
 	o->used++;
 	if (o->used > o->maxused)
 		o->maxused = o->used;
 
+#ifdef POOL_DEBUG
 	/*
 	 * overwrite the entry with garbage so any attempt to use
 	 * uninitialized memory will probably segfault
@@ -135,25 +254,30 @@ pool_new(struct pool *o)
 }
 
 /*
- * free an entry: just link it again on the free list
+ * free an entry: just link it again on the free list of its slab. If
+ * the slab becomes empty and there's already an empty slab, free it.
  */
 void
 pool_del(struct pool *o, void *p)
 {
 	struct poolent *e = (struct poolent *)p;
+	struct poolslab *s;
 #ifdef POOL_DEBUG
 	unsigned i;
 	unsigned char *buf;
+#endif
 
+	s = (struct poolslab *)((uintptr_t)p & ~((uintptr_t)o->slabsize - 1));
+
+#ifdef POOL_DEBUG
 	/*
 	 * check if we aren't trying to free more
 	 * entries than the poll size
 	 */
-	if (o->used == 0) {
+	if (o->used == 0 || s->used == 0) {
 		logx(1, "%s: %s: pool is full", __func__, o->name);
 		panic();
 	}
-	o->used--;
 
 	/*
 	 * overwrite the entry with garbage so any attempt to use a
@@ -163,9 +287,51 @@ pool_del(struct pool *o, void *p)
 	for (i = o->itemsize; i > 0; i--)
 		*(buf++) = 0xdf;
 #endif
+	o->used--;
+
+	/*
+	 * if the slab was full, make it available again
+	 */
+	if (s->first == NULL) {
+		s->anext = o->avail;
+		s->aprev = &o->avail;
+		if (s->anext)
+			s->anext->aprev = &s->anext;
+		o->avail = s;
+	}
+
 	/*
 	 * link on the free list
 	 */
-	e->next = o->first;
-	o->first = e;
+	e->next = s->first;
+	s->first = e;
+
+	if (--s->used == 0) {
+		o->nempty++;
+		if (o->nempty > 1 && o->nslabs > o->minslabs)
+			pool_rmslab(o, s);
+	}
+}
+
+/*
+ * display usage of all pools: current and max memory used by entries,
+ * memory used by slabs, and number of allocations (total and since
+ * the last call)
+ */
+void
+pool_dumpstats(void)
+{
+	struct pool *o;
+
+	logx(1, "%-12s %10s %10s %10s %10s %10s",
+	    "pool", "used", "max", "slabs", "allocs", "new");
+	for (o = pool_list; o != NULL; o = o->next) {
+		logx(1, "%-12s %8lukB %8lukB %8lukB %10lu %10lu",
+		    o->name,
+		    ((unsigned long)o->used * o->itemsize + 1023) / 1024,
+		    ((unsigned long)o->maxused * o->itemsize + 1023) / 1024,
+		    (unsigned long)o->nslabs * (o->slabsize / 1024),
+		    o->newcnt, o->newcnt - o->lastcnt);
+		o->lastcnt = o->newcnt;
+	}
 }
@@ -27,18 +27,38 @@ struct poolent {
 };
 
 /*
- * the pool is a linked list of 'itemnum' blocks of size
- * 'itemsize'. The pool name is for debugging prurposes only
+ * a slab is a memory block of 'slabsize' bytes, aligned to its size,
+ * starting with this header followed by 'slabnum' entries. Thanks to
+ * the alignment, the slab an entry belongs to is found by masking the
+ * entry address.
+ */
+struct poolslab {
+	struct poolslab *next, **prev;	/* list of all slabs */
+	struct poolslab *anext, **aprev; /* list of slabs with free entries */
+	struct poolent *first;		/* free entries of this slab */
+	unsigned used;			/* entries allocated in this slab */
+};
+
+/*
+ * the pool is a list of slabs of entries of size 'itemsize'. Slabs
+ * are allocated when all entries are used and freed once they are
+ * empty, but the pool never shrinks below 'minslabs' slabs (the
+ * initial size). The pool name is for debugging prurposes only
  */
 struct pool {
-	unsigned char *data;	/* memory block of the pool */
-	struct poolent *first;	/* head of linked list */
-#ifdef POOL_DEBUG
+	struct pool *next;		/* list of all pools */
+	struct poolslab *slabs;		/* all slabs */
+	struct poolslab *avail;		/* slabs with free entries */
 	unsigned maxused;	/* max pool usage */
 	unsigned used;		/* current pool usage */
-	unsigned newcnt;	/* current items allocated */
-#endif
-	unsigned itemnum;	/* total number of entries */
+	unsigned long newcnt;	/* total items allocated */
+	unsigned long lastcnt;	/* newcnt at the last pool_dumpstats() */
+	unsigned maxslabs;	/* max number of slabs */
+	unsigned nslabs;	/* current number of slabs */
+	unsigned nempty;	/* slabs with no entries allocated */
+	unsigned minslabs;	/* slabs that are never freed */
+	unsigned slabsize;	/* size of a slab, power of two */
+	unsigned slabnum;	/* number of entries per slab */
 	unsigned itemsize;	/* size of a sigle entry */
 	char *name;		/* name of the pool */
 };
@@ -48,5 +68,8 @@ void  pool_done(struct pool *);
 
 void *pool_new(struct pool *);
 void  pool_del(struct pool *, void *);
+void  pool_dumpstats(void);
+
+extern struct pool *pool_list;
 
 #endif /* MIDISH_POOL_H */
@@ -0,0 +1,5 @@
+load "filt.msh"
+fmap {any {0 0}} {any {1 1}}
+bsave "bsave_a0.tmp2"
+reset
+load "bsave_a0.tmp2"
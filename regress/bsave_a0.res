@@ -0,0 +1,11 @@
+{
+	songfilt f {
+		filt {
+			evmap any {7 4..15} > any {3 0..11}
+			evmap any {7 9} > any {3 8}
+			evmap note {7 9} 0..65 > note {3 8} 10..75
+        		evmap any {0 0} > any {1 1}
+		}
+	}
+	curfilt f
+}
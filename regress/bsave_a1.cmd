@@ -0,0 +1,4 @@
+load "time.msh"
+bsave "bsave_a1.tmp2"
+reset
+load "bsave_a1.tmp2"
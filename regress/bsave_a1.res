@@ -0,0 +1,25 @@
+{
+	format 1
+	tics_per_unit 96
+	tempo_factor 256
+	meta {
+		timesig 5 12
+		600
+		timesig 5 24
+		1200
+		timesig 5 12
+		600
+		timesig 4 24
+	}
+	curpos 0
+	curlen 0
+	curquant 0
+	curev any {0..127 0..15}
+	metro {
+		mask	rec
+		lo	non {0 9} 68 90
+		hi	non {0 9} 67 127
+	}
+	tap off
+	tapev none
+}
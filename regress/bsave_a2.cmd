@@ -0,0 +1,8 @@
+load "bank.msh"
+fnew f
+fmap {any {0 0}} {any {1 3}}
+ftransp {any {1 3}} 5
+fvcurve {any {1 3}} 20
+bsave "bsave_a2.tmp2"
+reset
+load "bsave_a2.tmp2"
@@ -0,0 +1,36 @@
+{
+	format 1
+	tics_per_unit 96
+	tempo_factor 256
+	meta {
+		timesig 4 24
+		tempo 500000
+	}
+	songfilt f {
+		filt {
+			evmap any {0 0} > any {1 3}
+			transp any {1 3} 5
+			vcurve any {1 3} 20
+		}
+	}
+	songtrk t {
+		mute 0
+		track {
+			240
+			xpc {0 0} nil 67
+			48
+		}
+	}
+	curfilt f
+	curpos 0
+	curlen 0
+	curquant 0
+	curev any {0..127 0..15}
+	metro {
+		mask	rec
+		lo	non {0 9} 68 90
+		hi	non {0 9} 67 127
+	}
+	tap off
+	tapev none
+}
@@ -0,0 +1,10 @@
+load "ctl.msh"
+evpat master {0xf0 0x7f 0x7f 0x04 0x01 v0_lo v0_hi 0xf7}
+xnew sx
+xadd 0 {0xf0 0x7e 0x7f 0x09 0x01 0xf7}
+onew out {1 2}
+tapev {note {0 5}}
+tap tempo
+bsave "bsave_a3.tmp2"
+reset
+load "bsave_a3.tmp2"
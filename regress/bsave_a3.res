@@ -0,0 +1,48 @@
+{
+	format 1
+	tics_per_unit 96
+	tempo_factor 256
+	meta {
+		timesig 4 24
+		tempo 500000
+	}
+	evpat master {
+		pattern 0xf0 0x7f 0x7f 0x04 0x01 v0_lo v0_hi 0xf7
+	}
+	songout out {
+		chan {1 2}
+		conf {
+		}
+	}
+	songfilt out {
+		filt {
+		}
+	}
+	songtrk t {
+		mute 0
+		track {
+			96
+			xctl {0 0} 7 8320 # 65
+		}
+	}
+	songsx sx {
+		sysex {
+			unit 0
+			data	0xf0 0x7e 0x7f 0x09 0x01 0xf7
+		}
+	}
+	curfilt out
+	cursx sx
+	curout out
+	curpos 0
+	curlen 0
+	curquant 0
+	curev any {0..127 0..15}
+	metro {
+		mask	rec
+		lo	non {0 9} 68 90
+		hi	non {0 9} 67 127
+	}
+	tap tempo
+	tapev note {0 5} 0..127
+}
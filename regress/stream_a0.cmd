@@ -0,0 +1,25 @@
+dnew 0 "null" wo
+load "tevmap.msh"
+g 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+export "stream_a0.tmp2"
+import "stream_a0.tmp2"
+g 0
+render "stream_a0.tmp3"
+stream "stream_a0.tmp2"
+g 0
+render "stream_a0.tmp4"
+reset
@@ -0,0 +1,25 @@
+dnew 0 "null" wo
+load "tevmap.msh"
+g 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+sel [mend]
+mdup 0
+export "stream_a1.tmp2"
+import "stream_a1.tmp2"
+g 700
+render "stream_a1.tmp3"
+stream "stream_a1.tmp2"
+g 700
+render "stream_a1.tmp4"
+reset
@@ -14,7 +14,14 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "utils.h"
 #include "name.h"
 #include "mididev.h"
@@ -2320,6 +2327,8 @@ song_load(struct song *o, char *filename)
 	struct load p;
 	unsigned res;
 
+	if (song_isbin(filename))
+		return song_bload(o, filename);
 	if (!load_init(&p, filename))
 		return 0;
 	res = load_empty(&p);
@@ -2329,3 +2338,978 @@ song_load(struct song *o, char *filename)
 	load_done(&p);
 	return res;
 }
+
+/* ---------------------------------------------------- binary format --- */
+
+/*
+ * The binary format holds the same data as the text format, but can
+ * be loaded without parsing. The file starts with a magic number (its
+ * first byte is 0, so it can't be confused with a text file) and the
+ * format version, followed by chunks. Each chunk starts with a 4-byte
+ * type and a 32-bit length, so unknown chunks can be skipped. Integers
+ * are 32-bit big endian, strings are prefixed by their 32-bit length.
+ *
+ * Tracks are stored as arrays of 12-byte packed events, including the
+ * end-of-track event, in the order they are in memory. They are
+ * restored as is, without being packed again according to the current
+ * device setup. Similarly, filter rules are stored as the lists they
+ * are in memory, because adding them one by one may reorder them.
+ */
+#define BIN_VERSION	1
+#define BIN_EVSIZE	12
+
+char bin_magic[4] = { 0, 'M', 'S', 'B' };
+char bin_head[4] = { 'h', 'e', 'a', 'd' };	/* tpu, tempo factor */
+char bin_meta[4] = { 'm', 'e', 't', 'a' };	/* meta track */
+char bin_evpat[4] = { 'e', 'p', 'a', 't' };	/* sysex pattern */
+char bin_chan[4] = { 'c', 'h', 'a', 'n' };	/* songin/songout */
+char bin_filt[4] = { 'f', 'i', 'l', 't' };	/* songfilt */
+char bin_trk[4] = { 't', 'r', 'k', ' ' };	/* songtrk */
+char bin_sx[4] = { 's', 'x', ' ', ' ' };	/* songsx */
+char bin_cur[4] = { 'c', 'u', 'r', ' ' };	/* defaults, metro, tap */
+
+struct bin {
+	char *path;			/* for error messages */
+	unsigned char *data;		/* buffer */
+	unsigned char *p, *end;		/* read position, end of chunk */
+	unsigned char *fend;		/* end of data */
+	unsigned len, size;		/* used/allocated bytes, when writing */
+	unsigned chunk;			/* start of current chunk */
+	unsigned char patmap[EV_NPAT];	/* file to actual evpat cmd */
+};
+
+/*
+ * make room for at least 'n' more bytes in the buffer
+ */
+void
+bin_grow(struct bin *o, unsigned n)
+{
+	unsigned char *buf;
+	unsigned size;
+
+	if (o->len + n <= o->size)
+		return;
+	size = o->size;
+	while (size < o->len + n)
+		size *= 2;
+	buf = xmalloc(size, "bin");
+	memcpy(buf, o->data, o->len);
+	xfree(o->data);
+	o->data = buf;
+	o->size = size;
+}
+
+void
+bin_put32(struct bin *o, unsigned val)
+{
+	unsigned char *p;
+
+	bin_grow(o, 4);
+	p = o->data + o->len;
+	p[0] = (val >> 24) & 0xff;
+	p[1] = (val >> 16) & 0xff;
+	p[2] = (val >> 8) & 0xff;
+	p[3] = val & 0xff;
+	o->len += 4;
+}
+
+void
+bin_putstr(struct bin *o, char *str)
+{
+	unsigned n;
+
+	n = (str != NULL) ? strlen(str) : 0;
+	bin_put32(o, n);
+	bin_grow(o, n);
+	memcpy(o->data + o->len, str, n);
+	o->len += n;
+}
+
+/*
+ * start a chunk of the given type, its length is set by bin_endchunk()
+ */
+void
+bin_newchunk(struct bin *o, char *type)
+{
+	bin_grow(o, 8);
+	memcpy(o->data + o->len, type, 4);
+	o->chunk = o->len;
+	o->len += 8;
+}
+
+void
+bin_endchunk(struct bin *o)
+{
+	unsigned char *p = o->data + o->chunk + 4;
+	unsigned len = o->len - o->chunk - 8;
+
+	p[0] = (len >> 24) & 0xff;
+	p[1] = (len >> 16) & 0xff;
+	p[2] = (len >> 8) & 0xff;
+	p[3] = len & 0xff;
+}
+
+void
+bin_putev(struct bin *o, struct ev *ev)
+{
+	bin_put32(o, ev->cmd);
+	bin_put32(o, ev->dev);
+	bin_put32(o, ev->ch);
+	bin_put32(o, ev->v0);
+	bin_put32(o, ev->v1);
+}
+
+void
+bin_putevspec(struct bin *o, struct evspec *es)
+{
+	bin_put32(o, es->cmd);
+	bin_put32(o, es->dev_min);
+	bin_put32(o, es->dev_max);
+	bin_put32(o, es->ch_min);
+	bin_put32(o, es->ch_max);
+	bin_put32(o, es->v0_min);
+	bin_put32(o, es->v0_max);
+	bin_put32(o, es->v1_min);
+	bin_put32(o, es->v1_max);
+}
+
+/*
+ * store the track as an array of packed events; parameters not used
+ * by the event (all of them for the end-of-track) are stored as zeros,
+ * so saving the same song always gives the same file
+ */
+void
+bin_puttrack(struct bin *o, struct track *t)
+{
+	struct seqev_data d;
+	struct seqev *i;
+	struct evinfo *ei;
+	struct ev ev;
+	unsigned char *p;
+	unsigned n;
+
+	n = track_numev(t);
+	bin_put32(o, n);
+	bin_grow(o, n * BIN_EVSIZE);
+	p = o->data + o->len;
+	for (i = t->first; i != NULL; i = i->next) {
+		ei = evinfo + i->ev.cmd;
+		ev.cmd = i->ev.cmd;
+		ev.dev = (ei->flags & EV_HAS_DEV) ? i->ev.dev : 0;
+		ev.ch = (ei->flags & EV_HAS_CH) ? i->ev.ch : 0;
+		ev.v0 = (ei->nparams > 0) ? i->ev.v0 : 0;
+		ev.v1 = (ei->nparams > 1) ? i->ev.v1 : 0;
+		seqev_pack(&d, i->delta, &ev);
+		p[0] = (d.delta >> 24) & 0xff;
+		p[1] = (d.delta >> 16) & 0xff;
+		p[2] = (d.delta >> 8) & 0xff;
+		p[3] = d.delta & 0xff;
+		p[4] = d.cmd;
+		p[5] = d.dev;
+		p[6] = d.ch;
+		p[7] = d.v0_hi;
+		p[8] = d.v0 >> 8;
+		p[9] = d.v0 & 0xff;
+		p[10] = d.v1 >> 8;
+		p[11] = d.v1 & 0xff;
+		p += BIN_EVSIZE;
+	}
+	o->len += n * BIN_EVSIZE;
+}
+
+/*
+ * store the filter rules in the order they are in memory, so the
+ * filter is restored as is, rather than rebuilt rule by rule
+ */
+void
+bin_putfilt(struct bin *o, struct filt *f)
+{
+	struct filtnode *s, *d;
+	unsigned n;
+
+	n = 0;
+	for (s = f->map; s != NULL; s = s->next)
+		n++;
+	bin_put32(o, n);
+	for (s = f->map; s != NULL; s = s->next) {
+		bin_putevspec(o, &s->es);
+		n = 0;
+		for (d = s->dstlist; d != NULL; d = d->next)
+			n++;
+		bin_put32(o, n);
+		for (d = s->dstlist; d != NULL; d = d->next)
+			bin_putevspec(o, &d->es);
+	}
+	n = 0;
+	for (s = f->transp; s != NULL; s = s->next)
+		n++;
+	bin_put32(o, n);
+	for (s = f->transp; s != NULL; s = s->next) {
+		bin_putevspec(o, &s->es);
+		bin_put32(o, s->u.transp.plus & 0x7f);
+	}
+	n = 0;
+	for (s = f->vcurve; s != NULL; s = s->next)
+		n++;
+	bin_put32(o, n);
+	for (s = f->vcurve; s != NULL; s = s->next) {
+		bin_putevspec(o, &s->es);
+		bin_put32(o, (64 - s->u.vel.nweight) & 0x7f);
+	}
+}
+
+void
+bin_putsong(struct bin *o, struct song *s)
+{
+	struct songtrk *t;
+	struct songchan *i;
+	struct songfilt *g;
+	struct songsx *l;
+	struct sysex *sx;
+	struct chunk *c;
+	unsigned char *p;
+	unsigned cmd, n;
+
+	memcpy(o->data, bin_magic, 4);
+	o->len = 4;
+	bin_put32(o, BIN_VERSION);
+
+	bin_newchunk(o, bin_head);
+	bin_put32(o, s->tics_per_unit);
+	bin_put32(o, s->tempo_factor);
+	bin_endchunk(o);
+
+	bin_newchunk(o, bin_meta);
+	bin_puttrack(o, &s->meta);
+	bin_endchunk(o);
+
+	for (cmd = EV_PAT0; cmd < EV_PAT0 + EV_NPAT; cmd++) {
+		if (evinfo[cmd].ev == NULL)
+			continue;
+		bin_newchunk(o, bin_evpat);
+		bin_put32(o, cmd - EV_PAT0);
+		bin_putstr(o, evinfo[cmd].ev);
+		p = evinfo[cmd].pattern;
+		for (n = 0; n < EV_PATSIZE; n++) {
+			if (p[n] == 0xf7) {
+				n++;
+				break;
+			}
+		}
+		bin_put32(o, n);
+		bin_grow(o, n);
+		memcpy(o->data + o->len, p, n);
+		o->len += n;
+		bin_endchunk(o);
+	}
+	SONG_FOREACH_CHAN(s, i) {
+		bin_newchunk(o, bin_chan);
+		bin_putstr(o, i->name.str);
+		bin_put32(o, i->isinput);
+		bin_put32(o, i->dev);
+		bin_put32(o, i->ch);
+		bin_puttrack(o, &i->conf);
+		bin_endchunk(o);
+	}
+	SONG_FOREACH_FILT(s, g) {
+		bin_newchunk(o, bin_filt);
+		bin_putstr(o, g->name.str);
+		bin_putfilt(o, &g->filt);
+		bin_endchunk(o);
+	}
+	SONG_FOREACH_TRK(s, t) {
+		bin_newchunk(o, bin_trk);
+		bin_putstr(o, t->name.str);
+		bin_putstr(o, t->curfilt ? t->curfilt->name.str : NULL);
+		bin_put32(o, t->mute);
+		bin_puttrack(o, &t->track);
+		bin_endchunk(o);
+	}
+	SONG_FOREACH_SX(s, l) {
+		bin_newchunk(o, bin_sx);
+		bin_putstr(o, l->name.str);
+		n = 0;
+		for (sx = l->sx.first; sx != NULL; sx = sx->next)
+			n++;
+		bin_put32(o, n);
+		for (sx = l->sx.first; sx != NULL; sx = sx->next) {
+			bin_put32(o, sx->unit);
+			n = 0;
+			for (c = sx->first; c != NULL; c = c->next)
+				n += c->used;
+			bin_put32(o, n);
+			bin_grow(o, n);
+			for (c = sx->first; c != NULL; c = c->next) {
+				memcpy(o->data + o->len, c->data, c->used);
+				o->len += c->used;
+			}
+		}
+		bin_endchunk(o);
+	}
+
+	bin_newchunk(o, bin_cur);
+	bin_putstr(o, s->curtrk ? s->curtrk->name.str : NULL);
+	bin_putstr(o, s->curfilt ? s->curfilt->name.str : NULL);
+	bin_putstr(o, s->cursx ? s->cursx->name.str : NULL);
+	bin_putstr(o, s->curin ? s->curin->name.str : NULL);
+	bin_putstr(o, s->curout ? s->curout->name.str : NULL);
+	bin_put32(o, s->curpos);
+	bin_put32(o, s->curlen);
+	bin_put32(o, s->curquant);
+	bin_putevspec(o, &s->curev);
+	bin_put32(o, s->metro.mask);
+	bin_putev(o, &s->metro.lo);
+	bin_putev(o, &s->metro.hi);
+	bin_put32(o, s->tap_mode);
+	bin_putevspec(o, &s->tap_evspec);
+	bin_endchunk(o);
+}
+
+/*
+ * save the song in binary format
+ */
+void
+song_bsave(struct song *s, char *filename)
+{
+	struct bin o;
+	FILE *f;
+
+	f = fopen(filename, "w");
+	if (f == NULL) {
+		logx(1, "%s: failed to open output file", filename);
+		return;
+	}
+	o.size = 0x10000;
+	o.data = xmalloc(o.size, "bin");
+	bin_putsong(&o, s);
+	if (fwrite(o.data, 1, o.len, f) != o.len)
+		logx(1, "%s: failed to write file", filename);
+	if (fclose(f) != 0)
+		logx(1, "%s: failed to close file", filename);
+	xfree(o.data);
+}
+
+void
+bin_err(struct bin *o, char *msg)
+{
+	logx(1, "%s: %s", o->path, msg);
+}
+
+unsigned
+bin_get32(struct bin *o, unsigned *val)
+{
+	unsigned char *p = o->p;
+
+	if (o->end - p < 4) {
+		bin_err(o, "truncated chunk");
+		return 0;
+	}
+	*val = (p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+	o->p += 4;
+	return 1;
+}
+
+/*
+ * read a number in the given range
+ */
+unsigned
+bin_getnum(struct bin *o, unsigned min, unsigned max, unsigned *val)
+{
+	if (!bin_get32(o, val))
+		return 0;
+	if (*val < min || *val > max) {
+		bin_err(o, "number out of range");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * read a string into the given buffer
+ */
+unsigned
+bin_getstr(struct bin *o, char *buf, unsigned size)
+{
+	unsigned i, n, c;
+
+	if (!bin_get32(o, &n))
+		return 0;
+	if (n >= size || (unsigned)(o->end - o->p) < n) {
+		bin_err(o, "bad string");
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		/*
+		 * only identifiers are stored
+		 */
+		c = o->p[i];
+		if (!(c == '_' || (c >= 'a' && c <= 'z') ||
+			(c >= 'A' && c <= 'Z') ||
+			(i > 0 && c >= '0' && c <= '9'))) {
+			bin_err(o, "bad identifier");
+			return 0;
+		}
+		buf[i] = c;
+	}
+	buf[n] = 0;
+	o->p += n;
+	return 1;
+}
+
+unsigned
+bin_getev(struct bin *o, struct ev *ev)
+{
+	unsigned val[5];
+	unsigned i;
+
+	for (i = 0; i < 5; i++) {
+		if (!bin_get32(o, &val[i]))
+			return 0;
+	}
+	if (val[0] >= EV_NUMCMD || val[1] > EV_MAXDEV || val[2] > EV_MAXCH) {
+		bin_err(o, "bad event");
+		return 0;
+	}
+	ev->cmd = val[0];
+	ev->dev = val[1];
+	ev->ch = val[2];
+	ev->v0 = val[3];
+	ev->v1 = val[4];
+	return 1;
+}
+
+unsigned
+bin_getevspec(struct bin *o, struct evspec *es)
+{
+	unsigned val[9];
+	unsigned i;
+
+	for (i = 0; i < 9; i++) {
+		if (!bin_get32(o, &val[i]))
+			return 0;
+	}
+	if (val[0] >= EV_NUMCMD ||
+	    val[1] > val[2] || val[2] > EV_MAXDEV ||
+	    val[3] > val[4] || val[4] > EV_MAXCH ||
+	    val[5] > val[6] || val[7] > val[8]) {
+		bin_err(o, "bad event set");
+		return 0;
+	}
+	es->cmd = val[0];
+	es->dev_min = val[1];
+	es->dev_max = val[2];
+	es->ch_min = val[3];
+	es->ch_max = val[4];
+	es->v0_min = val[5];
+	es->v0_max = val[6];
+	es->v1_min = val[7];
+	es->v1_max = val[8];
+	return 1;
+}
+
+/*
+ * check that event parameters are in the ranges load_ev() accepts
+ */
+unsigned
+bin_chkev(struct ev *ev)
+{
+	struct evinfo *ei = evinfo + ev->cmd;
+
+	switch (ev->cmd) {
+	case EV_TEMPO:
+		return ev->tempo_usec24 >= TEMPO_MIN &&
+		    ev->tempo_usec24 <= TEMPO_MAX;
+	case EV_TIMESIG:
+		return ev->timesig_beats >= 1 &&
+		    ev->timesig_beats <= TIMESIG_BEATS_MAX &&
+		    ev->timesig_tics >= 1 &&
+		    ev->timesig_tics <= TIMESIG_TICS_MAX;
+	case EV_NRPN:
+	case EV_RPN:
+		return ev->v0 <= EV_MAXFINE && ev->v1 <= EV_MAXFINE;
+	case EV_XCTL:
+		return ev->v0 <= EV_MAXCOARSE && ev->v1 <= EV_MAXFINE;
+	case EV_XPC:
+		return (ev->v0 == EV_UNDEF || ev->v0 <= EV_MAXFINE) &&
+		    ev->v1 <= EV_MAXCOARSE;
+	case EV_NON:
+	case EV_NOFF:
+	case EV_CTL:
+	case EV_KAT:
+		return ev->v0 <= EV_MAXCOARSE && ev->v1 <= EV_MAXCOARSE;
+	case EV_CAT:
+		return ev->v0 <= EV_MAXCOARSE;
+	case EV_BEND:
+		return ev->v0 <= EV_MAXFINE;
+	default:
+		if (!EV_ISSX(ev) || ei->ev == NULL)
+			return 0;
+		if (ei->nparams >= 1 && ev->v0 > ei->v0_max)
+			return 0;
+		if (ei->nparams >= 2 && ev->v1 > ei->v1_max)
+			return 0;
+		return 1;
+	}
+}
+
+/*
+ * read an array of packed events and store it in the given track
+ */
+unsigned
+bin_gettrack(struct bin *o, struct track *t)
+{
+	struct seqev_data d;
+	struct seqev *se;
+	struct ev ev;
+	unsigned char *p;
+	unsigned i, n;
+
+	if (!bin_get32(o, &n))
+		return 0;
+	if (n == 0 || (unsigned)(o->end - o->p) / BIN_EVSIZE < n) {
+		bin_err(o, "bad track length");
+		return 0;
+	}
+	track_clear(t);
+	p = o->p;
+	for (i = 0; i < n; i++, p += BIN_EVSIZE) {
+		d.delta = (p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+		d.cmd = p[4];
+		d.dev = p[5];
+		d.ch = p[6];
+		d.v0_hi = p[7];
+		d.v0 = (p[8] << 8) + p[9];
+		d.v1 = (p[10] << 8) + p[11];
+		if ((d.cmd == EV_NULL) != (i == n - 1)) {
+			bin_err(o, "bad end of track");
+			goto err;
+		}
+		if (d.cmd == EV_NULL) {
+			t->eot.delta = d.delta;
+			break;
+		}
+		if (EV_ISSX(&d)) {
+			if (o->patmap[d.cmd - EV_PAT0] == 0) {
+				bin_err(o, "unknown sysex pattern in track");
+				goto err;
+			}
+			d.cmd = o->patmap[d.cmd - EV_PAT0];
+		}
+		if (d.cmd >= EV_NUMCMD || d.dev > EV_MAXDEV || d.ch > EV_MAXCH) {
+			bin_err(o, "bad event in track");
+			goto err;
+		}
+		seqev_unpack(&d, &ev);
+		if (!bin_chkev(&ev)) {
+			bin_err(o, "event parameter out of range");
+			goto err;
+		}
+		se = seqev_new();
+		se->ev = ev;
+		t->eot.delta = d.delta;
+		seqev_ins(&t->eot, se);
+	}
+	o->p += n * BIN_EVSIZE;
+	return 1;
+err:
+	track_clear(t);
+	return 0;
+}
+
+/*
+ * read filter rules, nodes are appended in the order they are stored
+ */
+unsigned
+bin_getfilt(struct bin *o, struct filt *f)
+{
+	struct evspec from, to;
+	struct filtnode **ps, **pd, *s, *d;
+	unsigned i, j, n, ndst, val;
+
+	filt_reset(f);
+	if (!bin_get32(o, &n))
+		return 0;
+	ps = &f->map;
+	for (i = 0; i < n; i++) {
+		if (!bin_getevspec(o, &from) || !bin_get32(o, &ndst))
+			return 0;
+		s = filtnode_new(&from, ps);
+		ps = &s->next;
+		pd = &s->dstlist;
+		for (j = 0; j < ndst; j++) {
+			if (!bin_getevspec(o, &to))
+				return 0;
+			if (to.cmd != EVSPEC_EMPTY && !evspec_isamap(&from, &to)) {
+				bin_err(o, "bad filter rule");
+				return 0;
+			}
+			d = filtnode_new(&to, pd);
+			pd = &d->next;
+		}
+	}
+	if (!bin_get32(o, &n))
+		return 0;
+	ps = &f->transp;
+	for (i = 0; i < n; i++) {
+		if (!bin_getevspec(o, &from) ||
+		    !bin_getnum(o, 0, EV_MAXCOARSE, &val))
+			return 0;
+		if ((from.cmd != EVSPEC_ANY && from.cmd != EVSPEC_NOTE) ||
+		    (from.cmd == EVSPEC_NOTE &&
+			(from.v0_min != 0 || from.v0_max != EV_MAXCOARSE))) {
+			bin_err(o, "bad transpose rule");
+			return 0;
+		}
+		s = filtnode_new(&from, ps);
+		s->u.transp.plus = val;
+		ps = &s->next;
+	}
+	if (!bin_get32(o, &n))
+		return 0;
+	ps = &f->vcurve;
+	for (i = 0; i < n; i++) {
+		if (!bin_getevspec(o, &from) ||
+		    !bin_getnum(o, 1, EV_MAXCOARSE, &val))
+			return 0;
+		if (from.cmd != EVSPEC_ANY && from.cmd != EVSPEC_NOTE) {
+			bin_err(o, "bad velocity curve rule");
+			return 0;
+		}
+		s = filtnode_new(&from, ps);
+		s->u.vel.nweight = (64 - val) & 0x7f;
+		ps = &s->next;
+	}
+	return 1;
+}
+
+unsigned
+bin_getevpat(struct bin *o)
+{
+	char ref[TOK_MAXLEN + 1], *name;
+	unsigned char *pattern;
+	unsigned cmd, fcmd, size;
+
+	if (!bin_getnum(o, 0, EV_NPAT - 1, &fcmd))
+		return 0;
+	if (!bin_getstr(o, ref, sizeof(ref)))
+		return 0;
+	if (!bin_getnum(o, 1, EV_PATSIZE, &size))
+		return 0;
+	if ((unsigned)(o->end - o->p) < size) {
+		bin_err(o, "truncated pattern");
+		return 0;
+	}
+
+	/*
+	 * find a free slot, and remember it to translate events
+	 */
+	if (evpat_lookup(ref, &cmd))
+		evpat_unconf(cmd);
+	for (cmd = EV_PAT0;; cmd++) {
+		if (cmd == EV_PAT0 + EV_NPAT) {
+			bin_err(o, "too many sysex patterns");
+			return 0;
+		}
+		if (evinfo[cmd].ev == NULL)
+			break;
+	}
+	name = str_new(ref);
+	pattern = xmalloc(EV_PATSIZE, "evpat");
+	memcpy(pattern, o->p, size);
+	o->p += size;
+	if (!evpat_set(cmd, name, pattern, size)) {
+		str_delete(name);
+		xfree(pattern);
+		return 0;
+	}
+	o->patmap[fcmd] = cmd;
+	return 1;
+}
+
+unsigned
+bin_getsx(struct bin *o, struct songsx *l)
+{
+	struct sysex *sx;
+	unsigned i, j, n, unit, len;
+
+	if (!bin_get32(o, &n))
+		return 0;
+	for (i = 0; i < n; i++) {
+		if (!bin_getnum(o, 0, EV_MAXDEV, &unit))
+			return 0;
+		if (!bin_get32(o, &len))
+			return 0;
+		if ((unsigned)(o->end - o->p) < len) {
+			bin_err(o, "truncated sysex");
+			return 0;
+		}
+		sx = sysex_new(unit);
+		for (j = 0; j < len; j++)
+			sysex_add(sx, o->p[j]);
+		o->p += len;
+		sysexlist_put(&l->sx, sx);
+	}
+	return 1;
+}
+
+unsigned
+bin_getcur(struct bin *o, struct song *s)
+{
+	char name[5][TOK_MAXLEN + 1];
+	struct evspec es;
+	struct songtrk *t;
+	struct songfilt *g;
+	struct songsx *l;
+	struct songchan *i;
+	struct ev ev;
+	unsigned k, val;
+
+	for (k = 0; k < 5; k++) {
+		if (!bin_getstr(o, name[k], sizeof(name[k])))
+			return 0;
+	}
+	if (*name[0] && (t = song_trklookup(s, name[0])) != NULL)
+		s->curtrk = t;
+	if (*name[1] && (g = song_filtlookup(s, name[1])) != NULL)
+		s->curfilt = g;
+	if (*name[2] && (l = song_sxlookup(s, name[2])) != NULL)
+		s->cursx = l;
+	if (*name[3] && (i = song_chanlookup(s, name[3], 1)) != NULL)
+		song_setcurchan(s, i, 1);
+	if (*name[4] && (i = song_chanlookup(s, name[4], 0)) != NULL)
+		song_setcurchan(s, i, 0);
+	if (!bin_get32(o, &s->curpos) || !bin_get32(o, &s->curlen))
+		return 0;
+	if (!bin_getnum(o, 0, s->tics_per_unit, &s->curquant))
+		return 0;
+	if (!bin_getevspec(o, &es))
+		return 0;
+	s->curev = es;
+	if (!bin_get32(o, &val))
+		return 0;
+	metro_setmask(&s->metro, val);
+	for (k = 0; k < 2; k++) {
+		if (!bin_getev(o, &ev))
+			return 0;
+		if (ev.cmd != EV_NON) {
+			bin_err(o, "metronome click must be a 'non' event");
+			return 0;
+		}
+		if (k == 0)
+			s->metro.lo = ev;
+		else
+			s->metro.hi = ev;
+	}
+	if (!bin_getnum(o, SONG_TAP_OFF, SONG_TAP_TEMPO, &val))
+		return 0;
+	s->tap_mode = val;
+	if (!bin_getevspec(o, &es))
+		return 0;
+	s->tap_evspec = es;
+	return 1;
+}
+
+/*
+ * parse a chunk, the same way as the corresponding block of the
+ * text format
+ */
+unsigned
+bin_getchunk(struct bin *o, struct song *s, unsigned char *type)
+{
+	char name[TOK_MAXLEN + 1], fname[TOK_MAXLEN + 1];
+	struct songtrk *t;
+	struct songchan *i;
+	struct songfilt *g;
+	struct songsx *l;
+	unsigned val, dev, ch, input;
+
+	if (memcmp(type, bin_head, 4) == 0) {
+		if (!bin_get32(o, &val))
+			return 0;
+		if (val < 96 || val % 96 != 0) {
+			bin_err(o, "bad tics_per_unit");
+			return 0;
+		}
+		s->tics_per_unit = val;
+		if (!bin_getnum(o, 0x80, 0x200, &s->tempo_factor))
+			return 0;
+	} else if (memcmp(type, bin_meta, 4) == 0) {
+		if (!bin_gettrack(o, &s->meta))
+			return 0;
+	} else if (memcmp(type, bin_evpat, 4) == 0) {
+		if (!bin_getevpat(o))
+			return 0;
+	} else if (memcmp(type, bin_chan, 4) == 0) {
+		if (!bin_getstr(o, name, sizeof(name)) ||
+		    !bin_getnum(o, 0, 1, &input) ||
+		    !bin_getnum(o, 0, EV_MAXDEV, &dev) ||
+		    !bin_getnum(o, 0, EV_MAXCH, &ch))
+			return 0;
+		i = song_chanlookup(s, name, input);
+		if (i == NULL) {
+			i = song_channew(s, name, 0, 0, input);
+			song_setcurchan(s, NULL, input);
+			if (i->filt)
+				filt_reset(&i->filt->filt);
+		}
+		i->dev = dev;
+		i->ch = ch;
+		if (!bin_gettrack(o, &i->conf))
+			return 0;
+		track_setchan(&i->conf, i->dev, i->ch);
+	} else if (memcmp(type, bin_filt, 4) == 0) {
+		if (!bin_getstr(o, name, sizeof(name)))
+			return 0;
+		g = song_filtlookup(s, name);
+		if (!g) {
+			g = song_filtnew(s, name);
+			song_setcurfilt(s, NULL);
+		}
+		if (!bin_getfilt(o, &g->filt))
+			return 0;
+	} else if (memcmp(type, bin_trk, 4) == 0) {
+		if (!bin_getstr(o, name, sizeof(name)) ||
+		    !bin_getstr(o, fname, sizeof(fname)))
+			return 0;
+		t = song_trklookup(s, name);
+		if (t == NULL) {
+			t = song_trknew(s, name);
+			song_setcurtrk(s, NULL);
+		}
+		if (*fname) {
+			g = song_filtlookup(s, fname);
+			if (!g) {
+				g = song_filtnew(s, fname);
+				song_setcurfilt(s, NULL);
+			}
+			t->curfilt = g;
+		}
+		if (!bin_getnum(o, 0, 1, &t->mute))
+			return 0;
+		if (!bin_gettrack(o, &t->track))
+			return 0;
+	} else if (memcmp(type, bin_sx, 4) == 0) {
+		if (!bin_getstr(o, name, sizeof(name)))
+			return 0;
+		l = song_sxlookup(s, name);
+		if (!l) {
+			l = song_sxnew(s, name);
+			song_setcursx(s, NULL);
+		}
+		if (!bin_getsx(o, l))
+			return 0;
+	} else if (memcmp(type, bin_cur, 4) == 0) {
+		if (!bin_getcur(o, s))
+			return 0;
+	} else {
+		bin_err(o, "unknown chunk, ignored");
+		return 1;
+	}
+	if (o->p != o->end) {
+		bin_err(o, "chunk too long");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * return true if the given file is in binary format
+ */
+unsigned
+song_isbin(char *filename)
+{
+	unsigned char magic[4];
+	FILE *f;
+	size_t n;
+
+	f = fopen(filename, "r");
+	if (f == NULL)
+		return 0;
+	n = fread(magic, 1, 4, f);
+	fclose(f);
+	return n == 4 && memcmp(magic, bin_magic, 4) == 0;
+}
+
+/*
+ * load a song saved in binary format; the whole file is read with
+ * a single call, then parsed
+ */
+unsigned
+song_bload(struct song *s, char *filename)
+{
+	struct bin o;
+	struct stat sb;
+	unsigned char *type;
+	unsigned version, len;
+	size_t size, done;
+	ssize_t n;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		logx(1, "%s: failed to open file", filename);
+		return 0;
+	}
+	if (fstat(fd, &sb) < 0) {
+		logx(1, "%s: %s", filename, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	if (sb.st_size > UINT_MAX) {
+		logx(1, "%s: file too large", filename);
+		close(fd);
+		return 0;
+	}
+	size = sb.st_size;
+	o.path = filename;
+	o.data = xmalloc(size > 0 ? size : 1, "bin");
+	for (done = 0; done < size; done += n) {
+		n = read(fd, o.data + done, size - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			logx(1, "%s: %s", filename, strerror(errno));
+			close(fd);
+			goto err;
+		}
+		if (n == 0)
+			break;
+	}
+	close(fd);
+	memset(o.patmap, 0, sizeof(o.patmap));
+	o.fend = o.end = o.data + done;
+	if (done < 4 || memcmp(o.data, bin_magic, 4) != 0) {
+		bin_err(&o, "not a binary song file");
+		goto err;
+	}
+	o.p = o.data + 4;
+	if (!bin_get32(&o, &version))
+		goto err;
+	if (version > BIN_VERSION) {
+		logx(1, "Warning: midish version too old to read this file.");
+	}
+	while (o.p != o.fend) {
+		if (o.fend - o.p < 8) {
+			bin_err(&o, "truncated chunk header");
+			goto err;
+		}
+		type = o.p;
+		len = (o.p[4] << 24) + (o.p[5] << 16) + (o.p[6] << 8) + o.p[7];
+		o.p += 8;
+		if ((unsigned)(o.fend - o.p) < len) {
+			bin_err(&o, "truncated chunk");
+			goto err;
+		}
+		o.end = o.p + len;
+		if (!bin_getchunk(&o, s, type))
+			goto err;
+		o.p = o.end;
+	}
+	xfree(o.data);
+	return 1;
+err:
+	xfree(o.data);
+	return 0;
+}
@@ -47,6 +47,9 @@ unsigned track_load(struct track *, char *);
 
 void song_save(struct song *, char *);
 unsigned song_load(struct song *, char *);
+void song_bsave(struct song *, char *);
+unsigned song_isbin(char *);
+unsigned song_bload(struct song *, char *);
 
 
 #endif /* MIDISH_SAVELOAD_H */
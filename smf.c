@@ -14,10 +14,18 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef USE_THREADS
+#include <pthread.h>
+#endif
 
 #include "utils.h"
 #include "mididev.h"
@@ -28,6 +36,9 @@
 #include "cons.h"
 #include "frame.h"
 #include "conv.h"
+#include "mixout.h"
+#include "mux.h"
+#include "str.h"
 
 #define MAXTRACKNAME 100
 
@@ -39,10 +50,18 @@ unsigned smf_evlen[] = { 2, 2, 2, 2, 1, 1, 2, 0 };
 
 /* --------------------------------------------- chunk read/write --- */
 
+/*
+ * files are read in memory with a single call and parsed from there;
+ * when writing, each chunk is encoded in memory and written with
+ * stdio
+ */
 struct smf
 {
 	FILE *file;
-	unsigned length, index;		/* current chunk length/position */
+	unsigned length, index;		/* used/allocated bytes, when writing */
+	unsigned char *data;		/* whole file, or chunk buffer */
+	unsigned char *p, *end;		/* current position/end of chunk */
+	unsigned char *fend;		/* end of file */
 };
 
 /*
@@ -59,116 +78,93 @@ smf_open(struct smf *o, char *path, char *mode)
 	}
 	o->length = 0;
 	o->index = 0;
+	o->data = NULL;
 	return 1;
 }
 
 /*
- * close the file
- */
-void
-smf_close(struct smf *o)
-{
-	fclose(o->file);
-}
-
-/*
- * read a 32bit fixed-size number, return 0 on error
+ * load the whole file in memory, and initialize the smf structure
+ * for reading, return 0 on error
  */
 unsigned
-smf_get32(struct smf *o, unsigned *val)
+smf_load(struct smf *o, char *path)
 {
-	unsigned char buf[4];
-	if (o->index + 4 > o->length || fread(buf, 1, 4, o->file) != 4) {
-		logx(1, "failed to read 32bit number");
+	struct stat sb;
+	size_t size, done;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		logx(1, "%s: failed to open file", path);
 		return 0;
 	}
-	*val = (buf[0] << 24) + (buf[1] << 16) + (buf[2] << 8) + buf[3];
-	o->index += 4;
-	return 1;
-}
-
-/*
- * read a 24bit fixed-size number, return 0 on error
- */
-unsigned
-smf_get24(struct smf *o, unsigned *val)
-{
-	unsigned char buf[4];
-	if (o->index + 3 > o->length || fread(buf, 1, 3, o->file) != 3) {
-		logx(1, "failed to read 24bit number");
+	if (fstat(fd, &sb) < 0) {
+		logx(1, "%s: %s", path, strerror(errno));
+		close(fd);
 		return 0;
 	}
-	*val = (buf[0] << 16) + (buf[1] << 8) + buf[2];
-	o->index += 3;
-	return 1;
-}
-
-/*
- * read a 16bit fixed-size number, return 0 on error
- */
-unsigned
-smf_get16(struct smf *o, unsigned *val)
-{
-	unsigned char buf[4];
-	if (o->index + 2 > o->length || fread(buf, 1, 2, o->file) != 2) {
-		logx(1, "failed to read 16bit number");
+	if (sb.st_size > UINT_MAX) {
+		logx(1, "%s: file too large", path);
+		close(fd);
 		return 0;
 	}
-	*val =  (buf[0] << 8) + buf[1];
-	o->index += 2;
+	size = sb.st_size;
+	o->data = xmalloc(size > 0 ? size : 1, "smf");
+	for (done = 0; done < size; done += n) {
+		n = read(fd, o->data + done, size - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			logx(1, "%s: %s", path, strerror(errno));
+			xfree(o->data);
+			close(fd);
+			return 0;
+		}
+		if (n == 0)
+			break;
+	}
+	close(fd);
+	o->file = NULL;
+	o->p = o->end = o->data;
+	o->fend = o->data + done;
 	return 1;
 }
 
 /*
- * read a 8bit fixed-size number, return 0 on error
+ * close the file, return 0 if written data couldn't be flushed
  */
 unsigned
-smf_getc(struct smf *o, unsigned *res)
+smf_close(struct smf *o)
 {
-	int c;
-	if (o->index + 1 > o->length || (c = fgetc(o->file)) < 0) {
-		logx(1, "failed to read one byte");
+	if (o->data)
+		xfree(o->data);
+	if (o->file && fclose(o->file) != 0) {
+		logx(1, "failed to close file");
 		return 0;
 	}
-	o->index++;
-	*res = c & 0xff;
 	return 1;
 }
 
 /*
- * read a variable length number, return 0 on error
+ * read a 16bit fixed-size number, return 0 on error
  */
 unsigned
-smf_getvar(struct smf *o, unsigned *val)
+smf_get16(struct smf *o, unsigned *val)
 {
-	int c;
-	unsigned bits;
-	*val = 0;
-	bits = 0;
-	for (;;) {
-		if (o->index + 1 > o->length || (c = fgetc(o->file)) == EOF) {
-			logx(1, "failed to read varlength number");
-			return 0;
-		}
-		o->index++;
-		*val += (c & 0x7f);
-		if (!(c & 0x80)) {
-			break;
-		}
-		*val <<= 7;
-		bits += 7;
-		/*
-		 * smf spec forbids more than 32bit per integer
-		 */
-		if (bits > 32) {
-			logx(1, "overflow while reading varlength number");
-			return 0;
-		}
+	unsigned char *p = o->p;
+
+	if (o->end - p < 2) {
+		logx(1, "failed to read 16bit number");
+		return 0;
 	}
+	*val = (p[0] << 8) + p[1];
+	o->p += 2;
 	return 1;
 }
 
-
 /*
  * read a chunk header, compare it with ethe given 4-byte header and
  * initialize the smf structure so that other smf_getxxx can work.
@@ -177,150 +173,121 @@ smf_getvar(struct smf *o, unsigned *val)
 unsigned
 smf_getheader(struct smf *o, char *hdr)
 {
-	char buf[4];
+	unsigned char *p = o->p;
 	unsigned len;
-	if (o->index != o->length) {
+
+	if (p != o->end) {
 		logx(1, "chunk not finished");
 		return 0;
 	}
-	if (fread(buf, 1, 4, o->file) != 4) {
+	if (o->fend - p < 8) {
 		logx(1, "failed to read header");
 		return 0;
 	}
-	if (memcmp(buf, hdr, 4) != 0) {
+	if (memcmp(p, hdr, 4) != 0) {
 		logx(1, "header corrupted");
 		return 0;
 	}
-	o->index = 0;
-	o->length = 4;
-	if (!smf_get32(o, &len)) {
+	len = (p[4] << 24) + (p[5] << 16) + (p[6] << 8) + p[7];
+	p += 8;
+	if ((size_t)(o->fend - p) < len) {
+		logx(1, "chunk truncated");
 		return 0;
 	}
-	o->index = 0;
-	o->length = len;
+	o->p = p;
+	o->end = p + len;
 	return 1;
 }
 
 /*
- * in smf_putxxx routines there is a 'unsigned *used' argument if
- * (used == NULL) then data is not written in the smf structure, only
- * *user is incremented by the number of bytes that would be written
- * otherwise.  This is used to determine chunk's length
+ * chunks are encoded in memory, in a buffer growing as needed,
+ * and written to the file with a single call once complete. The
+ * first 8 bytes are reserved for the chunk header
  */
-
+#define SMF_BUFSIZE	0x10000
 
 /*
- * put a fixed-size 32-bit number
+ * make room for at least 'n' more bytes in the buffer
  */
 void
-smf_put32(struct smf *o, unsigned *used, unsigned val)
+smf_grow(struct smf *o, unsigned n)
 {
-	unsigned char buf[4];
-	if (used) {
-		(*used) += 4;
-	} else {
-		if (o->index + 4 > o->length) {
-			logx(1, "%s: bad chunk length", __func__);
-			panic();
-		}
-		buf[0] = (val >> 24) & 0xff;
-		buf[1] = (val >> 16) & 0xff;
-		buf[2] = (val >> 8) & 0xff;
-		buf[3] = val & 0xff;
-		fwrite(buf, 1, 4, o->file);
-		o->index += 4;
-	}
+	unsigned char *buf;
+	unsigned size;
+
+	if (o->length + n <= o->index)
+		return;
+	size = o->index;
+	while (size < o->length + n)
+		size *= 2;
+	buf = xmalloc(size, "smfbuf");
+	memcpy(buf, o->data, o->length);
+	xfree(o->data);
+	o->data = buf;
+	o->index = size;
 }
 
 /*
  * put a fixed-size 24-bit number
  */
 void
-smf_put24(struct smf *o, unsigned *used, unsigned val)
+smf_put24(struct smf *o, unsigned val)
 {
-	unsigned char buf[4];
-	if (used) {
-		(*used) += 3;
-	} else {
-		if (o->index + 3 > o->length) {
-			logx(1, "%s: bad chunk length", __func__);
-			panic();
-		}
-		buf[0] = (val >> 16) & 0xff;
-		buf[1] = (val >> 8) & 0xff;
-		buf[2] = val & 0xff;
-		fwrite(buf, 1, 3, o->file);
-		o->index += 3;
-	}
+	unsigned char *p;
+
+	smf_grow(o, 3);
+	p = o->data + o->length;
+	p[0] = (val >> 16) & 0xff;
+	p[1] = (val >> 8) & 0xff;
+	p[2] = val & 0xff;
+	o->length += 3;
 }
 
 /*
  * put a fixed-size 16-bit number
  */
 void
-smf_put16(struct smf *o, unsigned *used, unsigned val)
+smf_put16(struct smf *o, unsigned val)
 {
-	unsigned char buf[4];
-	if (used) {
-		(*used) += 2;
-	} else {
-		if (o->index + 2 > o->length) {
-			logx(1, "%s: bad chunk length", __func__);
-			panic();
-		}
-		buf[0] = (val >> 8) & 0xff;
-		buf[1] = val & 0xff;
-		fwrite(buf, 1, 2, o->file);
-		o->index += 2;
-	}
-}
+	unsigned char *p;
 
+	smf_grow(o, 2);
+	p = o->data + o->length;
+	p[0] = (val >> 8) & 0xff;
+	p[1] = val & 0xff;
+	o->length += 2;
+}
 
 /*
  * put a fixed-size 8-bit number
  */
 void
-smf_putc(struct smf *o, unsigned *used, unsigned val)
+smf_putc(struct smf *o, unsigned val)
 {
-	if (used) {
-		(*used) ++;
-	} else {
-		if (o->index + 1 > o->length) {
-			logx(1, "%s: bad chunk length", __func__);
-			panic();
-		}
-		fputc((int)val & 0xff, o->file);
-		o->index++;
-	}
+	smf_grow(o, 1);
+	o->data[o->length++] = val & 0xff;
 }
 
-
 /*
  * put a variable length number
  */
 void
-smf_putvar(struct smf *o, unsigned *used, unsigned val)
+smf_putvar(struct smf *o, unsigned val)
 {
 #define MAXBYTES 5			/* 32bit / 7bit = 4bytes + 4bit */
-	unsigned char buf[MAXBYTES];
-	unsigned index = 0, bits;
+	unsigned char *p;
+	unsigned bits;
+
+	smf_grow(o, MAXBYTES);
+	p = o->data + o->length;
 	for (bits = 7; bits < MAXBYTES * 7; bits += 7) {
 		if (val < (1U << bits)) {
 			bits -= 7;
 			for (; bits != 0; bits -= 7) {
-				buf[index++] = ((val >> bits) & 0x7f) | 0x80;
-			}
-			buf[index++] = val & 0x7f;
-			if (used) {
-				(*used) += index;
-			} else {
-				if (o->index + index > o->length) {
-					logx(1, "%s: bad chunk length", __func__);
-					panic();
-				}
-				o->index += index;
-				fwrite(buf, 1, index, o->file);
+				*p++ = ((val >> bits) & 0x7f) | 0x80;
 			}
+			*p++ = val & 0x7f;
+			o->length = p - o->data;
 			return;
 		}
 	}
@@ -330,24 +297,41 @@ smf_putvar(struct smf *o, unsigned *used, unsigned val)
 }
 
 /*
- * put the given chunk header with the given magic and size field
+ * start a new chunk, reserving space for its header
  */
 void
-smf_putheader(struct smf *o, char *hdr, unsigned len)
+smf_newchunk(struct smf *o)
 {
-	fwrite(hdr, 1, 4, o->file);
-	o->length = 4;
-	o->index = 0;
-	smf_put32(o, NULL, len);
-	o->length = len;
-	o->index = 0;
+	o->length = 8;
+}
+
+/*
+ * fill the header of the current chunk with the given magic and its
+ * size, and write it to the file. Return 0 on error
+ */
+unsigned
+smf_putchunk(struct smf *o, char *hdr)
+{
+	unsigned char *p = o->data;
+	unsigned len = o->length - 8;
+
+	memcpy(p, hdr, 4);
+	p[4] = (len >> 24) & 0xff;
+	p[5] = (len >> 16) & 0xff;
+	p[6] = (len >> 8) & 0xff;
+	p[7] = len & 0xff;
+	if (fwrite(p, 1, o->length, o->file) != o->length) {
+		logx(1, "failed to write chunk");
+		return 0;
+	}
+	return 1;
 }
 
 /*
  * store a track in the smf
  */
 void
-smf_puttrack(struct smf *o, unsigned *used, struct song *s, struct track *t)
+smf_puttrack(struct smf *o, struct song *s, struct track *t)
 {
 	struct seqev *pos;
 	unsigned status, newstatus, delta, chan, denom;
@@ -368,31 +352,31 @@ smf_puttrack(struct smf *o, unsigned *used, struct song *s, struct track *t)
 			nev = conv_unpackev(&slist, 0U,
 			    CONV_XPC | CONV_NRPN | CONV_RPN, &pos->ev, rev);
 			for (i = 0; i < nev; i++) {
-				smf_putvar(o, used, delta);
+				smf_putvar(o, delta);
 				delta = 0;
 				chan = rev[i].ch;
 				newstatus = (rev[i].cmd << 4) + (chan & 0x0f);
 				if (newstatus != status) {
 					status = newstatus;
-					smf_putc(o, used, status);
+					smf_putc(o, status);
 				}
 				if (rev[i].cmd == EV_BEND) {
-					smf_putc(o, used, rev[i].bend_val & 0x7f);
-					smf_putc(o, used, rev[i].bend_val >> 7);
+					smf_putc(o, rev[i].bend_val & 0x7f);
+					smf_putc(o, rev[i].bend_val >> 7);
 				} else {
-					smf_putc(o, used, rev[i].v0);
+					smf_putc(o, rev[i].v0);
 					if (SMF_EVLEN(status) == 2) {
-						smf_putc(o, used, rev[i].v1);
+						smf_putc(o, rev[i].v1);
 					}
 				}
 			}
 		} else if (pos->ev.cmd == EV_TEMPO) {
-			smf_putvar(o, used, delta);
+			smf_putvar(o, delta);
 			delta = 0;
-			smf_putc(o, used, 0xff);
-			smf_putc(o, used, 0x51);
-			smf_putc(o, used, 0x03);
-			smf_put24(o, used, pos->ev.tempo_usec24 * s->tics_per_unit / 96);
+			smf_putc(o, 0xff);
+			smf_putc(o, 0x51);
+			smf_putc(o, 0x03);
+			smf_put24(o, pos->ev.tempo_usec24 * s->tics_per_unit / 96);
 		} else if (pos->ev.cmd == EV_TIMESIG) {
 			denom = s->tics_per_unit / pos->ev.timesig_tics;
 			switch(denom) {
@@ -415,45 +399,52 @@ smf_puttrack(struct smf *o, unsigned *used, struct song *s, struct track *t)
 				logx(1, "%s: bad time signature", __func__);
 				panic();
 			}
-			smf_putvar(o, used, delta);
+			smf_putvar(o, delta);
 			delta = 0;
-			smf_putc(o, used, 0xff);
-			smf_putc(o, used, 0x58);
-			smf_putc(o, used, 0x04);
-			smf_putc(o, used, pos->ev.timesig_beats);
-			smf_putc(o, used, denom);
+			smf_putc(o, 0xff);
+			smf_putc(o, 0x58);
+			smf_putc(o, 0x04);
+			smf_putc(o, pos->ev.timesig_beats);
+			smf_putc(o, denom);
 			/* metronome tics per metro beat */
-			smf_putc(o, used, pos->ev.timesig_tics);
+			smf_putc(o, pos->ev.timesig_tics);
 			/* metronome 1/32 notes per 24 tics */
-			smf_putc(o, used, 8 * s->tics_per_unit / 96);
+			smf_putc(o, 8 * s->tics_per_unit / 96);
 		}
 
 	}
-	smf_putvar(o, used, delta);
-	smf_putc(o, used, 0xff);
-	smf_putc(o, used, 0x2f);
-	smf_putc(o, used, 0x00);
+	smf_putvar(o, delta);
+	smf_putc(o, 0xff);
+	smf_putc(o, 0x2f);
+	smf_putc(o, 0x00);
 	statelist_done(&slist);
 }
 
 /*
- * store a sysex in the smf
+ * store a sysex in the smf, without the leading 0xf0, preceded by
+ * its length
  */
 void
-smf_putsysex(struct smf *o, unsigned *used, struct sysex *sx)
+smf_putsysex(struct smf *o, struct sysex *sx)
 {
 	struct chunk *c;
-	unsigned i, first;
-
-	first = 1;
+	unsigned len, skip, n;
+
+	len = 0;
+	for (c = sx->first; c != NULL; c = c->next)
+		len += c->used;
+	smf_putvar(o, len - 1);
+	smf_grow(o, len);
+	skip = 1;
 	for (c = sx->first; c != NULL; c = c->next) {
-		for (i = 0; i < c->used; i++) {
-			if (first) {
-				first = 0;
-			} else {
-				smf_putc(o, used, c->data[i]);
-			}
+		if (c->used <= skip) {
+			skip -= c->used;
+			continue;
 		}
+		n = c->used - skip;
+		memcpy(o->data + o->length, c->data + skip, n);
+		o->length += n;
+		skip = 0;
 	}
 }
 
@@ -461,23 +452,19 @@ smf_putsysex(struct smf *o, unsigned *used, struct sysex *sx)
  * store a sysex back in the smf
  */
 void
-smf_putsx(struct smf *o, unsigned *used, struct song *s, struct songsx *songsx)
+smf_putsx(struct smf *o, struct song *s, struct songsx *songsx)
 {
-	unsigned sysexused;
 	struct sysex *sx;
 
 	for (sx = songsx->sx.first; sx != NULL; sx = sx->next) {
-		sysexused = 0;
-		smf_putvar(o, used, 0);
-		smf_putc(o, used, 0xf0);
-		smf_putsysex(o, &sysexused, sx);
-		smf_putvar(o, used, sysexused);
-		smf_putsysex(o, used, sx);
+		smf_putvar(o, 0);
+		smf_putc(o, 0xf0);
+		smf_putsysex(o, sx);
 	}
-	smf_putvar(o, used, 0);
-	smf_putc(o, used, 0xff);
-	smf_putc(o, used, 0x2f);
-	smf_putc(o, used, 0x00);
+	smf_putvar(o, 0);
+	smf_putc(o, 0xff);
+	smf_putc(o, 0x2f);
+	smf_putc(o, 0x00);
 }
 
 /*
@@ -490,11 +477,14 @@ song_exportsmf(struct song *o, char *filename)
 	struct songtrk *t;
 	struct songchan *i;
 	struct songsx *s;
-	unsigned ntrks, nchan, nsx, used;
+	unsigned ntrks, nchan, nsx;
 
 	if (!smf_open(&f, filename, "w")) {
 		return 0;
 	}
+	f.data = xmalloc(SMF_BUFSIZE, "smfbuf");
+	f.index = SMF_BUFSIZE;
+
 	ntrks = 0;
 	SONG_FOREACH_TRK(o, t) {
 		ntrks++;
@@ -513,27 +503,29 @@ song_exportsmf(struct song *o, char *filename)
 	/*
 	 * write the header
 	 */
-	smf_putheader(&f, smftype_header, 6);
-	smf_put16(&f, NULL, 1);				/* format = 1 */
-	smf_put16(&f, NULL, nsx + ntrks + nchan + 1);	/* +1 -> meta track */
-	smf_put16(&f, NULL, o->tics_per_unit / 4);		/* tics per quarter */
+	smf_newchunk(&f);
+	smf_put16(&f, 1);				/* format = 1 */
+	smf_put16(&f, nsx + ntrks + nchan + 1);	/* +1 -> meta track */
+	smf_put16(&f, o->tics_per_unit / 4);		/* tics per quarter */
+	if (!smf_putchunk(&f, smftype_header))
+		goto err;
 
 	/*
 	 * write the tempo track
 	 */
-	used = 0;
-	smf_puttrack(&f, &used, o, &o->meta);
-	smf_putheader(&f, smftype_track, used);
-	smf_puttrack(&f, NULL, o, &o->meta);
+	smf_newchunk(&f);
+	smf_puttrack(&f, o, &o->meta);
+	if (!smf_putchunk(&f, smftype_track))
+		goto err;
 
 	/*
 	 * write each sx
 	 */
 	SONG_FOREACH_SX(o, s) {
-		used = 0;
-		smf_putsx(&f, &used, o, s);
-		smf_putheader(&f, smftype_track, used);
-		smf_putsx(&f, NULL, o, s);
+		smf_newchunk(&f);
+		smf_putsx(&f, o, s);
+		if (!smf_putchunk(&f, smftype_track))
+			goto err;
 	}
 
 	/*
@@ -542,66 +534,282 @@ song_exportsmf(struct song *o, char *filename)
 	SONG_FOREACH_CHAN(o, i) {
 		if (i->isinput)
 			continue;
-		used = 0;
-		smf_puttrack(&f, &used, o, &i->conf);
-		smf_putheader(&f, smftype_track, used);
-		smf_puttrack(&f, NULL, o, &i->conf);
+		smf_newchunk(&f);
+		smf_puttrack(&f, o, &i->conf);
+		if (!smf_putchunk(&f, smftype_track))
+			goto err;
 	}
 
 	/*
 	 * write each track
 	 */
 	SONG_FOREACH_TRK(o, t) {
-		used = 0;
-		smf_puttrack(&f, &used, o, &t->track);
-		smf_putheader(&f, smftype_track, used);
-		smf_puttrack(&f, NULL, o, &t->track);
+		smf_newchunk(&f);
+		smf_puttrack(&f, o, &t->track);
+		if (!smf_putchunk(&f, smftype_track))
+			goto err;
 	}
+	return smf_close(&f);
+err:
 	smf_close(&f);
+	return 0;
+}
+
+/*
+ * tracks are decoded in two steps: first, the chunk is parsed into a
+ * flat array of events, without allocating memory or using any global
+ * state, so it's safe to decode multiple chunks in parallel threads;
+ * then events are packed and inserted into the track
+ */
+#define SMF_SYSEX	0xff	/* private cmd, sysex at data + v0, v1 bytes */
+#define SMF_MAXTHREADS	16
+
+struct smf_item {
+	unsigned delta;			/* tics since previous item */
+	struct ev ev;			/* event or SMF_SYSEX */
+};
+
+struct smf_trk {
+	unsigned char *data;		/* chunk data */
+	unsigned len;			/* chunk length */
+	unsigned tpu;			/* song tics per unit */
+	struct smf_item *items;		/* decoded events */
+	unsigned nitems;		/* number of items */
+	unsigned tail;			/* tics after the last item */
+	unsigned nraw;			/* skipped raw data messages */
+	char *err;			/* error message, or NULL */
+};
+
+/*
+ * decode a variable length number, return 0 on error
+ */
+unsigned
+smf_decvar(unsigned char **pp, unsigned char *end, unsigned *val)
+{
+	unsigned char *p = *pp;
+	unsigned v, c, bits;
+
+	v = 0;
+	bits = 0;
+	do {
+		/*
+		 * smf spec forbids more than 32bit per integer
+		 */
+		if (p == end || bits > 32)
+			return 0;
+		c = *p++;
+		v = (v << 7) + (c & 0x7f);
+		bits += 7;
+	} while (c & 0x80);
+	*pp = p;
+	*val = v;
 	return 1;
 }
 
 /*
- * parse '0xF0 varlen data data ... data 0xF7'
+ * parse a track 'varlen event varlen event ... varlen event' into
+ * the items array, which must have room for one item per 2 bytes of
+ * data (the shortest event). Return 0 on error and set the error
+ * message
  */
 unsigned
-smf_getsysex(struct smf *o, struct sysex *sx)
+smf_decode(struct smf_trk *o)
 {
-	unsigned i, length, c;
+	unsigned char *p = o->data, *end = o->data + o->len;
+	struct smf_item *it = o->items;
+	unsigned delta, v, c, status, len, type, tempo;
+	struct ev ev;
 
-	if (!smf_getvar(o, &length)) {
-		return 0;
-	}
-	for (i = 0; i < length; i++) {
-		if (!smf_getc(o, &c)) {
+	delta = 0;
+	status = 0;
+	while (p != end) {
+		if (!smf_decvar(&p, end, &v)) {
+			o->err = "failed to read delta time";
 			return 0;
 		}
-		sysex_add(sx, c);
+		delta += v;
+		if (p == end) {
+			o->err = "failed to read event";
+			return 0;
+		}
+		c = *p;
+		if (c < 0xf0) {
+			/*
+			 * voice event, possibly with running status
+			 */
+			if (c >= 0x80) {
+				status = c;
+				p++;
+			} else if (status == 0) {
+				o->err = "bad status";
+				return 0;
+			}
+			len = SMF_EVLEN(status);
+			if ((size_t)(end - p) < len) {
+				o->err = "truncated event";
+				return 0;
+			}
+			ev.cmd = (status >> 4) & 0xf;
+			ev.dev = 0;
+			ev.ch = status & 0xf;
+			ev.v0 = p[0] & 0x7f;
+			if (len == 2) {
+				if (ev.cmd == EV_BEND)
+					ev.v0 += (p[1] & 0x7f) << 7;
+				else
+					ev.v1 = p[1] & 0x7f;
+			}
+			p += len;
+			if (ev.cmd == EV_NON && ev.note_vel == 0) {
+				ev.cmd = EV_NOFF;
+				ev.note_vel = EV_NOFF_DEFAULTVEL;
+			}
+		} else {
+			p++;
+			status = 0;
+			type = 0;
+			if (c == 0xff) {
+				if (p == end) {
+					o->err = "failed to read meta event";
+					return 0;
+				}
+				type = *p++;
+			} else if (c != 0xf0 && c != 0xf7) {
+				o->err = "bad event";
+				return 0;
+			}
+			if (!smf_decvar(&p, end, &len) ||
+			    (size_t)(end - p) < len) {
+				o->err = "truncated event";
+				return 0;
+			}
+			if (c == 0xf0) {
+				/* sys ex */
+				ev.cmd = SMF_SYSEX;
+				ev.v0 = p - o->data;
+				ev.v1 = len;
+			} else if (c == 0xff && type == 0x51 && len == 3) {
+				/* tempo change */
+				tempo = (p[0] << 16) + (p[1] << 8) + p[2];
+				ev.cmd = EV_TEMPO;
+				ev.tempo_usec24 = tempo * 96 / o->tpu;
+			} else if (c == 0xff && type == 0x58 && len == 4) {
+				/* time signature change */
+				ev.cmd = EV_TIMESIG;
+				ev.timesig_beats = p[0];
+				ev.timesig_tics = o->tpu / (1 << p[1]);
+			} else {
+				/* raw data, end of track, ignored meta */
+				if (c == 0xf7)
+					o->nraw++;
+				p += len;
+				continue;
+			}
+			p += len;
+		}
+		it->delta = delta;
+		it->ev = ev;
+		it++;
+		delta = 0;
 	}
+	o->nitems = it - o->items;
+	o->tail = delta;
 	return 1;
 }
 
+#ifdef USE_THREADS
+struct smf_worker {
+	pthread_t thread;
+	struct smf_trk *trks;
+	unsigned first, ntrks, stride;
+};
+
+/*
+ * decode every 'stride' track, starting from 'first'
+ */
+void *
+smf_workermain(void *arg)
+{
+	struct smf_worker *w = arg;
+	unsigned i;
+
+	for (i = w->first; i < w->ntrks; i += w->stride)
+		smf_decode(&w->trks[i]);
+	return NULL;
+}
+#endif
+
+/*
+ * decode all tracks, in parallel if possible
+ */
+void
+smf_decodeall(struct smf_trk *trks, unsigned ntrks)
+{
+	unsigned i;
+#ifdef USE_THREADS
+	struct smf_worker w[SMF_MAXTHREADS];
+	unsigned n;
+	long ncpu;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	n = (ncpu < 1) ? 1 : (ncpu > SMF_MAXTHREADS) ? SMF_MAXTHREADS : ncpu;
+	if (n > ntrks)
+		n = ntrks;
+	if (n > 1) {
+		for (i = 0; i < n; i++) {
+			w[i].trks = trks;
+			w[i].first = i;
+			w[i].ntrks = ntrks;
+			w[i].stride = n;
+		}
+		/*
+		 * if a thread can't be created, its tracks are
+		 * decoded by this thread
+		 */
+		for (i = 1; i < n; i++) {
+			if (pthread_create(&w[i].thread, NULL,
+				smf_workermain, &w[i]) != 0)
+				w[i].stride = 0;
+		}
+		smf_workermain(&w[0]);
+		for (i = 1; i < n; i++) {
+			if (w[i].stride == 0) {
+				w[i].stride = n;
+				smf_workermain(&w[i]);
+			} else
+				pthread_join(w[i].thread, NULL);
+		}
+		return;
+	}
+#endif
+	for (i = 0; i < ntrks; i++)
+		smf_decode(&trks[i]);
+}
+
 /*
- * parse a track 'varlen event varlen event ... varlen event'
+ * pack decoded events according to device setup and store them in
+ * the given track; sysex messages go in the song sysex bank
  */
 unsigned
-smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
+smf_gettrack(struct smf_trk *o, struct song *s, struct songtrk *t)
 {
-	unsigned delta, i, status, type, length;
-	unsigned tempo, num, den, dummy;
 	struct statelist slist;
 	struct songsx *songsx;
 	struct seqev *pos, *se;
+	struct smf_item *it, *end;
 	struct sysex *sx;
 	struct mididev *dev;
-	struct ev ev, rev;
+	struct ev rev;
 	unsigned xctlset, evset;
-	unsigned c;
+	unsigned char *p;
+	unsigned i;
 
-	if (!smf_getheader(o, smftype_track)) {
+	if (o->nraw > 0)
+		logx(1, "raw data (status = 0xF7) not implemented");
+	if (o->err) {
+		logx(1, "%s", o->err);
 		return 0;
 	}
-	status = 0;
 	track_clear(&t->track);
 	pos = t->track.first;
 	songsx = (struct songsx *)s->sxlist;	/* first (and unique) sysex in song */
@@ -609,154 +817,49 @@ smf_gettrack(struct smf *o, struct song *s, struct songtrk *t)
 		songsx = song_sxnew(s, "smf");
 	}
 	statelist_init(&slist);
-	for (;;) {
-		if (o->index >= o->length) {
-			statelist_done(&slist);
-			return 1;
-		}
-		if (!smf_getvar(o, &delta)) {
-			goto err;
-		}
-		pos->delta += delta;
-		if (!smf_getc(o, &c)) {
-			goto err;;
-		}
-		if (c == 0xff) {
-			status = 0;
-			if (!smf_getc(o, &c)) {
-				goto err;
-			}
-			type = c;
-			if (!smf_getvar(o, &length)) {
-				goto err;
-			}
-			if (type == 0x2f && length == 0) {
-				/* end of track */
-				goto ignoremeta;
-			} else if (type == 0x51 && length == 3) {
-				/* tempo change */
-				if (!smf_get24(o, &tempo)) {
-					goto err;
-				}
-				ev.cmd = EV_TEMPO;
-				ev.tempo_usec24 = tempo * 96 / s->tics_per_unit;
-				goto putev;
-			} else if (type == 0x58 && length == 4) {
-				/* time signature change */
-				if (!smf_getc(o, &num)) {
-					goto err;
-				}
-				if (!smf_getc(o, &den)) {
-					goto err;
-				}
-				ev.cmd = EV_TIMESIG;
-				ev.timesig_beats = num;
-				ev.timesig_tics = s->tics_per_unit / (1 << den);
-				if (!smf_getc(o, &dummy)) {
-					goto err;
-				}
-				if (!smf_getc(o, &dummy)) {
-					goto err;
-				}
-				goto putev;
-			} else {
-			ignoremeta:
-				for (i = 0; i < length; i++) {
-					if (!smf_getc(o, &c)) {
-						goto err;
-					}
-				}
-			}
-		} else if (c == 0xf7) {
-			/* raw data */
-			logx(1, "raw data (status = 0xF7) not implemented");
-			status = 0;
-			if (!smf_getvar(o, &length)) {
-				goto err;
-			}
-			for (i = 0; i < length; i++) {
-				if (!smf_getc(o, &c)) {
-					goto err;
-				}
-			}
-		} else if (c == 0xf0) {
-			/* sys ex */
-			status = 0;
+	end = o->items + o->nitems;
+	for (it = o->items; it != end; it++) {
+		pos->delta += it->delta;
+		if (it->ev.cmd == SMF_SYSEX) {
 			sx = sysex_new(0);
 			sysex_add(sx, 0xf0);
-			if (!smf_getsysex(o, sx)) {
-				sysex_del(sx);
-				goto err;
-			}
+			p = o->data + it->ev.v0;
+			for (i = 0; i < it->ev.v1; i++)
+				sysex_add(sx, p[i]);
 			if (sysex_check(sx)) {
 				sysexlist_put(&songsx->sx, sx);
 			} else {
 				logx(1, "corrupted sysex message, ignored");
 				sysex_del(sx);
 			}
-		} else if (c >= 0x80 && c < 0xf0) {
-			status = c;
-			if (!smf_getc(o, &c)) {
-				goto err;
-			}
-		runningstatus:
-			ev.cmd = (status >> 4) & 0xf;
-			ev.dev = 0;
-			ev.ch = status & 0xf;
-			ev.v0 = c & 0x7f;
-			if (SMF_EVLEN(status) == 2) {
-				if (!smf_getc(o, &c)) {
-					goto err;
-				}
-				c &= 0x7f;
-				if (ev.cmd == EV_BEND) {
-					ev.v0 += c << 7;
-				} else {
-					ev.v1 = c;
-				}
-			}
-		putev:
-			if (ev.cmd == EV_NON && ev.note_vel == 0) {
-				ev.cmd = EV_NOFF;
-				ev.note_vel = EV_NOFF_DEFAULTVEL;
-			}
+			continue;
+		}
 
-			/*
-			 * Pack events according to device setup.
-			 *
-			 * XXX: this needs to be done in
-			 * doevset/doxctl by converting the whole
-			 * project whenever events configuration
-			 * is changed.
-			 */
-			if ((evinfo[ev.cmd].flags & EV_HAS_DEV) &&
-			    (dev = mididev_byunit[ev.dev]) != NULL) {
-				xctlset = dev->oxctlset;
-				evset = dev->oevset;
-			} else {
-				xctlset = 0;
-				evset = CONV_XPC | CONV_NRPN | CONV_RPN;
-			}
-			if (conv_packev(&slist, xctlset, evset,
-				&ev, &rev)) {
-				se = seqev_new();
-				se->ev = rev;
-				seqev_ins(pos, se);
-			}
-		} else if (c < 0x80) {
-			if (status == 0) {
-				logx(1, "bad status");
-				goto err;
-			}
-			goto runningstatus;
+		/*
+		 * Pack events according to device setup.
+		 *
+		 * XXX: this needs to be done in
+		 * doevset/doxctl by converting the whole
+		 * project whenever events configuration
+		 * is changed.
+		 */
+		if ((evinfo[it->ev.cmd].flags & EV_HAS_DEV) &&
+		    (dev = mididev_byunit[it->ev.dev]) != NULL) {
+			xctlset = dev->oxctlset;
+			evset = dev->oevset;
 		} else {
-			logx(1, "bad event");
-			goto err;
+			xctlset = 0;
+			evset = CONV_XPC | CONV_NRPN | CONV_RPN;
+		}
+		if (conv_packev(&slist, xctlset, evset, &it->ev, &rev)) {
+			se = seqev_new();
+			se->ev = rev;
+			seqev_ins(pos, se);
 		}
 	}
- err:
+	pos->delta += o->tail;
 	statelist_done(&slist);
-	return 0;
+	return 1;
 }
 
 /*
@@ -879,11 +982,12 @@ song_importsmf(char *filename)
 {
 	struct song *o;
 	struct songtrk *t;
+	struct smf_trk *trks;
 	unsigned format, ntrks, timecode, i;
 	char trackname[MAXTRACKNAME];
 	struct smf f;
 
-	if (!smf_open(&f, filename, "r")) {
+	if (!smf_load(&f, filename)) {
 		goto bad1;
 	}
 	if (!smf_getheader(&f, smftype_header)) {
@@ -910,18 +1014,45 @@ song_importsmf(char *filename)
 		logx(1, "SMPTE timecode is not supported");
 		goto bad2;
 	}
+	f.p = f.end;
 
-	o = song_new();
+	/*
+	 * locate track chunks, and decode them
+	 */
+	trks = xmalloc((ntrks > 0 ? ntrks : 1) * sizeof(struct smf_trk), "smf_trk");
+	for (i = 0; i < ntrks; i++) {
+		if (!smf_getheader(&f, smftype_track)) {
+			while (i > 0)
+				xfree(trks[--i].items);
+			goto bad3;
+		}
+		trks[i].data = f.p;
+		trks[i].len = f.end - f.p;
+		trks[i].tpu = timecode * 4;
+		trks[i].items = xmalloc((trks[i].len / 2 + 1) *
+		    sizeof(struct smf_item), "smf_item");
+		trks[i].nitems = 0;
+		trks[i].tail = 0;
+		trks[i].nraw = 0;
+		trks[i].err = NULL;
+		f.p = f.end;
+	}
+	smf_decodeall(trks, ntrks);
+
+	o = song_new();
 	o->tics_per_unit = timecode * 4;   /* timecode = tics per quarter */
 
 	for (i = 0; i < ntrks; i++) {
 		snprintf(trackname, MAXTRACKNAME, "trk%02u", i);
 		t = song_trknew(o, trackname);
-		if (!smf_gettrack(&f, o, t)) {
-			goto bad3;
+		if (!smf_gettrack(&trks[i], o, t)) {
+			goto bad4;
 		}
 		track_check(&t->track);
 	}
+	for (i = 0; i < ntrks; i++)
+		xfree(trks[i].items);
+	xfree(trks);
 	smf_close(&f);
 
 	if (format == 0) {
@@ -936,11 +1067,806 @@ song_importsmf(char *filename)
 	 */
 	return o;
 
-bad3:	song_delete(o);
+bad4:	song_delete(o);
+	for (i = 0; i < ntrks; i++)
+		xfree(trks[i].items);
+bad3:	xfree(trks);
 bad2:	smf_close(&f);
 bad1:	return 0;
 }
 
+/* ---------------------------------------------- streamed playback --- */
+
+/*
+ * a standard midi file may be played without being imported: each
+ * track chunk is read through a small buffer refilled from the file
+ * as playback advances, so only a bounded window of each track is
+ * in memory and tracks are merged tic by tic. Meta events and sysex
+ * messages are loaded in the song when the file is opened, as
+ * they are needed to locate measures and are sent before playback.
+ *
+ * Buffers are refilled by smfstream_fill() from the main loop, when
+ * they are less than half full, so tics don't wait for the disk; the
+ * file is read without holding the lock of the real-time thread. The
+ * tick path reads the file itself only if a buffer runs empty. When
+ * looping, the state of each track at the loop start is kept, so the
+ * file isn't read again to jump there.
+ */
+#define SMF_STREAMBUF	0x1000
+
+struct smfstream_trk {
+	unsigned start, end;		/* chunk position in the file */
+	unsigned off;			/* file offset of the end of buf */
+	unsigned pos, len;		/* current position, end of buf */
+	unsigned char buf[SMF_STREAMBUF];
+	unsigned status;		/* running status */
+	unsigned delta;			/* tics until the pending event */
+	unsigned eot;			/* no pending event */
+	unsigned tic;			/* absolute position */
+	struct ev ev;			/* pending event */
+	struct statelist conv;		/* state to pack events */
+	struct statelist slist;		/* played states */
+};
+
+struct smfstream {
+	char *path;
+	int fd;
+	unsigned tpu;			/* tics per unit */
+	unsigned ntrks;			/* number of track chunks */
+	unsigned numtic;		/* length of the longest track */
+	struct smfstream_trk *trks;
+	struct smfstream_trk *loops;	/* tracks at loop start, or NULL */
+};
+
+/*
+ * read the given number of bytes at the given file offset, return 0
+ * on error
+ */
+unsigned
+smfstream_pread(struct smfstream *s, unsigned char *buf, unsigned n,
+    unsigned off)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		r = pread(s->fd, buf, n, off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			logx(1, "%s: %s", s->path, strerror(errno));
+			return 0;
+		}
+		if (r == 0) {
+			logx(1, "%s: unexpected end of file", s->path);
+			return 0;
+		}
+		buf += r;
+		off += r;
+		n -= r;
+	}
+	return 1;
+}
+
+/*
+ * read a byte from the track, refill the buffer if it's empty
+ */
+unsigned
+smfstream_getc(struct smfstream *s, struct smfstream_trk *t, unsigned *val)
+{
+	unsigned n;
+
+	if (t->pos == t->len) {
+		n = t->end - t->off;
+		if (n == 0) {
+			logx(1, "%s: truncated track", s->path);
+			return 0;
+		}
+		if (n > SMF_STREAMBUF)
+			n = SMF_STREAMBUF;
+		if (!smfstream_pread(s, t->buf, n, t->off))
+			return 0;
+		t->off += n;
+		t->pos = 0;
+		t->len = n;
+	}
+	*val = t->buf[t->pos++];
+	return 1;
+}
+
+/*
+ * skip the given number of bytes, without reading them
+ */
+unsigned
+smfstream_skip(struct smfstream *s, struct smfstream_trk *t, unsigned n)
+{
+	unsigned avail;
+
+	avail = t->len - t->pos;
+	if (n <= avail) {
+		t->pos += n;
+		return 1;
+	}
+	n -= avail;
+	if (t->end - t->off < n) {
+		logx(1, "%s: truncated track", s->path);
+		return 0;
+	}
+	t->pos = t->len;
+	t->off += n;
+	return 1;
+}
+
+/*
+ * read a variable length number
+ */
+unsigned
+smfstream_getvar(struct smfstream *s, struct smfstream_trk *t, unsigned *val)
+{
+	unsigned c, bits;
+
+	*val = 0;
+	bits = 0;
+	do {
+		if (!smfstream_getc(s, t, &c))
+			return 0;
+		*val = (*val << 7) + (c & 0x7f);
+		bits += 7;
+		if (bits > 32) {
+			logx(1, "%s: variable length number too long", s->path);
+			return 0;
+		}
+	} while (c & 0x80);
+	return 1;
+}
+
+/*
+ * read the next event of the track, and store it as the pending
+ * event. Ignored events are skipped. If a sysex bank is given, sysex
+ * messages are stored in it, else they are skipped. Return 0 on error
+ */
+unsigned
+smfstream_next(struct smfstream *s, struct smfstream_trk *t,
+    struct songsx *songsx)
+{
+	struct sysex *sx;
+	unsigned delta, c, type, len, i, val[3];
+
+	for (;;) {
+		if (t->pos == t->len && t->off == t->end) {
+			t->eot = 1;
+			return 1;
+		}
+		if (!smfstream_getvar(s, t, &delta))
+			return 0;
+		t->delta += delta;
+		if (!smfstream_getc(s, t, &c))
+			return 0;
+		if (c < 0xf0) {
+			/*
+			 * voice event, possibly with running status
+			 */
+			if (c >= 0x80) {
+				t->status = c;
+				if (!smfstream_getc(s, t, &c))
+					return 0;
+			} else if (t->status == 0) {
+				logx(1, "%s: bad status", s->path);
+				return 0;
+			}
+			t->ev.cmd = (t->status >> 4) & 0xf;
+			t->ev.dev = 0;
+			t->ev.ch = t->status & 0xf;
+			t->ev.v0 = c & 0x7f;
+			if (SMF_EVLEN(t->status) == 2) {
+				if (!smfstream_getc(s, t, &c))
+					return 0;
+				if (t->ev.cmd == EV_BEND)
+					t->ev.v0 += (c & 0x7f) << 7;
+				else
+					t->ev.v1 = c & 0x7f;
+			}
+			if (t->ev.cmd == EV_NON && t->ev.note_vel == 0) {
+				t->ev.cmd = EV_NOFF;
+				t->ev.note_vel = EV_NOFF_DEFAULTVEL;
+			}
+			return 1;
+		}
+		t->status = 0;
+		type = 0;
+		if (c == 0xff) {
+			if (!smfstream_getc(s, t, &type))
+				return 0;
+		} else if (c != 0xf0 && c != 0xf7) {
+			logx(1, "%s: bad event", s->path);
+			return 0;
+		}
+		if (!smfstream_getvar(s, t, &len))
+			return 0;
+		if (c == 0xf0 && songsx != NULL) {
+			/* sys ex */
+			sx = sysex_new(0);
+			sysex_add(sx, 0xf0);
+			for (i = 0; i < len; i++) {
+				if (!smfstream_getc(s, t, &c)) {
+					sysex_del(sx);
+					return 0;
+				}
+				sysex_add(sx, c);
+			}
+			if (sysex_check(sx)) {
+				sysexlist_put(&songsx->sx, sx);
+			} else {
+				logx(1, "corrupted sysex message, ignored");
+				sysex_del(sx);
+			}
+		} else if (c == 0xff && (type == 0x51 || type == 0x58) &&
+		    len == (type == 0x51 ? 3 : 4)) {
+			for (i = 0; i < 3; i++) {
+				if (!smfstream_getc(s, t, &val[i]))
+					return 0;
+			}
+			if (type == 0x51) {
+				/* tempo change */
+				t->ev.cmd = EV_TEMPO;
+				t->ev.tempo_usec24 =
+				    ((val[0] << 16) + (val[1] << 8) + val[2]) *
+				    96 / s->tpu;
+			} else {
+				/* time signature change */
+				if (!smfstream_skip(s, t, 1))
+					return 0;
+				t->ev.cmd = EV_TIMESIG;
+				t->ev.timesig_beats = val[0];
+				t->ev.timesig_tics = s->tpu / (1 << val[1]);
+			}
+			return 1;
+		} else {
+			/* raw data, end of track, ignored meta, sysex */
+			if (!smfstream_skip(s, t, len))
+				return 0;
+		}
+	}
+}
+
+/*
+ * move the track to its beginning, and read the first event
+ */
+unsigned
+smfstream_rewind(struct smfstream *s, struct smfstream_trk *t)
+{
+	t->off = t->start;
+	t->pos = t->len = 0;
+	t->status = 0;
+	t->delta = 0;
+	t->tic = 0;
+	t->eot = 0;
+	return smfstream_next(s, t, NULL);
+}
+
+/*
+ * pack the pending event of the track according to the device setup
+ * and update the state of the track. Return the state to play or
+ * NULL if there's nothing to play
+ */
+struct state *
+smfstream_evget(struct smfstream_trk *t)
+{
+	struct mididev *dev;
+	struct state *st;
+	struct ev rev;
+	unsigned xctlset, evset;
+
+	if (!EV_ISVOICE(&t->ev))
+		return NULL;
+	if ((dev = mididev_byunit[t->ev.dev]) != NULL) {
+		xctlset = dev->oxctlset;
+		evset = dev->oevset;
+	} else {
+		xctlset = 0;
+		evset = CONV_XPC | CONV_NRPN | CONV_RPN;
+	}
+	if (!conv_packev(&t->conv, xctlset, evset, &t->ev, &rev))
+		return NULL;
+	st = statelist_update(&t->slist, &rev);
+	if (st->phase & EV_PHASE_FIRST)
+		st->tag = 1;
+	return st;
+}
+
+/*
+ * read the header and locate track chunks, then load meta events and
+ * sysex messages in the given song. Return NULL on error
+ */
+struct smfstream *
+smfstream_new(struct song *o, char *path)
+{
+	struct smfstream *s;
+	struct smfstream_trk *t;
+	struct track copy;
+	struct seqev *pos, *se;
+	struct songsx *songsx;
+	struct stat sb;
+	unsigned char hdr[14];
+	unsigned format, ntrks, timecode, size, off, len, i;
+
+	s = xmalloc(sizeof(struct smfstream), "smfstream");
+	s->path = str_new(path);
+	s->fd = open(path, O_RDONLY);
+	if (s->fd < 0) {
+		logx(1, "%s: failed to open file", path);
+		goto bad1;
+	}
+	if (fstat(s->fd, &sb) < 0) {
+		logx(1, "%s: %s", path, strerror(errno));
+		goto bad2;
+	}
+	if (sb.st_size > UINT_MAX) {
+		logx(1, "%s: file too large", path);
+		goto bad2;
+	}
+	size = sb.st_size;
+	if (!smfstream_pread(s, hdr, sizeof(hdr), 0))
+		goto bad2;
+	len = (hdr[4] << 24) + (hdr[5] << 16) + (hdr[6] << 8) + hdr[7];
+	if (memcmp(hdr, smftype_header, 4) != 0 || len < 6) {
+		logx(1, "%s: header corrupted", path);
+		goto bad2;
+	}
+	format = (hdr[8] << 8) + hdr[9];
+	ntrks = (hdr[10] << 8) + hdr[11];
+	timecode = (hdr[12] << 8) + hdr[13];
+	if (format != 1 && format != 0) {
+		logx(1, "only smf format 0 or 1 can be imported");
+		goto bad2;
+	}
+	if (ntrks >= 256) {
+		logx(1, "too many tracks in midi file");
+		goto bad2;
+	}
+	if ((timecode & 0x8000) != 0) {
+		logx(1, "SMPTE timecode is not supported");
+		goto bad2;
+	}
+	s->tpu = timecode * 4;
+	s->ntrks = ntrks;
+	s->numtic = 0;
+	s->loops = NULL;
+	s->trks = xmalloc((ntrks > 0 ? ntrks : 1) *
+	    sizeof(struct smfstream_trk), "smfstream_trk");
+	off = 8 + len;
+	for (i = 0; i < ntrks; i++) {
+		t = &s->trks[i];
+		if (size - off < 8) {
+			logx(1, "%s: failed to read header", path);
+			goto bad3;
+		}
+		if (!smfstream_pread(s, hdr, 8, off))
+			goto bad3;
+		len = (hdr[4] << 24) + (hdr[5] << 16) + (hdr[6] << 8) + hdr[7];
+		if (memcmp(hdr, smftype_track, 4) != 0) {
+			logx(1, "%s: header corrupted", path);
+			goto bad3;
+		}
+		off += 8;
+		if (size - off < len) {
+			logx(1, "%s: chunk truncated", path);
+			goto bad3;
+		}
+		t->start = off;
+		t->end = off + len;
+		off += len;
+	}
+
+	o->tics_per_unit = s->tpu;
+	songsx = song_sxnew(o, "smf");
+
+	/*
+	 * scan tracks, move meta events into the meta track and sysex
+	 * messages in the sysex bank
+	 */
+	for (i = 0; i < ntrks; i++) {
+		t = &s->trks[i];
+		t->off = t->start;
+		t->pos = t->len = 0;
+		t->status = 0;
+		t->delta = 0;
+		t->eot = 0;
+		track_init(&copy);
+		pos = copy.first;
+		len = 0;
+		for (;;) {
+			if (!smfstream_next(s, t, songsx)) {
+				track_done(&copy);
+				goto bad3;
+			}
+			pos->delta += t->delta;
+			len += t->delta;
+			t->delta = 0;
+			if (t->eot)
+				break;
+			if (EV_ISMETA(&t->ev)) {
+				se = seqev_new();
+				se->ev = t->ev;
+				seqev_ins(pos, se);
+			}
+		}
+		if (s->numtic < len)
+			s->numtic = len;
+		track_merge(&o->meta, &copy);
+		track_done(&copy);
+		statelist_init(&t->conv);
+		statelist_init(&t->slist);
+		t->eot = 1;
+	}
+	return s;
+bad3:
+	xfree(s->trks);
+bad2:
+	close(s->fd);
+bad1:
+	str_delete(s->path);
+	xfree(s);
+	return NULL;
+}
+
+/*
+ * close the file and free the stream
+ */
+void
+smfstream_del(struct smfstream *s)
+{
+	struct smfstream_trk *t;
+	unsigned i;
+
+	if (s->loops)
+		smfstream_loopdone(s);
+	for (i = 0; i < s->ntrks; i++) {
+		t = &s->trks[i];
+		statelist_empty(&t->conv);
+		statelist_done(&t->conv);
+		statelist_empty(&t->slist);
+		statelist_done(&t->slist);
+	}
+	close(s->fd);
+	str_delete(s->path);
+	xfree(s->trks);
+	xfree(s);
+}
+
+/*
+ * return the length of the longest track, in tics
+ */
+unsigned
+smfstream_numtic(struct smfstream *s)
+{
+	return s->numtic;
+}
+
+/*
+ * cancel all sounding notes and played states
+ */
+void
+smfstream_cancel(struct smfstream *s)
+{
+	unsigned i;
+
+	for (i = 0; i < s->ntrks; i++)
+		song_confcancel(&s->trks[i].slist, PRIO_TRACK);
+}
+
+/*
+ * move the track the given number of tics forward, updating its
+ * state without playing anything
+ */
+void
+smfstream_advance(struct smfstream *s, struct smfstream_trk *t,
+    unsigned ntics)
+{
+	unsigned n;
+
+	while (ntics > 0) {
+		while (!t->eot && t->delta == 0) {
+			(void)smfstream_evget(t);
+			if (!smfstream_next(s, t, NULL))
+				t->eot = 1;
+		}
+		n = t->delta < ntics ? t->delta : ntics;
+		if (n == 0)
+			break;
+		t->delta -= n;
+		t->tic += n;
+		ntics -= n;
+		statelist_outdate(&t->slist);
+	}
+}
+
+/*
+ * cancel the current state, move all tracks to the given position
+ * and restore the state there; if 'all' is set, unterminated states
+ * are restored too. Return 0 if the end of the file is reached
+ */
+unsigned
+smfstream_seek(struct smfstream *s, unsigned tic, int all)
+{
+	struct smfstream_trk *t;
+	struct state *st;
+	unsigned i, neot;
+
+	neot = 0;
+	for (i = 0; i < s->ntrks; i++) {
+		t = &s->trks[i];
+		song_confcancel(&t->slist, PRIO_TRACK);
+		statelist_empty(&t->slist);
+		statelist_empty(&t->conv);
+		if (!smfstream_rewind(s, t))
+			t->eot = 1;
+		smfstream_advance(s, t, tic);
+		for (st = t->slist.first; st != NULL; st = st->next)
+			st->tag = 0;
+		song_confrestore(&t->slist, all, PRIO_TRACK);
+		if (!t->eot || t->delta > 0)
+			neot = 1;
+	}
+	return neot;
+}
+
+/*
+ * save the state of all tracks at the given position, from which
+ * playback continues when the end of the loop is reached
+ */
+void
+smfstream_loopinit(struct smfstream *s, unsigned tic)
+{
+	struct smfstream_trk *l;
+	struct state *st, *stnext;
+	unsigned i;
+
+	s->loops = xmalloc((s->ntrks > 0 ? s->ntrks : 1) *
+	    sizeof(struct smfstream_trk), "smfstream_trk");
+	for (i = 0; i < s->ntrks; i++) {
+		l = &s->loops[i];
+		l->start = s->trks[i].start;
+		l->end = s->trks[i].end;
+		statelist_init(&l->conv);
+		statelist_init(&l->slist);
+		if (!smfstream_rewind(s, l))
+			l->eot = 1;
+		smfstream_advance(s, l, tic);
+
+		/*
+		 * drop notes, as we don't restore them, and
+		 * terminated states
+		 */
+		for (st = l->slist.first; st != NULL; st = stnext) {
+			stnext = st->next;
+			if (EV_ISNOTE(&st->ev)) {
+				statelist_rm(&l->slist, st);
+				state_del(st);
+			}
+		}
+		statelist_outdate(&l->slist);
+	}
+}
+
+/*
+ * free the state saved at the loop start
+ */
+void
+smfstream_loopdone(struct smfstream *s)
+{
+	struct smfstream_trk *l;
+	unsigned i;
+
+	for (i = 0; i < s->ntrks; i++) {
+		l = &s->loops[i];
+		statelist_empty(&l->conv);
+		statelist_done(&l->conv);
+		statelist_empty(&l->slist);
+		statelist_done(&l->slist);
+	}
+	xfree(s->loops);
+	s->loops = NULL;
+}
+
+/*
+ * move all tracks to the loop start: cancel states not present there
+ * (including all notes), restore the ones that differ, and continue
+ * reading the file from the saved position
+ */
+void
+smfstream_loop(struct smfstream *s)
+{
+	struct smfstream_trk *t, *l;
+	struct state *st, *d, *dnext;
+	struct ev re;
+	unsigned i;
+
+	for (i = 0; i < s->ntrks; i++) {
+		t = &s->trks[i];
+		l = &s->loops[i];
+		for (d = t->slist.first; d != NULL; d = dnext) {
+			dnext = d->next;
+			if (statelist_lookup(&l->slist, &d->ev) != NULL)
+				continue;
+			if (!state_cancel(d, &re))
+				continue;
+			statelist_update(&t->slist, &re);
+			if (d->tag)
+				mixout_putev(&d->ev, PRIO_TRACK);
+		}
+		for (st = l->slist.first; st != NULL; st = st->next) {
+			d = statelist_lookup(&t->slist, &st->ev);
+			if (d != NULL && state_eq(d, &st->ev))
+				continue;
+			if (!state_restore(st, &re))
+				continue;
+			d = statelist_update(&t->slist, &re);
+			if (d->phase & EV_PHASE_FIRST)
+				d->tag = 1;
+			if (d->tag)
+				mixout_putev(&d->ev, PRIO_TRACK);
+		}
+		statelist_empty(&t->conv);
+		statelist_copy(&t->conv, &l->conv);
+		memcpy(t->buf + l->pos, l->buf + l->pos, l->len - l->pos);
+		t->off = l->off;
+		t->pos = l->pos;
+		t->len = l->len;
+		t->status = l->status;
+		t->delta = l->delta;
+		t->eot = l->eot;
+		t->tic = l->tic;
+		t->ev = l->ev;
+	}
+}
+
+/*
+ * return true if the given track buffer must be refilled
+ */
+static unsigned
+smfstream_trkneedfill(struct smfstream_trk *t)
+{
+	return t->len - t->pos < SMF_STREAMBUF / 2 && t->off < t->end;
+}
+
+/*
+ * return true if a buffer must be refilled. Called with the lock
+ * held, by the real-time path, to request a smfstream_fill() call
+ */
+unsigned
+smfstream_needfill(struct smfstream *s)
+{
+	unsigned i;
+
+	for (i = 0; i < s->ntrks; i++) {
+		if (smfstream_trkneedfill(&s->trks[i]))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * refill buffers that are less than half full, so the next tics
+ * find data in memory. Called by the main loop, without the lock:
+ * it's taken only to look at and to update the buffers, not while
+ * the file is read. Errors are left to smfstream_getc() to report
+ */
+void
+smfstream_fill(struct smfstream *s)
+{
+	unsigned char buf[SMF_STREAMBUF];
+	struct smfstream_trk *t;
+	unsigned i, avail, n, off;
+
+	for (i = 0; i < s->ntrks; i++) {
+		t = &s->trks[i];
+		mux_mdep_lock();
+		if (!smfstream_trkneedfill(t)) {
+			mux_mdep_unlock();
+			continue;
+		}
+		off = t->off;
+		n = t->end - off;
+		if (n > SMF_STREAMBUF / 2)
+			n = SMF_STREAMBUF / 2;
+		mux_mdep_unlock();
+
+		if (!smfstream_pread(s, buf, n, off))
+			n = 0;
+
+		/*
+		 * 'off' is the file offset of the end of the buffer, if
+		 * it changed (buffer consumed to the end, loop, seek)
+		 * the data we read is not needed anymore
+		 */
+		mux_mdep_lock();
+		if (t->off == off) {
+			avail = t->len - t->pos;
+			if (n > SMF_STREAMBUF - avail)
+				n = SMF_STREAMBUF - avail;
+			memmove(t->buf, t->buf + t->pos, avail);
+			memcpy(t->buf + avail, buf, n);
+			t->pos = 0;
+			t->len = avail + n;
+			t->off = (n > 0) ? off + n : t->end;
+			off = t->off;
+		} else
+			off = t->end;
+		mux_mdep_unlock();
+#ifdef POSIX_FADV_WILLNEED
+		/*
+		 * ask the system to start reading the next block
+		 */
+		if (off < t->end) {
+			(void)posix_fadvise(s->fd, off,
+			    SMF_STREAMBUF, POSIX_FADV_WILLNEED);
+		}
+#endif
+	}
+}
+
+/*
+ * play all events of the current tic
+ */
+void
+smfstream_play(struct smfstream *s)
+{
+	struct smfstream_trk *t;
+	struct state *st;
+	unsigned i;
+
+	for (i = 0; i < s->ntrks; i++) {
+		t = &s->trks[i];
+		while (!t->eot && t->delta == 0) {
+			st = smfstream_evget(t);
+			if (st != NULL && st->tag)
+				mixout_putev(&st->ev, PRIO_TRACK);
+			if (!smfstream_next(s, t, NULL))
+				t->eot = 1;
+		}
+	}
+}
+
+/*
+ * move all tracks one tic forward. Return 0 if the end of the file
+ * is reached
+ */
+unsigned
+smfstream_ticskip(struct smfstream *s)
+{
+	struct smfstream_trk *t;
+	unsigned i, neot;
+
+	neot = 0;
+	for (i = 0; i < s->ntrks; i++) {
+		t = &s->trks[i];
+		if (t->delta == 0)
+			continue;
+		t->delta--;
+		t->tic++;
+		statelist_outdate(&t->slist);
+		neot = 1;
+	}
+	return neot;
+}
+
+/*
+ * create a new song to play the given file without importing it
+ */
+struct song *
+song_streamsmf(char *filename)
+{
+	struct song *o;
+
+	o = song_new();
+	o->stream = smfstream_new(o, filename);
+	if (o->stream == NULL) {
+		song_delete(o);
+		return NULL;
+	}
+	return o;
+}
+
 int
 syx_import(char *path, struct sysexlist *l, int unit)
 {
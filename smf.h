@@ -18,9 +18,23 @@
 #define MIDISH_SMF_H
 
 struct song;
+struct smfstream;
 
 unsigned song_exportsmf(struct song *, char *);
 struct song *song_importsmf(char *);
+struct song *song_streamsmf(char *);
+
+void smfstream_del(struct smfstream *);
+unsigned smfstream_numtic(struct smfstream *);
+void smfstream_cancel(struct smfstream *);
+unsigned smfstream_seek(struct smfstream *, unsigned, int);
+void smfstream_loopinit(struct smfstream *, unsigned);
+void smfstream_loopdone(struct smfstream *);
+void smfstream_loop(struct smfstream *);
+unsigned smfstream_needfill(struct smfstream *);
+void smfstream_fill(struct smfstream *);
+void smfstream_play(struct smfstream *);
+unsigned smfstream_ticskip(struct smfstream *);
 
 int syx_import(char *, struct sysexlist *, int);
 int syx_export(char *, struct sysexlist *);
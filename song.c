@@ -27,6 +27,8 @@
 #include "mixout.h"
 #include "norm.h"
 #include "undo.h"
+#include "hist.h"
+#include "smf.h"
 
 #define TAG_OFF		0
 #define TAG_PLAY	1
@@ -112,6 +114,7 @@ song_init(struct song *o)
 	evspec_reset(&o->tap_evspec);
 	o->tap_evspec.cmd = EVSPEC_EMPTY;
 	o->tap_mode = 0;
+	o->stream = NULL;
 
 	/*
 	 * add default timesig/tempo so that setunit() works
@@ -149,6 +152,8 @@ song_done(struct song *o)
 	while (o->sxlist) {
 		song_sxdel(o, (struct songsx *)o->sxlist);
 	}
+	if (o->stream)
+		smfstream_del(o->stream);
 	track_done(&o->meta);
 	track_done(&o->clip);
 	track_done(&o->rec);
@@ -454,9 +459,8 @@ song_setcurchan(struct song *o, struct songchan *c, int input)
 unsigned
 song_endpos(struct song *o)
 {
-	struct seqptr *mp;
 	struct songtrk *t;
-	unsigned m, tpm, tpb, bpm, len, maxlen, delta;
+	unsigned m, beat, tic, len, maxlen;
 
 	maxlen = 0;
 	SONG_FOREACH_TRK(o, t) {
@@ -464,24 +468,14 @@ song_endpos(struct song *o)
 		if (maxlen < len)
 			maxlen = len;
 	}
-	m = 0;
-	len = 0;
-	mp = seqptr_new(&o->meta);
-	while (len < maxlen) {
-		while (seqptr_evget(mp)) {
-			/* nothing */
-		}
-		seqptr_getsign(mp, &bpm, &tpb);
-		tpm = bpm * tpb;
-		delta = seqptr_skip(mp, tpm);
-		if (delta > 0) {
-			m += (maxlen - len + tpm - 1) / tpm;
-			break;
-		}
-		len += tpm;
-		m++;
+	if (o->stream) {
+		len = smfstream_numtic(o->stream);
+		if (maxlen < len)
+			maxlen = len;
 	}
-	seqptr_del(mp);
+	track_measinfo(&o->meta, maxlen, &m, &beat, &tic);
+	if (beat > 0 || tic > 0)
+		m++;
 	return m;
 }
 
@@ -632,6 +626,8 @@ song_loop_init(struct song *o)
 		 */
 		statelist_outdate(slist);
 	}
+	if (o->stream)
+		smfstream_loopinit(o->stream, o->loop_tstart);
 }
 
 /*
@@ -650,6 +646,8 @@ song_loop_done(struct song *o)
 		statelist_empty(&t->loop_trackptr->statelist);
 		seqptr_del(t->loop_trackptr);
 	}
+	if (o->stream)
+		smfstream_loopdone(o->stream);
 }
 
 /*
@@ -762,6 +760,9 @@ song_loop_repeat(struct song *o)
 
 	song_loop_track(o, NULL);
 
+	if (o->stream)
+		smfstream_loop(o->stream);
+
 	if (o->mode >= SONG_REC)
 		song_loop_rec(o);
 
@@ -802,6 +803,8 @@ song_ticskip(struct song *o)
 	SONG_FOREACH_TRK(o, i) {
 		neot |= seqptr_ticskip(i->trackptr, 1);
 	}
+	if (o->stream)
+		neot |= smfstream_ticskip(o->stream);
 	if (o->mode >= SONG_REC) {
 		if (o->playptr) {
 			seqptr_ticdel(o->playptr, 1, &o->rec_replay);
@@ -845,7 +848,9 @@ song_ticplay(struct song *o)
 {
 	struct songtrk *i;
 	struct state *st, *sr;
+	unsigned long start;
 
+	start = hist_mdep_nsec();
 	while ((st = seqptr_evget(o->metaptr)))
 		song_metaput(o, st);
 
@@ -861,6 +866,8 @@ song_ticplay(struct song *o)
 				mixout_putev(&st->ev, PRIO_TRACK);
 		}
 	}
+	if (o->stream)
+		smfstream_play(o->stream);
 
 	if (o->mode >= SONG_REC) {
 		/*
@@ -882,6 +889,7 @@ song_ticplay(struct song *o)
 		}
 
 	}
+	HIST_ACC(HIST_TICPLAY, start);
 }
 
 /*
@@ -1118,6 +1126,8 @@ song_stopcb(struct song *o)
 	SONG_FOREACH_TRK(o, t) {
 		song_confcancel(&t->trackptr->statelist, PRIO_TRACK);
 	}
+	if (o->stream)
+		smfstream_cancel(o->stream);
 }
 
 /*
@@ -1133,6 +1143,27 @@ song_movecb(struct song *o)
 	mux_flush();
 }
 
+/*
+ * return true if song_fillcb() has work to do. Called with the lock
+ * held, ex. by the real-time thread
+ */
+unsigned
+song_needfill(struct song *o)
+{
+	return o->stream != NULL && smfstream_needfill(o->stream);
+}
+
+/*
+ * call-back, called by the main loop without the lock, to do work
+ * that must not delay ticks
+ */
+void
+song_fillcb(struct song *o)
+{
+	if (o->stream)
+		smfstream_fill(o->stream);
+}
+
 /*
  * call-back called when a midi event arrives
  */
@@ -1241,34 +1272,12 @@ song_sysexcb(struct song *o, struct sysex *sx)
 unsigned
 song_mtcpos(struct song *o, unsigned where, unsigned offs)
 {
-	struct seqptr *p;
-	unsigned delta, bpm, tpb, meas, beat, tick;
 	unsigned long long pos;
-	unsigned long usec24;
+	unsigned tic;
 
-	p = seqptr_new(&o->meta);
-	pos = 0;
-	meas = beat = tick = 0;
-
-	for (;;) {
-		seqptr_getsign(p, &bpm, &tpb);
-		seqptr_gettempo(p, &usec24);
-		delta = (where - meas) * bpm * tpb - beat * tpb - tick;
-		if (delta <= offs)
-			break;
-		delta -= offs;
-		if (!seqptr_eot(p)) {
-			delta = seqptr_ticskip(p, delta);
-			while (seqptr_evget(p))
-				; /* nothing */
-		}
-		tick += delta;
-		beat += tick / tpb;
-		tick = tick % tpb;
-		meas += beat / bpm;
-		beat = beat % bpm;
-		pos += (unsigned long long)delta * usec24;
-	}
+	tic = track_findmeasure(&o->meta, where);
+	tic = (tic > offs) ? tic - offs : 0;
+	pos = track_tictime(&o->meta, tic, NULL);
 
 	/* round to frame */
 	pos -= pos % (24000000ULL / DEFAULT_FPS);
@@ -1276,7 +1285,6 @@ song_mtcpos(struct song *o, unsigned where, unsigned offs)
 	/* wrap every 24 hours */
 	pos = pos % (24000000ULL * 36000 * 24);
 
-	seqptr_del(p);
 	return pos / (24000000ULL / MTC_SEC);
 }
 
@@ -1292,8 +1300,7 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 {
 	struct state *s;
 	struct songtrk *t;
-	unsigned maxdelta, delta;
-	unsigned bpm, tpb;
+	unsigned tic;
 	unsigned long long pos, endpos;
 	unsigned long usec24;
 
@@ -1302,7 +1309,7 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 
 	/* please gcc */
 	endpos = 0xdeadbeef;
-	maxdelta = 0xdeadbeef;
+	tic = 0;
 
 	/*
 	 * XXX: when not in LOC_MEAS and LOC_SPP modes, the MTC position
@@ -1311,57 +1318,30 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 
 	switch (how) {
 	case LOC_MEAS:
+		tic = track_findmeasure(&o->meta, where);
 		break;
 	case LOC_MTC:
 		endpos = (unsigned long long)where * (24000000 / MTC_SEC);
+		tic = track_timetic(&o->meta, endpos);
 		offs = 0;
 		break;
 	case LOC_SPP:
-		where *= o->tics_per_unit / 16;
+		tic = where * (o->tics_per_unit / 16);
 		offs = 0;
 		break;
 	default:
 		logx(1, "%s: bad argument", __func__);
 		panic();
 	}
-	pos = 0;
-	o->abspos = 0;
-	o->measure = o->beat = o->tic = 0;
-
-	for (;;) {
-		seqptr_getsign(o->metaptr, &bpm, &tpb);
-		seqptr_gettempo(o->metaptr, &usec24);
-		switch (how) {
-		case LOC_MEAS:
-			maxdelta = (where - o->measure) * bpm * tpb
-			    - o->beat * tpb
-			    - o->tic;
-			break;
-		case LOC_MTC:
-			maxdelta = (endpos - pos) / usec24;
-			break;
-		case LOC_SPP:
-			maxdelta = where - o->abspos;
-			break;
-		}
-		if (maxdelta <= offs)
-			break;
-		maxdelta -= offs;
-		delta = seqptr_ticskip(o->metaptr, maxdelta);
-		s = seqptr_evget(o->metaptr);
-		if (s == NULL) {
-			/* XXX: integrate this in ticskip() & co */
-			statelist_outdate(&o->metaptr->statelist);
-			delta = maxdelta;
-		}
-		o->tic += delta;
-		o->beat += o->tic / tpb;
-		o->tic = o->tic % tpb;
-		o->measure += o->beat / bpm;
-		o->beat = o->beat % bpm;
-		o->abspos += delta;
-		pos += (unsigned long long)delta * usec24;
-	}
+
+	/*
+	 * convert the position using the tempo and measure maps of the
+	 * meta track, and move the meta track to it
+	 */
+	o->abspos = (tic > offs) ? tic - offs : 0;
+	pos = track_tictime(&o->meta, o->abspos, &usec24);
+	track_measinfo(&o->meta, o->abspos, &o->measure, &o->beat, &o->tic);
+	(void)seqptr_skip(o->metaptr, o->abspos);
 
 	/*
 	 * process all meta events of the current tick,
@@ -1400,6 +1380,10 @@ song_loc(struct song *o, unsigned how, unsigned where, unsigned offs)
 		if (!seqptr_eot(t->trackptr))
 			o->complete = 0;
 	}
+	if (o->stream) {
+		if (smfstream_seek(o->stream, o->abspos, o->mode >= SONG_PLAY))
+			o->complete = 0;
+	}
 
 	if (o->mode >= SONG_REC)
 		track_clear(&o->rec);
@@ -1502,6 +1486,8 @@ song_setmode(struct song *o, unsigned newmode)
 			statelist_empty(&t->trackptr->statelist);
 			seqptr_del(t->trackptr);
 		}
+		if (o->stream)
+			smfstream_cancel(o->stream);
 		if (o->playptr)
 			seqptr_del(o->playptr);
 		statelist_empty(&o->rec_input);
@@ -1680,6 +1666,19 @@ song_try_mode(struct song *o, unsigned reqmode)
 	return 1;
 }
 
+/*
+ * songs streamed from a midi file have no tracks to save
+ */
+unsigned
+song_try_save(struct song *o)
+{
+	if (o->stream) {
+		logx(1, "song is played from a midi file, import it to save it");
+		return 0;
+	}
+	return 1;
+}
+
 unsigned
 song_try_curev(struct song *o)
 {
@@ -33,6 +33,7 @@ struct songchan;
 struct songfilt;
 struct songsx;
 struct undo;
+struct smfstream;
 
 struct songtrk {
 	struct name name;		/* identifier + list entry */
@@ -127,6 +128,8 @@ struct song {
 	unsigned loop_tstart;		/* loop start tick */
 	unsigned loop_tend;		/* loop end tick */
 	struct seqptr *loop_metaptr;	/* backup of metaptr */
+
+	struct smfstream *stream;	/* midi file played, not imported */
 };
 
 extern char *song_tap_modestr[3];
@@ -186,6 +189,8 @@ void song_setcurfilt(struct song *, struct songfilt *);
 void song_getcurchan(struct song *, struct songchan **, int);
 void song_setcurchan(struct song *, struct songchan *, int);
 unsigned song_endpos(struct song *);
+void song_confrestore(struct statelist *, int, unsigned);
+void song_confcancel(struct statelist *, unsigned);
 
 void song_setmode(struct song *, unsigned);
 void song_goto(struct song *, unsigned);
@@ -195,6 +200,7 @@ void song_idle(struct song *);
 void song_stop(struct song *);
 
 unsigned song_try_mode(struct song *, unsigned);
+unsigned song_try_save(struct song *);
 unsigned song_try_curev(struct song *);
 unsigned song_try_curpos(struct song *);
 unsigned song_try_curlen(struct song *);
@@ -26,8 +26,8 @@
  * state pool. In a typical performace, the maximum state list length
  * is roughly equal to the maximum sounding notes; the mean list
  * length is between 2 and 3 states and the maximum is between 10 and
- * 20 states. Currently we use a singly linked list, but for
- * performance reasons we shoud use a hash table in the future.
+ * 20 states. Currently we use a doubly linked list, and optionally
+ * (STATE_HASH) a hash table for streams with many concurrent frames.
  *
  */
 
@@ -307,12 +307,55 @@ state_restore(struct state *st, struct ev *rev)
 }
 
 
+#ifdef STATE_HASH
+/*
+ * return the hash bucket of the frame the given event belongs to.
+ * Events matched by ev_match() must hash to the same bucket, so
+ * only parameters compared by ev_match() are used.
+ */
+static unsigned
+state_hash(struct ev *ev)
+{
+	unsigned h;
+
+	switch (ev->cmd) {
+	case EV_NON:
+	case EV_NOFF:
+	case EV_KAT:
+		h = (EV_NON << 24) ^ (ev->dev << 16) ^ (ev->ch << 8) ^ ev->v0;
+		break;
+	case EV_CTL:
+	case EV_XCTL:
+	case EV_NRPN:
+	case EV_RPN:
+		h = (ev->cmd << 24) ^ (ev->dev << 16) ^ (ev->ch << 8) ^ ev->v0;
+		break;
+	case EV_PC:
+	case EV_BEND:
+	case EV_CAT:
+	case EV_XPC:
+		h = (ev->cmd << 24) ^ (ev->dev << 16) ^ (ev->ch << 8);
+		break;
+	default:
+		h = ev->cmd << 24;
+	}
+	h *= 2654435761U;
+	return h >> 26;
+}
+#endif
+
 /*
  * initialize an empty state list
  */
 void
 statelist_init(struct statelist *o)
 {
+#ifdef STATE_HASH
+	unsigned i;
+
+	for (i = 0; i < STATE_NHASH; i++)
+		o->hash[i] = NULL;
+#endif
 	o->first = NULL;
 	o->changed = 0;
 	o->serial = state_serial++;
@@ -375,6 +418,43 @@ statelist_dup(struct statelist *o, struct statelist *src)
 	}
 }
 
+/*
+ * copy all states (including fields private to other subsystems) of
+ * the given state list into the given empty list, preserving the
+ * ordering.
+ */
+void
+statelist_copy(struct statelist *dst, struct statelist *src)
+{
+	struct state *i, *n, **last;
+#ifdef STATE_HASH
+	struct state **hlast[STATE_NHASH];
+	unsigned h;
+
+	for (h = 0; h < STATE_NHASH; h++)
+		hlast[h] = &dst->hash[h];
+#endif
+	last = &dst->first;
+	for (i = src->first; i != NULL; i = i->next) {
+		n = state_new();
+		*n = *i;
+		n->prev = last;
+		*last = n;
+		last = &n->next;
+#ifdef STATE_HASH
+		h = state_hash(&n->ev);
+		*hlast[h] = n;
+		hlast[h] = &n->hnext;
+#endif
+	}
+	*last = NULL;
+#ifdef STATE_HASH
+	for (h = 0; h < STATE_NHASH; h++)
+		*hlast[h] = NULL;
+#endif
+	dst->changed = src->changed;
+}
+
 /*
  * remove and free all states from the state list
  */
@@ -391,11 +471,19 @@ statelist_empty(struct statelist *o)
 }
 
 /*
- * add a state to the state list
+ * add a state to the state list. The event of the state must be set,
+ * since it determines the hash bucket.
  */
 void
 statelist_add(struct statelist *o, struct state *st)
 {
+#ifdef STATE_HASH
+	unsigned h;
+
+	h = state_hash(&st->ev);
+	st->hnext = o->hash[h];
+	o->hash[h] = st;
+#endif
 	st->next = o->first;
 	st->prev = &o->first;
 	if (o->first)
@@ -410,6 +498,13 @@ statelist_add(struct statelist *o, struct state *st)
 void
 statelist_rm(struct statelist *o, struct state *st)
 {
+#ifdef STATE_HASH
+	struct state **p;
+
+	for (p = &o->hash[state_hash(&st->ev)]; *p != st; p = &(*p)->hnext)
+		; /* nothing */
+	*p = st->hnext;
+#endif
 	*st->prev = st->next;
 	if (st->next)
 		st->next->prev = st->prev;
@@ -423,7 +518,12 @@ struct state *
 statelist_lookup(struct statelist *o, struct ev *ev)
 {
 	struct state *i;
+
+#ifdef STATE_HASH
+	for (i = o->hash[state_hash(ev)]; i != NULL; i = i->hnext) {
+#else
 	for (i = o->first; i != NULL; i = i->next) {
+#endif
 		if (state_match(i, ev)) {
 			break;
 		}
@@ -447,16 +547,25 @@ statelist_update(struct statelist *statelist, struct ev *ev)
 
 	phase = ev_phase(ev);
 
+#ifdef STATE_HASH
+	st = statelist->hash[state_hash(ev)];
+#else
 	st = statelist->first;
+#endif
 	for (;;) {
 		if (st == NULL) {
 			st = state_new();
 			st->flags = STATE_NEW;
+			st->ev = *ev;
 			statelist_add(statelist, st);
 			break;
 		}
 
+#ifdef STATE_HASH
+		stnext = st->hnext;
+#else
 		stnext = st->next;
+#endif
 
 		if (state_match(st, ev)) {
 			if (!(st->phase == EV_PHASE_LAST) &&
@@ -476,6 +585,7 @@ statelist_update(struct statelist *statelist, struct ev *ev)
 		if (st->flags != STATE_NEW) {
 			st = state_new();
 			st->flags = STATE_NEW | STATE_NESTED;
+			st->ev = *ev;
 			statelist_add(statelist, st);
 #ifdef STATE_DEBUG
 			logx(1, "%s: {ev:%p}: stacked (nested)", __func__, ev);
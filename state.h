@@ -23,8 +23,16 @@
 struct seqev;
 struct statelist;
 
+/*
+ * number of hash buckets of a statelist, if built with STATE_HASH
+ */
+#define STATE_NHASH	64
+
 struct state  {
 	struct state *next, **prev;	/* for statelist */
+#ifdef STATE_HASH
+	struct state *hnext;		/* next in the hash bucket */
+#endif
 	struct ev ev;			/* last event */
 	unsigned phase;			/* current phase (of the 'ev' field) */
 	/*
@@ -53,13 +61,19 @@ struct state  {
 
 struct statelist {
 	/*
-	 * instead of a simple list, we should use a hash table here,
-	 * but statistics on real-life cases seem to show that lookups
+	 * statistics on real-life cases seem to show that lookups
 	 * are very fast thanks to the state ordering (average lookup
 	 * time is around 1-2 iterations for a common MIDI file), so
-	 * we keep using a simple list
+	 * by default we use a simple list. Dense streams (many
+	 * sustained notes, many NRPN/XCTL frames) make lookups
+	 * linear, so if built with STATE_HASH, states are also
+	 * linked to hash buckets keyed on the frame the events belong
+	 * to. Buckets keep the list ordering.
 	 */
 	struct state *first;	/* head of the state list */
+#ifdef STATE_HASH
+	struct state *hash[STATE_NHASH];
+#endif
 	unsigned changed;	/* if changed within this tick */
 	unsigned serial;	/* unique ID */
 #ifdef STATE_PROF
@@ -83,6 +97,7 @@ void	      statelist_init(struct statelist *);
 void	      statelist_done(struct statelist *);
 void	      statelist_dump(struct statelist *);
 void	      statelist_dup(struct statelist *, struct statelist *);
+void	      statelist_copy(struct statelist *, struct statelist *);
 void	      statelist_empty(struct statelist *);
 void	      statelist_add(struct statelist *, struct state *);
 void	      statelist_rm(struct statelist *, struct state *);
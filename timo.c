@@ -32,15 +32,118 @@
  *	the timeout can be aborted with timo_del(), it is OK to try to
  *	abort a timout that has expired
  *
+ * Scheduled timeouts are kept in a binary heap ordered by expiration
+ * time, so adding and removing a timeout takes O(log n) and checking
+ * for expired timeouts O(1). Timeouts expiring at the same time are
+ * called in the order they were added.
  */
 
+#include <string.h>
 #include "utils.h"
 #include "timo.h"
 
+/*
+ * initial size of the heap, it's doubled when full
+ */
+#define TIMO_HEAPMIN	32
+
 unsigned timo_debug = 0;
-struct timo *timo_queue;
+struct timo **timo_heap;
+unsigned timo_nheap, timo_maxheap;
+unsigned timo_seq;
 unsigned timo_abstime;
 
+/*
+ * return true if the 'a' timeout expires before 'b'. There is no
+ * overflow here because + and - are modulo 2^32, they are the same
+ * for both signed and unsigned integers
+ */
+static int
+timo_before(struct timo *a, struct timo *b)
+{
+	int diff;
+
+	diff = a->val - b->val;
+	if (diff != 0)
+		return diff < 0;
+	diff = a->seq - b->seq;
+	return diff < 0;
+}
+
+/*
+ * store the timeout at the given heap position
+ */
+static void
+timo_heapput(struct timo *o, unsigned idx)
+{
+	timo_heap[idx] = o;
+	o->idx = idx;
+}
+
+/*
+ * move the timeout at the given position toward the root until the
+ * heap order is restored
+ */
+static void
+timo_heapup(unsigned idx)
+{
+	struct timo *o = timo_heap[idx];
+	unsigned parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (!timo_before(o, timo_heap[parent]))
+			break;
+		timo_heapput(timo_heap[parent], idx);
+		idx = parent;
+	}
+	timo_heapput(o, idx);
+}
+
+/*
+ * move the timeout at the given position toward the leaves until the
+ * heap order is restored
+ */
+static void
+timo_heapdown(unsigned idx)
+{
+	struct timo *o = timo_heap[idx];
+	unsigned child;
+
+	for (;;) {
+		child = 2 * idx + 1;
+		if (child >= timo_nheap)
+			break;
+		if (child + 1 < timo_nheap &&
+		    timo_before(timo_heap[child + 1], timo_heap[child]))
+			child++;
+		if (!timo_before(timo_heap[child], o))
+			break;
+		timo_heapput(timo_heap[child], idx);
+		idx = child;
+	}
+	timo_heapput(o, idx);
+}
+
+/*
+ * remove the timeout at the given heap position
+ */
+static void
+timo_heaprm(unsigned idx)
+{
+	struct timo *last;
+
+	timo_heap[idx]->set = 0;
+	last = timo_heap[--timo_nheap];
+	if (idx == timo_nheap)
+		return;
+	timo_heapput(last, idx);
+	if (idx > 0 && timo_before(last, timo_heap[(idx - 1) / 2]))
+		timo_heapup(idx);
+	else
+		timo_heapdown(idx);
+}
+
 /*
  * initialise a timeout structure, arguments are callback and argument
  * that will be passed to the callback
@@ -60,9 +163,7 @@ timo_set(struct timo *o, void (*cb)(void *), void *arg)
 void
 timo_add(struct timo *o, unsigned delta)
 {
-	struct timo **i;
-	unsigned val;
-	int diff;
+	struct timo **heap;
 
 #ifdef TIMO_DEBUG
 	if (o->set) {
@@ -74,17 +175,23 @@ timo_add(struct timo *o, unsigned delta)
 		panic();
 	}
 #endif
-	val = timo_abstime + delta;
-	for (i = &timo_queue; *i != NULL; i = &(*i)->next) {
-		diff = (*i)->val - val;
-		if (diff > 0) {
-			break;
+	if (timo_nheap == timo_maxheap) {
+		timo_maxheap = (timo_maxheap == 0) ?
+		    TIMO_HEAPMIN : 2 * timo_maxheap;
+		heap = xmalloc(timo_maxheap * sizeof(struct timo *), "timo");
+		if (timo_nheap > 0) {
+			memcpy(heap, timo_heap,
+			    timo_nheap * sizeof(struct timo *));
 		}
+		if (timo_heap)
+			xfree(timo_heap);
+		timo_heap = heap;
 	}
 	o->set = 1;
-	o->val = val;
-	o->next = *i;
-	*i = o;
+	o->val = timo_abstime + delta;
+	o->seq = timo_seq++;
+	timo_heap[timo_nheap] = o;
+	timo_heapup(timo_nheap++);
 }
 
 /*
@@ -93,17 +200,12 @@ timo_add(struct timo *o, unsigned delta)
 void
 timo_del(struct timo *o)
 {
-	struct timo **i;
-
-	for (i = &timo_queue; *i != NULL; i = &(*i)->next) {
-		if (*i == o) {
-			*i = o->next;
-			o->set = 0;
-			return;
-		}
+	if (!o->set) {
+		if (timo_debug)
+			logx(1, "%s: not found", __func__);
+		return;
 	}
-	if (timo_debug)
-		logx(1, "%s: not found", __func__);
+	timo_heaprm(o->idx);
 }
 
 /*
@@ -125,29 +227,41 @@ timo_update(unsigned delta)
 	/*
 	 * remove from the queue and run expired timeouts
 	 */
-	while (timo_queue != NULL) {
-		/*
-		 * there is no overflow here because + and - are
-		 * modulo 2^32, they are the same for both signed and
-		 * unsigned integers
-		 */
-		diff = timo_queue->val - timo_abstime;
+	while (timo_nheap > 0) {
+		to = timo_heap[0];
+		diff = to->val - timo_abstime;
 		if (diff > 0)
 			break;
-		to = timo_queue;
-		timo_queue = to->next;
-		to->set = 0;
+		timo_heaprm(0);
 		to->cb(to->arg);
 	}
 }
 
+/*
+ * store in the given location the time until the next timeout
+ * expires. Return 0 if there are no timeouts
+ */
+int
+timo_next(unsigned *delta)
+{
+	int diff;
+
+	if (timo_nheap == 0)
+		return 0;
+	diff = timo_heap[0]->val - timo_abstime;
+	*delta = diff > 0 ? diff : 0;
+	return 1;
+}
+
 /*
  * initialize timeout queue
  */
 void
 timo_init(void)
 {
-	timo_queue = NULL;
+	timo_heap = NULL;
+	timo_nheap = timo_maxheap = 0;
+	timo_seq = 0;
 	timo_abstime = 0;
 }
 
@@ -157,9 +271,12 @@ timo_init(void)
 void
 timo_done(void)
 {
-	if (timo_queue != NULL) {
-		logx(1, "%s: timo_queue not empty!", __func__);
+	if (timo_nheap != 0) {
+		logx(1, "%s: timeouts still pending", __func__);
 		panic();
 	}
-	timo_queue = (struct timo *)0xdeadbeef;
+	if (timo_heap) {
+		xfree(timo_heap);
+		timo_heap = NULL;
+	}
 }
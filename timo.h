@@ -18,9 +18,10 @@
 #define MIDISH_TIMO_H
 
 struct timo {
-	struct timo *next;
-	unsigned val;			/* time to wait before the callback */
+	unsigned val;			/* absolute expiration time */
+	unsigned seq;			/* order of timo_add() calls */
 	unsigned set;			/* true if the timeout is set */
+	unsigned idx;			/* index in the heap, if set */
 	void (*cb)(void *arg);		/* routine to call on expiration */
 	void *arg;			/* argument to give to 'cb' */
 };
@@ -29,6 +30,7 @@ void timo_set(struct timo *, void (*)(void *), void *);
 void timo_add(struct timo *, unsigned);
 void timo_del(struct timo *);
 void timo_update(unsigned);
+int timo_next(unsigned *);
 void timo_init(void);
 void timo_done(void);
 
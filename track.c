@@ -27,12 +27,26 @@
  *	- each clock tick marks the begining of a delta
  *	- each event (struct ev) is played after delta ticks
  *
+ * To avoid walking the whole list when seeking far from the
+ * beginning of a long track, the track has an optional time index:
+ * an array of positions (and the corresponding track states) saved
+ * by seqptr_skip() every few events. Tracks containing tempo and
+ * time signature changes also have tempo and measure maps used
+ * to convert between measures, tics and absolute time. The index and
+ * the maps are built lazily and must be dropped with track_idxclear()
+ * whenever the track is modified.
  */
 
+#include <string.h>
 #include "utils.h"
 #include "pool.h"
 #include "track.h"
 
+/*
+ * initial number of entries of the time index
+ */
+#define TRACK_IDXMIN	64
+
 struct pool seqev_pool;
 
 void
@@ -60,6 +74,65 @@ seqev_del(struct seqev *se)
 	pool_del(&seqev_pool, se);
 }
 
+/*
+ * store the given delta and event in packed form
+ */
+void
+seqev_pack(struct seqev_data *d, unsigned delta, struct ev *ev)
+{
+#ifdef TRACK_DEBUG
+	if (ev->v0 > SEQEV_DATA_MAXV0 || ev->v1 > 0xffff) {
+		logx(1, "%s: {ev:%p}: value out of range", __func__, ev);
+		panic();
+	}
+#endif
+	d->delta = delta;
+	d->cmd = ev->cmd;
+	d->dev = ev->dev;
+	d->ch = ev->ch;
+	d->v0 = ev->v0 & 0xffff;
+	d->v0_hi = ev->v0 >> 16;
+	d->v1 = ev->v1;
+}
+
+/*
+ * extract the event of the given packed entry, return its delta
+ */
+unsigned
+seqev_unpack(struct seqev_data *d, struct ev *ev)
+{
+	ev->cmd = d->cmd;
+	ev->dev = d->dev;
+	ev->ch = d->ch;
+	ev->v0 = d->v0 | (d->v0_hi << 16);
+	ev->v1 = d->v1;
+	return d->delta;
+}
+
+/*
+ * return true if both packed entries have the same delta and
+ * the same event
+ */
+unsigned
+seqev_dataeq(struct seqev_data *d1, struct seqev_data *d2)
+{
+	struct ev ev1, ev2;
+
+	if (d1->delta != d2->delta)
+		return 0;
+	if (d1->cmd != d2->cmd || d1->dev != d2->dev || d1->ch != d2->ch ||
+	    d1->v0 != d2->v0 || d1->v0_hi != d2->v0_hi || d1->v1 != d2->v1) {
+		/*
+		 * unused parameters may differ, fallback to
+		 * the slow path
+		 */
+		seqev_unpack(d1, &ev1);
+		seqev_unpack(d2, &ev2);
+		return ev_eq(&ev1, &ev2);
+	}
+	return 1;
+}
+
 /*
  * initialise the track
  */
@@ -71,6 +144,12 @@ track_init(struct track *o)
 	o->eot.next = NULL;
 	o->eot.prev = &o->first;
 	o->first = &o->eot;
+	o->idx = NULL;
+	o->nidx = o->maxidx = 0;
+	o->meas = NULL;
+	o->nmeas = 0;
+	o->tempo = NULL;
+	o->ntempo = 0;
 }
 
 /*
@@ -81,6 +160,8 @@ track_done(struct track *o)
 {
 	struct seqev *i, *inext;
 
+	track_idxclear(o);
+
 	for (i = o->first;  i != &o->eot;  i = inext) {
 		inext = i->next;
 		seqev_del(i);
@@ -121,6 +202,7 @@ track_isempty(struct track *o)
 void
 track_chomp(struct track *o)
 {
+	track_idxclear(o);
 	o->eot.delta = 0;
 }
 
@@ -130,6 +212,7 @@ track_chomp(struct track *o)
 void
 track_shift(struct track *o, unsigned ntics)
 {
+	track_idxclear(o);
 	o->first->delta += ntics;
 }
 
@@ -141,6 +224,9 @@ track_swap(struct track *t1, struct track *t2)
 {
 	struct seqev *se, eot;
 
+	track_idxclear(t1);
+	track_idxclear(t2);
+
 	/* swap list of events */
 	se = t1->first;
 	t1->first = t2->first;
@@ -158,6 +244,87 @@ track_swap(struct track *t1, struct track *t2)
 	*t2->eot.prev = &t2->eot;
 }
 
+/*
+ * drop the time index and the tempo and measure maps, must be called
+ * when the track is modified
+ */
+void
+track_idxclear(struct track *o)
+{
+	unsigned i;
+
+	if (o->meas) {
+		xfree(o->meas);
+		o->meas = NULL;
+		o->nmeas = 0;
+	}
+	if (o->tempo) {
+		xfree(o->tempo);
+		o->tempo = NULL;
+		o->ntempo = 0;
+	}
+	if (o->idx == NULL)
+		return;
+	for (i = 0; i < o->nidx; i++)
+		statelist_empty(&o->idx[i].statelist);
+	xfree(o->idx);
+	o->idx = NULL;
+	o->nidx = o->maxidx = 0;
+}
+
+/*
+ * append an entry to the time index, growing it if necessary, and
+ * return a pointer to it. The caller must fill it, entries must be
+ * added in increasing tic order
+ */
+struct trackidx *
+track_idxadd(struct track *o)
+{
+	struct trackidx *idx;
+	unsigned i;
+
+	if (o->nidx == o->maxidx) {
+		o->maxidx = o->maxidx == 0 ? TRACK_IDXMIN : 2 * o->maxidx;
+		idx = xmalloc(o->maxidx * sizeof(struct trackidx), "trackidx");
+		if (o->idx) {
+			memcpy(idx, o->idx, o->nidx * sizeof(struct trackidx));
+			xfree(o->idx);
+		}
+		/*
+		 * statelists moved, so fix back-pointers of their
+		 * first states
+		 */
+		for (i = 0; i < o->nidx; i++) {
+			if (idx[i].statelist.first)
+				idx[i].statelist.first->prev =
+				    &idx[i].statelist.first;
+		}
+		o->idx = idx;
+	}
+	return &o->idx[o->nidx++];
+}
+
+/*
+ * return the last index entry at or before the given tic,
+ * or NULL if there's none
+ */
+struct trackidx *
+track_idxfind(struct track *o, unsigned tic)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = o->nidx;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (o->idx[mid].tic <= tic)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 ? &o->idx[lo - 1] : NULL;
+}
+
 /*
  * return true if an event is available on the track
  */
@@ -170,7 +337,8 @@ seqev_avail(struct seqev *pos)
 /*
  * insert an event (stored in an already allocated seqev structure)
  * just before the event of the given position (the delta field of the
- * given event is ignored)
+ * given event is ignored). The caller must drop the time index of
+ * the track.
  */
 void
 seqev_ins(struct seqev *pos, struct seqev *se)
@@ -185,7 +353,8 @@ seqev_ins(struct seqev *pos, struct seqev *se)
 }
 
 /*
- * remove the event (but not blank space) on the given position
+ * remove the event (but not blank space) on the given position. The
+ * caller must drop the time index of the track.
  */
 void
 seqev_rm(struct seqev *pos)
@@ -243,6 +412,7 @@ track_clear(struct track *o)
 {
 	struct seqev *i, *inext;
 
+	track_idxclear(o);
 	for (i = o->first;  i != &o->eot;  i = inext) {
 		inext = i->next;
 		seqev_del(i);
@@ -261,6 +431,7 @@ track_setchan(struct track *src, unsigned dev, unsigned ch)
 {
 	struct seqev *i;
 
+	track_idxclear(src);
 	for (i = src->first; i != NULL; i = i->next) {
 		if (EV_ISVOICE(&i->ev)) {
 			i->ev.dev = dev;
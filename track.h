@@ -18,6 +18,7 @@
 #define MIDISH_TRACK_H
 
 #include "ev.h"
+#include "state.h"
 
 struct seqev {
 	unsigned delta;
@@ -25,16 +26,62 @@ struct seqev {
 	struct seqev *next, **prev;
 };
 
+/*
+ * saved position of a seqptr that walked the track from its
+ * beginning, see seqptr_skip()
+ */
+struct trackidx {
+	unsigned tic;			/* absolute tic */
+	struct seqev *pos;		/* next event */
+	unsigned delta;			/* tics since the previous event */
+	struct statelist statelist;	/* track state at this position */
+};
+
+/*
+ * time signature in effect from the given measure
+ */
+struct trackmeas {
+	unsigned meas;			/* first measure */
+	unsigned tic;			/* absolute tic of the measure */
+	unsigned bpm, tpb;		/* beats per measure, tics per beat */
+};
+
+/*
+ * tempo in effect from the given tic
+ */
+struct tracktempo {
+	unsigned tic;			/* absolute tic of the change */
+	unsigned long usec24;		/* tic length */
+	unsigned long long time;	/* absolute time of the tic */
+};
+
 struct track {
 	struct seqev eot;		/* end-of-track event */
 	struct seqev *first;		/* head of the event list */
+	struct trackidx *idx;		/* time index, sorted by tic */
+	unsigned nidx, maxidx;		/* used and allocated idx entries */
+	struct trackmeas *meas;		/* measure map, sorted by measure */
+	unsigned nmeas;			/* entries in measure map */
+	struct tracktempo *tempo;	/* tempo map, sorted by tic */
+	unsigned ntempo;		/* entries in tempo map */
 };
 
+/*
+ * packed event with its delta, as stored in undo data and in binary
+ * song files. It takes 12 bytes instead of the 32 bytes of a seqev.
+ * The v0 parameter may be up to 24-bit wide (tempo), the v1
+ * parameter is 16-bit wide (EV_UNDEF fits).
+ */
+struct seqev_data {
+	unsigned delta;
+	unsigned short v0, v1;
+	unsigned char cmd, dev, ch, v0_hi;
+};
+
+#define SEQEV_DATA_MAXV0	0xffffff
+
 struct track_data {
-	struct seqev_data {
-		unsigned delta;
-		struct ev ev;
-	} *evs;
+	struct seqev_data *evs;
 	unsigned int pos, nrm, nins;
 };
 
@@ -43,6 +90,9 @@ void	      seqev_pool_done(void);
 struct seqev *seqev_new(void);
 void	      seqev_del(struct seqev *);
 void	      seqev_dump(struct seqev *);
+void	      seqev_pack(struct seqev_data *, unsigned, struct ev *);
+unsigned      seqev_unpack(struct seqev_data *, struct ev *);
+unsigned      seqev_dataeq(struct seqev_data *, struct seqev_data *);
 
 void	      track_init(struct track *);
 void	      track_done(struct track *);
@@ -54,6 +104,9 @@ unsigned      track_isempty(struct track *);
 void	      track_chomp(struct track *);
 void	      track_shift(struct track *, unsigned);
 void	      track_swap(struct track *, struct track *);
+void	      track_idxclear(struct track *);
+struct trackidx *track_idxadd(struct track *);
+struct trackidx *track_idxfind(struct track *, unsigned);
 
 unsigned      seqev_avail(struct seqev *);
 void	      seqev_ins(struct seqev *, struct seqev *);
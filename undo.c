@@ -331,8 +331,7 @@ track_undosave(struct track *t, struct track_data *u)
 	u->evs = xmalloc(size, "track_data");
 	e = u->evs;
 	for (i = t->first; i != NULL; i = i->next) {
-		e->delta = i->delta;
-		e->ev = i->ev;
+		seqev_pack(e, i->delta, &i->ev);
 		e++;
 	}
 	u->pos = 0;
@@ -350,9 +349,7 @@ track_diff(struct track_data *u1, struct track_data *u2,
 	while (1) {
 		if (start == u1->nins || start == u2->nins)
 			break;
-		if (u1->evs[start].delta != u2->evs[start].delta)
-			break;
-		if (!ev_eq(&u1->evs[start].ev, &u2->evs[start].ev))
+		if (!seqev_dataeq(&u1->evs[start], &u2->evs[start]))
 			break;
 		start++;
 	}
@@ -362,9 +359,7 @@ track_diff(struct track_data *u1, struct track_data *u2,
 	while (1) {
 		if (end1 == start || end2 == start)
 			break;
-		if (u1->evs[end1 - 1].delta != u2->evs[end2 - 1].delta)
-			break;
-		if (!ev_eq(&u1->evs[end1 - 1].ev, &u2->evs[end2 - 1].ev))
+		if (!seqev_dataeq(&u1->evs[end1 - 1], &u2->evs[end2 - 1]))
 			break;
 		end1--;
 		end2--;
@@ -403,6 +398,8 @@ track_undorestore(struct track *t, struct track_data *u)
 	struct seqev *pos, *se;
 	struct seqev_data *e;
 
+	track_idxclear(t);
+
 	/* go to pos */
 	pos = t->first;
 	for (n = u->pos; n > 0; n--)
@@ -430,7 +427,7 @@ track_undorestore(struct track *t, struct track_data *u)
 	/* insert events that were removed */
 	e = u->evs;
 	for (n = u->nrm; n > 0; n--) {
-		if (e->ev.cmd == EV_NULL) {
+		if (e->cmd == EV_NULL) {
 			if (n != 1) {
 				logx(1, "%s: can't insert eot event", __func__);
 				panic();
@@ -439,8 +436,7 @@ track_undorestore(struct track *t, struct track_data *u)
 			break;
 		}
 		se = seqev_new();
-		se->ev = e->ev;
-		se->delta = e->delta;
+		se->delta = seqev_unpack(e, &se->ev);
 		e++;
 
 		/* insert seqev */
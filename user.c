@@ -957,6 +957,9 @@ user_mainloop(void)
 	exec_newbuiltin(exec, "version", blt_version, NULL);
 	exec_newbuiltin(exec, "panic", blt_panic, NULL);
 	exec_newbuiltin(exec, "info", blt_info, NULL);
+	exec_newbuiltin(exec, "meminfo", blt_meminfo, NULL);
+	exec_newbuiltin(exec, "timeinfo", blt_timeinfo, NULL);
+	exec_newbuiltin(exec, "timeclr", blt_timeclr, NULL);
 
 	exec_newbuiltin(exec, "getunit", blt_getunit, NULL);
 	exec_newbuiltin(exec, "setunit", blt_setunit,
@@ -1003,15 +1006,21 @@ user_mainloop(void)
 			name_newarg("filename", NULL));
 	exec_newbuiltin(exec, "load", blt_load,
 			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "bsave", blt_bsave,
+			name_newarg("filename", NULL));
 	exec_newbuiltin(exec, "reset", blt_reset, NULL);
 	exec_newbuiltin(exec, "export", blt_export,
 			name_newarg("filename", NULL));
 	exec_newbuiltin(exec, "import", blt_import,
 			name_newarg("filename", NULL));
+	exec_newbuiltin(exec, "stream", blt_stream,
+			name_newarg("filename", NULL));
 	exec_newbuiltin(exec, "i", blt_idle, NULL);
 	exec_newbuiltin(exec, "p", blt_play, NULL);
 	exec_newbuiltin(exec, "r", blt_rec, NULL);
 	exec_newbuiltin(exec, "s", blt_stop, NULL);
+	exec_newbuiltin(exec, "render", blt_render,
+			name_newarg("filename", NULL));
 	exec_newbuiltin(exec, "t", blt_tempo,
 			name_newarg("beats_per_minute", NULL));
 	exec_newbuiltin(exec, "mins", blt_mins,
@@ -1209,6 +1218,12 @@ user_mainloop(void)
 	exec_newbuiltin(exec, "dclkrate", blt_dclkrate,
 			name_newarg("devnum",
 			name_newarg("tics_per_unit", NULL)));
+	exec_newbuiltin(exec, "dbaud", blt_dbaud,
+			name_newarg("devnum",
+			name_newarg("baud", NULL)));
+	exec_newbuiltin(exec, "dlookahead", blt_dlookahead,
+			name_newarg("devnum",
+			name_newarg("msecs", NULL)));
 	exec_newbuiltin(exec, "dinfo", blt_dinfo,
 			name_newarg("devnum", NULL));
 	exec_newbuiltin(exec, "dixctl", blt_dixctl,
@@ -1246,8 +1261,10 @@ user_mainloop(void)
 	while (!done && mux_mdep_wait(1))
 		; /* nothing */
 
+	mux_mdep_lock();
 	song_delete(usong);
 	usong = NULL;
+	mux_mdep_unlock();
 	lex_done(&parse);
 	parse_done(&parse);
 	exec_delete(exec);
@@ -28,6 +28,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#ifdef USE_RTTHREAD
+#include <pthread.h>
+#endif
 #include "utils.h"
 #include "ev.h"
 #include "data.h"
@@ -35,17 +38,67 @@
 #include "state.h"
 #include "tty.h"
 
-/*
- * log buffer size
- */
-#define LOG_BUFSZ	8192
-
 char log_buf[LOG_BUFSZ];	/* buffer where traces are stored */
 size_t log_used = 0;		/* bytes used in the buffer */
 unsigned int log_sync = 1;	/* if true, flush after each '\n' */
 
 int log_level = 1;
 
+#ifdef USE_RTTHREAD
+/*
+ * the real-time thread logs and allocates memory while the main
+ * thread runs the parser, so protect the log buffer and the
+ * xmalloc() usage counters
+ */
+pthread_mutex_t log_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mem_mtx = PTHREAD_MUTEX_INITIALIZER;
+#define LOG_LOCK()	pthread_mutex_lock(&log_mtx)
+#define LOG_UNLOCK()	pthread_mutex_unlock(&log_mtx)
+#define MEM_LOCK()	pthread_mutex_lock(&mem_mtx)
+#define MEM_UNLOCK()	pthread_mutex_unlock(&mem_mtx)
+#else
+#define LOG_LOCK()	do {} while (0)
+#define LOG_UNLOCK()	do {} while (0)
+#define MEM_LOCK()	do {} while (0)
+#define MEM_UNLOCK()	do {} while (0)
+#endif
+
+/*
+ * max number of distinct xmalloc() tags, blocks with extra
+ * tags are accounted in the last one
+ */
+#define MEM_NSTAT	64
+
+/*
+ * header stored before each block allocated with xmalloc(), so
+ * xfree() knows its size and its tag
+ */
+union mem_hdr {
+	struct {
+		struct mem_stat *stat;
+		size_t size;
+	} h;
+	long double align;		/* for alignment only */
+};
+
+/*
+ * cache of looked up tags, indexed by a hash of the tag pointer, so
+ * the usage table is scanned only the first time a tag is used at
+ * given address (ie. in a given file)
+ */
+#define MEM_NCACHE	256
+#define MEM_HASH(tag) \
+	((((uintptr_t)(tag) >> 3) ^ ((uintptr_t)(tag) >> 11)) & (MEM_NCACHE - 1))
+
+struct mem_cache {
+	char *tag;
+	struct mem_stat *stat;
+};
+
+struct mem_stat mem_stat[MEM_NSTAT];
+unsigned mem_nstat = 0;
+struct mem_cache mem_cache[MEM_NCACHE];
+
 size_t
 hexdump_fmt(char *buf, size_t size, unsigned char *blob, size_t blob_size)
 {
@@ -83,11 +136,30 @@ log_fmt(char *buf, size_t size, const char *fmt, union snfmt_arg *args)
 void
 log_flush(void)
 {
-	if (log_used == 0)
-		return;
-	el_hide();
-	write(STDERR_FILENO, log_buf, log_used);
+	LOG_LOCK();
+	if (log_used > 0) {
+		el_hide();
+		write(STDERR_FILENO, log_buf, log_used);
+		log_used = 0;
+	}
+	LOG_UNLOCK();
+}
+
+/*
+ * move the contents of the log buffer to the given buffer and return
+ * the number of bytes moved, so the caller can write it later
+ */
+size_t
+log_take(char *buf, size_t size)
+{
+	size_t n;
+
+	LOG_LOCK();
+	n = log_used < size ? log_used : size;
+	memcpy(buf, log_buf, n);
 	log_used = 0;
+	LOG_UNLOCK();
+	return n;
 }
 
 /*
@@ -99,6 +171,7 @@ log_do(const char *fmt, ...)
 	va_list ap;
 	int n, save_errno = errno;
 
+	LOG_LOCK();
 	va_start(ap, fmt);
 	n = snfmt_va(log_fmt, log_buf + log_used, sizeof(log_buf) - log_used, fmt, ap);
 	va_end(ap);
@@ -109,10 +182,10 @@ log_do(const char *fmt, ...)
 		if (log_used >= sizeof(log_buf))
 			log_used = sizeof(log_buf) - 1;
 		log_buf[log_used++] = '\n';
-
-		if (log_sync)
-			log_flush();
 	}
+	LOG_UNLOCK();
+	if (n != -1 && log_sync)
+		log_flush();
 	errno = save_errno;
 }
 
@@ -127,6 +200,38 @@ panic(void)
 	_exit(1);
 }
 
+/*
+ * return the usage structure of the given xmalloc() tag. Tags are
+ * string literals, so they are found by address in the cache, except
+ * the first time
+ */
+static struct mem_stat *
+mem_getstat(char *tag)
+{
+	struct mem_cache *c;
+	struct mem_stat *s;
+
+	c = &mem_cache[MEM_HASH(tag)];
+	if (c->tag == tag)
+		return c->stat;
+	for (s = mem_stat; s != mem_stat + mem_nstat; s++) {
+		if (s->tag == tag || strcmp(s->tag, tag) == 0)
+			goto found;
+	}
+	if (mem_nstat == MEM_NSTAT) {
+		s = mem_stat + MEM_NSTAT - 1;
+		goto found;
+	}
+	s->tag = (mem_nstat == MEM_NSTAT - 1) ? "other" : tag;
+	s->used = s->maxused = 0;
+	s->newcnt = s->lastcnt = 0;
+	mem_nstat++;
+found:
+	c->tag = tag;
+	c->stat = s;
+	return s;
+}
+
 /*
  * allocate 'size' bytes of memory (with size > 0). This functions never
  * fails (and never returns NULL), if there isn't enough memory then
@@ -135,14 +240,24 @@ panic(void)
 void *
 xmalloc(size_t size, char *tag)
 {
-	void *p;
+	union mem_hdr *p;
+	struct mem_stat *s;
 
-	p = malloc(size);
+	p = malloc(sizeof(union mem_hdr) + size);
 	if (p == NULL) {
 		logx(1, "failed to allocate %zu bytes", size);
 		panic();
 	}
-	return p;
+	MEM_LOCK();
+	s = mem_getstat(tag);
+	s->used += size;
+	if (s->used > s->maxused)
+		s->maxused = s->used;
+	s->newcnt++;
+	MEM_UNLOCK();
+	p->h.stat = s;
+	p->h.size = size;
+	return p + 1;
 }
 
 /*
@@ -151,13 +266,43 @@ xmalloc(size_t size, char *tag)
 void
 xfree(void *p)
 {
+	union mem_hdr *h;
+
 #ifdef DEBUG
 	if (p == NULL) {
 		logx(1, "xfree with NULL arg");
 		panic();
 	}
 #endif
-	free(p);
+	if (p == NULL)
+		return;
+	h = (union mem_hdr *)p - 1;
+	MEM_LOCK();
+	h->h.stat->used -= h->h.size;
+	MEM_UNLOCK();
+	free(h);
+}
+
+/*
+ * display memory usage of each xmalloc() tag: current and max
+ * bytes allocated, and number of allocations (total and since
+ * the last call)
+ */
+void
+mem_dumpstats(void)
+{
+	struct mem_stat *s;
+
+	logx(1, "%-12s %10s %10s %10s %10s",
+	    "tag", "used", "max", "allocs", "new");
+	for (s = mem_stat; s != mem_stat + mem_nstat; s++) {
+		logx(1, "%-12s %8zukB %8zukB %10lu %10lu",
+		    s->tag,
+		    (s->used + 1023) / 1024,
+		    (s->maxused + 1023) / 1024,
+		    s->newcnt, s->newcnt - s->lastcnt);
+		s->lastcnt = s->newcnt;
+	}
 }
 
 /*
@@ -19,12 +19,28 @@
 
 #include <stddef.h>
 
+/*
+ * log buffer size
+ */
+#define LOG_BUFSZ	8192
+
 #define logx(n, ...)						\
 	do {							\
 		if (log_level >= (n))				\
 			log_do(__VA_ARGS__);			\
 	} while (0)
 
+/*
+ * memory usage of blocks allocated with xmalloc() using the same tag
+ */
+struct mem_stat {
+	char *tag;			/* tag passed to xmalloc() */
+	size_t used;			/* bytes currently allocated */
+	size_t maxused;			/* max bytes allocated */
+	unsigned long newcnt;		/* total blocks allocated */
+	unsigned long lastcnt;		/* newcnt at last mem_dumpstats() */
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,10 +48,12 @@ extern "C" {
 void log_do(const char *, ...) __attribute__((__format__ (printf, 1, 2)));
 void panic(void);
 void log_flush(void);
+size_t log_take(char *, size_t);
 
 void *xmalloc(size_t, char *);
 char *xstrdup(char *, char *);
 void xfree(void *);
+void mem_dumpstats(void);
 
 #ifdef __cplusplus
 }
@@ -53,5 +71,6 @@ void xfree(void *);
 extern int log_level;
 
 extern unsigned log_sync;
+extern size_t log_used;
 
 #endif /* UTILS_H */
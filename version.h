@@ -0,0 +1 @@
+#define VERSION "midish (unknown release)"